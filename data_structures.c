@@ -2,6 +2,24 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <math.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "CUnit/Basic.h"
 #include "data_structures.h"
 
@@ -11,6 +29,54 @@
 #define pow2(n) (uint)(1<<(n))
 #define mask(n) (uint)((1<<(n))-1)
 
+// Run fn(arg, i) for each i below nthreads, each on its own thread, and wait
+// for all of them to finish. The calling thread runs fn(arg, 0) itself, and
+// afterwards any slice whose thread couldn't be started. So every slice always
+// runs, but slices that wait on each other need all their threads.
+typedef struct
+{
+    void (*fn)(void*, uint);
+    void *arg;
+    uint i;
+    pthread_t thread;
+    bool started;
+} _ParallelTask;
+
+static void *_parallel_task(void *task_ptr)
+{
+    _ParallelTask *task = task_ptr;
+    task->fn(task->arg, task->i);
+    return NULL;
+}
+
+static void _parallel_run(uint nthreads, void (*fn)(void*, uint), void *arg)
+{
+    if (nthreads <= 1)
+    {
+        fn(arg, 0);
+        return;
+    }
+    _ParallelTask *tasks = malloc(sizeof(_ParallelTask) * nthreads);
+    uint i;
+    for (i = 1; i < nthreads && tasks != NULL; i++)
+    {
+        tasks[i].fn = fn;
+        tasks[i].arg = arg;
+        tasks[i].i = i;
+        tasks[i].started = pthread_create(&tasks[i].thread, NULL,
+                                          _parallel_task, &tasks[i]) == 0;
+    }
+    fn(arg, 0);
+    for (i = 1; i < nthreads; i++)
+    {
+        if (tasks != NULL && tasks[i].started)
+            pthread_join(tasks[i].thread, NULL);
+        else
+            fn(arg, i);
+    }
+    free(tasks);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // LinkedList
 // A circular doubly-linked list
@@ -132,6 +198,9 @@ bool LinkedList_enqueue(LinkedList *list, void *value)
     return LinkedList_insert(list, 0, value);
 }
 
+static void _LinkedList_unlink(LinkedList *list, LinkedListElement *first,
+                               LinkedListElement *last, uint count);
+
 LinkedListElement *_LinkedList_remove(LinkedList *list, int index)
 {
     assert(list != NULL);
@@ -139,9 +208,7 @@ LinkedListElement *_LinkedList_remove(LinkedList *list, int index)
     LinkedListElement *elem = _LinkedList_index(list, index);
     if (elem == NULL)
         return NULL;
-    elem->prev->next = elem->next;
-    elem->next->prev = elem->prev;
-    list->size--;
+    _LinkedList_unlink(list, elem, elem, 1);
     return elem;
 }
 
@@ -157,42 +224,32 @@ void *LinkedList_remove(LinkedList *list, int index)
 
 bool LinkedList_remove_first(LinkedList *list, void *value)
 {
-    LinkedListElement *first = list->first;
-    LinkedListElement *elem = first;
-    LinkedListElement *next = elem->next;
-    do
+    LinkedListCursor cursor = LinkedList_cursor(list);
+    for (; cursor.elem != NULL; LinkedListCursor_next(&cursor))
     {
-        if (elem->value == value)
+        if (cursor.elem->value == value)
         {
-            elem->prev->next = elem->next;
-            elem->next->prev = elem->prev;
-            free(elem);
+            LinkedListCursor_remove(&cursor);
             return true;
         }
-        elem = next;
-        next = elem->next;
-    } while (elem != first);
+    }
     return false;
 }
 
 bool LinkedList_remove_all(LinkedList *list, void *value)
 {
-    LinkedListElement *first = list->first;
-    LinkedListElement *elem = first;
-    LinkedListElement *next = elem->next;
+    LinkedListCursor cursor = LinkedList_cursor(list);
     bool found = false;
-    do
+    while (cursor.elem != NULL)
     {
-        if (elem->value == value)
+        if (cursor.elem->value == value)
         {
             found = true;
-            elem->prev->next = elem->next;
-            elem->next->prev = elem->prev;
-            free(elem);
+            LinkedListCursor_remove(&cursor); // moves on to the next element
         }
-        elem = next;
-        next = next->next;
-    } while (elem != first);
+        else
+            LinkedListCursor_next(&cursor);
+    }
     return found;
 }
 
@@ -204,33 +261,258 @@ void *LinkedList_pop(LinkedList *list)
 int LinkedList_find(LinkedList *list, void *value)
 {
     assert(list != NULL);
-    assert(list->first != NULL);
+    LinkedListCursor cursor = LinkedList_cursor(list);
     int i;
-    int size = (int)list->size;
-    LinkedListElement *elem = list->first;
-    for (i = 0; i < size; i++)
-    {
-        if (elem->value == value)
+    for (i = 0; cursor.elem != NULL; i++, LinkedListCursor_next(&cursor))
+        if (cursor.elem->value == value)
             return i;
-        elem = elem->next;
-    }
     return -1;
 }
 
-void LinkedList_del(LinkedList *list)
+// A cursor sits on an element, or on the "end" between the last element and
+// the first when its elem is NULL.
+LinkedListCursor LinkedList_cursor(LinkedList *list)
 {
     assert(list != NULL);
-    assert(list->first != NULL);
-    LinkedListElement *first = list->first;
-    LinkedListElement *elem = first;
+    LinkedListCursor cursor;
+    cursor.list = list;
+    cursor.elem = list->first;
+    return cursor;
+}
+
+LinkedListCursor LinkedList_cursor_last(LinkedList *list)
+{
+    LinkedListCursor cursor = LinkedList_cursor(list);
+    if (cursor.elem != NULL)
+        cursor.elem = cursor.elem->prev;
+    return cursor;
+}
+
+// Moving past either end puts the cursor on the end, and moving from the end
+// wraps around to the first (or last) element.
+bool LinkedListCursor_next(LinkedListCursor *cursor)
+{
+    LinkedListElement *first = cursor->list->first;
+    if (cursor->elem == NULL)
+        cursor->elem = first;
+    else
+        cursor->elem = (cursor->elem->next == first)? NULL : cursor->elem->next;
+    return cursor->elem != NULL;
+}
+
+bool LinkedListCursor_prev(LinkedListCursor *cursor)
+{
+    LinkedListElement *first = cursor->list->first;
+    if (cursor->elem == NULL)
+        cursor->elem = (first == NULL)? NULL : first->prev;
+    else
+        cursor->elem = (cursor->elem == first)? NULL : cursor->elem->prev;
+    return cursor->elem != NULL;
+}
+
+void *LinkedListCursor_get(LinkedListCursor *cursor)
+{
+    return (cursor->elem == NULL)? NULL : cursor->elem->value;
+}
+
+// Link the chain first..last in before the element at, or at the end when at
+// is NULL. The cursor does not move.
+static void _LinkedListCursor_link(LinkedListCursor *cursor,
+                                   LinkedListElement *first,
+                                   LinkedListElement *last, uint count)
+{
+    LinkedList *list = cursor->list;
+    if (list->first == NULL)
+    {
+        first->prev = last;
+        last->next = first;
+        list->first = first;
+    }
+    else
+    {
+        LinkedListElement *at = (cursor->elem == NULL)? list->first : cursor->elem;
+        LinkedListElement *prev = at->prev;
+        prev->next = first;
+        first->prev = prev;
+        last->next = at;
+        at->prev = last;
+        if (at == list->first && cursor->elem != NULL)
+            list->first = first;
+    }
+    list->size += count;
+}
+
+void LinkedListCursor_insert_before(LinkedListCursor *cursor, void *value)
+{
+    LinkedListElement *new = malloc(sizeof(LinkedListElement));
+    new->value = value;
+    _LinkedListCursor_link(cursor, new, new, 1);
+}
+
+// At the end, this inserts before the first element
+void LinkedListCursor_insert_after(LinkedListCursor *cursor, void *value)
+{
+    LinkedListElement *new = malloc(sizeof(LinkedListElement));
+    new->value = value;
+    LinkedListCursor after = *cursor;
+    LinkedListCursor_next(&after);
+    _LinkedListCursor_link(&after, new, new, 1);
+}
+
+// Unlink the chain first..last, which must not be the whole list
+static void _LinkedList_unlink(LinkedList *list, LinkedListElement *first,
+                               LinkedListElement *last, uint count)
+{
+    if (first == list->first)
+        list->first = (last->next == first)? NULL : last->next;
+    first->prev->next = last->next;
+    last->next->prev = first->prev;
+    list->size -= count;
+}
+
+// Removes the current element and moves the cursor on to the next one
+void *LinkedListCursor_remove(LinkedListCursor *cursor)
+{
+    LinkedListElement *elem = cursor->elem;
+    if (elem == NULL)
+        return NULL;
+    LinkedListCursor_next(cursor);
+    _LinkedList_unlink(cursor->list, elem, elem, 1);
+    void *value = elem->value;
+    free(elem);
+    return value;
+}
+
+// Move the count elements from first up to and including last out of their
+// list and in before the cursor. The count is taken on trust so that this is
+// O(1); the range must not contain the cursor.
+void LinkedListCursor_splice(LinkedListCursor *cursor, LinkedListCursor *first,
+                             LinkedListCursor *last, uint count)
+{
+    assert(first->list == last->list);
+    assert(first->elem != NULL && last->elem != NULL);
+    _LinkedList_unlink(first->list, first->elem, last->elem, count);
+    _LinkedListCursor_link(cursor, first->elem, last->elem, count);
+}
+
+// Merge two NULL-terminated chains, linked through next only. Ties are taken
+// from a so that the sort is stable. *tail is set to the last element.
+static LinkedListElement *_LinkedList_merge(LinkedListElement *a,
+                                            LinkedListElement *b,
+                                            int (*cmp)(void*,void*),
+                                            LinkedListElement **tail)
+{
+    LinkedListElement head;
+    LinkedListElement *last = &head;
+    while (a != NULL && b != NULL)
+    {
+        if (cmp(b->value, a->value) < 0)
+        {
+            last->next = b;
+            b = b->next;
+        }
+        else
+        {
+            last->next = a;
+            a = a->next;
+        }
+        last = last->next;
+    }
+    last->next = (a != NULL)? a : b;
+    while (last->next != NULL)
+        last = last->next;
+    *tail = last;
+    return head.next;
+}
+
+// Cut the natural run starting at elem off the front of the chain, leaving the
+// rest in *rest. Strictly descending runs are reversed, which keeps stability.
+static LinkedListElement *_LinkedList_run(LinkedListElement *elem,
+                                          int (*cmp)(void*,void*),
+                                          LinkedListElement **rest)
+{
+    LinkedListElement *next = elem->next;
+    if (next != NULL && cmp(next->value, elem->value) < 0)
+    {
+        LinkedListElement *run = elem;
+        run->next = NULL;
+        while (next != NULL && cmp(next->value, run->value) < 0)
+        {
+            LinkedListElement *after = next->next;
+            next->next = run;
+            run = next;
+            next = after;
+        }
+        *rest = next;
+        return run;
+    }
+    LinkedListElement *last = elem;
+    while (next != NULL && cmp(next->value, last->value) >= 0)
+    {
+        last = next;
+        next = next->next;
+    }
+    last->next = NULL;
+    *rest = next;
+    return elem;
+}
+
+// A stable bottom-up merge sort that relinks the elements in place. Each pass
+// merges neighbouring natural runs, so sorted or reversed input takes one pass.
+void LinkedList_sort(LinkedList *list, int (*cmp)(void*,void*))
+{
+    assert(list != NULL);
+    if (list->size < 2)
+        return;
+    LinkedListElement *chain = list->first;
+    chain->prev->next = NULL; // break the circle
+    LinkedListElement *tail;
+    uint runs;
     do
     {
+        LinkedListElement *merged = NULL;
+        LinkedListElement **end = &merged;
+        runs = 0;
+        while (chain != NULL)
+        {
+            LinkedListElement *a = _LinkedList_run(chain, cmp, &chain);
+            LinkedListElement *b = NULL;
+            if (chain != NULL)
+                b = _LinkedList_run(chain, cmp, &chain);
+            *end = _LinkedList_merge(a, b, cmp, &tail);
+            end = &tail->next;
+            runs++;
+        }
+        chain = merged;
+    } while (runs > 1);
+    // Restore the prev links and close the circle
+    list->first = chain;
+    LinkedListElement *elem;
+    for (elem = chain; elem->next != NULL; elem = elem->next)
+        elem->next->prev = elem;
+    elem->next = chain;
+    chain->prev = elem;
+}
+
+void LinkedList_del(LinkedList *list)
+{
+    assert(list != NULL);
+    LinkedListCursor cursor = LinkedList_cursor(list);
+    while (cursor.elem != NULL)
+    {
+        LinkedListElement *elem = cursor.elem;
+        LinkedListCursor_next(&cursor);
         free(elem);
-        elem = elem->next;
-    } while (elem != first);
+    }
     free(list);
 }
 
+// Orders on the bits above the low byte, which the sort tests use as a tag
+static int _tagged_order(void *a, void *b)
+{
+    return ptrorder((void*)((uint)a >> 8), (void*)((uint)b >> 8));
+}
+
 void LinkedList_test()
 {
     LinkedList *list = LinkedList_new();
@@ -250,1294 +532,6912 @@ void LinkedList_test()
     CU_ASSERT(LinkedList_index(list, 0) == (void*)2);
     CU_ASSERT(LinkedList_index(list, -1) == (void*)1);
     CU_ASSERT(LinkedList_index(list, 5) == NULL);
+    // Test cursors: 2 6 5 3 1 -> 2 6 7 5 3 1 -> 2 6 7 3 1
+    LinkedListCursor cursor = LinkedList_cursor(list);
+    LinkedListCursor_next(&cursor);
+    LinkedListCursor_insert_after(&cursor, (void*)7);
+    LinkedListCursor_next(&cursor);
+    LinkedListCursor_next(&cursor);
+    CU_ASSERT(LinkedListCursor_remove(&cursor) == (void*)5);
+    CU_ASSERT(LinkedListCursor_get(&cursor) == (void*)3);
+    CU_ASSERT(LinkedList_find(list, (void*)7) == 2);
+    // Splice 6 7 onto the end of another list
+    LinkedList *other = LinkedList_new();
+    LinkedList_add(other, (void*)8);
+    LinkedListCursor first = LinkedList_cursor(list);
+    LinkedListCursor_next(&first);
+    LinkedListCursor last = first;
+    LinkedListCursor_next(&last);
+    LinkedListCursor end = LinkedList_cursor(other);
+    LinkedListCursor_prev(&end);
+    LinkedListCursor_splice(&end, &first, &last, 2);
+    CU_ASSERT(list->size == 3 && other->size == 3);
+    CU_ASSERT(LinkedList_index(list, 1) == (void*)3);
+    CU_ASSERT(LinkedList_index(other, -1) == (void*)7);
+    CU_ASSERT(LinkedList_remove_all(other, (void*)8));
+    CU_ASSERT(LinkedList_index(other, 0) == (void*)6);
+    LinkedList_del(other);
+    LinkedList_del(list);
+    // Test sort() keeps equal keys in their original order
+    list = LinkedList_new();
+    uint i;
+    for (i = 0; i < 256; i++)
+        LinkedList_add(list, (void*)((((i * 7919) % 16) << 8) | i));
+    LinkedList_sort(list, _tagged_order);
+    CU_ASSERT(list->size == 256);
+    LinkedListCursor sorted = LinkedList_cursor(list);
+    uint prev = (uint)LinkedListCursor_get(&sorted);
+    bool ok = true;
+    while (LinkedListCursor_next(&sorted))
+    {
+        uint value = (uint)LinkedListCursor_get(&sorted);
+        if ((value >> 8) < (prev >> 8) ||
+            ((value >> 8) == (prev >> 8) && (value & 0xff) <= (prev & 0xff)))
+            ok = false;
+        prev = value;
+    }
+    CU_ASSERT(ok);
+    CU_ASSERT(LinkedList_index(list, -1) == (void*)((15ul << 8) | 0xf1));
+    LinkedList_del(list);
+    // Strictly descending input is a single run
+    list = LinkedList_new();
+    for (i = 0; i < 1000; i++)
+        LinkedList_enqueue(list, (void*)i);
+    CU_ASSERT(LinkedList_index(list, 0) == (void*)999);
+    LinkedList_sort(list, ptrorder);
+    CU_ASSERT(list->size == 1000);
+    sorted = LinkedList_cursor(list);
+    ok = true;
+    for (i = 0; i < 1000; i++, LinkedListCursor_next(&sorted))
+        ok &= sorted.elem != NULL && LinkedListCursor_get(&sorted) == (void*)i;
+    CU_ASSERT(ok && sorted.elem == NULL);
     LinkedList_del(list);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// ArrayList
-// A dynamically growing/shrinking array list
+// IntrusiveList
+// A circular doubly-linked list whose links are embedded in the caller's own
+// structs. Nothing is allocated per element.
 ////////////////////////////////////////////////////////////////////////////////
 
-static ArrayList *_ArrayList_new(int cap)
+void IntrusiveList_init(IntrusiveList *list)
 {
-    ArrayList *list = malloc(sizeof(ArrayList));
+    assert(list != NULL);
+    list->head.prev = &list->head;
+    list->head.next = &list->head;
     list->size = 0;
-    list->cap = cap;
-    list->array = (void**)malloc(list->cap * sizeof(void*));
-    return list;
 }
 
-ArrayList *ArrayList_new()
+IntrusiveList *IntrusiveList_new()
 {
-    return _ArrayList_new(8);
+    IntrusiveList *list = malloc(sizeof(IntrusiveList));
+    IntrusiveList_init(list);
+    return list;
 }
 
-void *ArrayList_index(ArrayList *list, int index)
+// Link new in after the link at, which may be the list's head
+static inline void _IntrusiveList_link(IntrusiveList *list, IntrusiveLink *at,
+                                       IntrusiveLink *new)
 {
-    int size = (int)list->size;
-    if (index < 0)
-        index += size;
-    if (index < 0 || index >= size) // check bounds
-        return NULL;
-    return list->array[index];
+    IntrusiveLink *next = at->next;
+    new->prev = at;
+    new->next = next;
+    next->prev = new;
+    at->next = new;
+    list->size++;
 }
 
-void ArrayList_growby(ArrayList *list, int additional_cap)
+void IntrusiveList_insert_after(IntrusiveList *list, IntrusiveLink *at,
+                                IntrusiveLink *new)
 {
-    list->cap += additional_cap;
-    list->array = (void**)realloc(list->array, list->cap * sizeof(void*));
+    assert(list != NULL);
+    assert(at != NULL);
+    _IntrusiveList_link(list, at, new);
 }
 
-void ArrayList_grow(ArrayList *list)
+void IntrusiveList_insert_before(IntrusiveList *list, IntrusiveLink *at,
+                                 IntrusiveLink *new)
 {
-    ArrayList_growby(list, list->cap >> 1);
+    assert(list != NULL);
+    assert(at != NULL);
+    _IntrusiveList_link(list, at->prev, new);
 }
 
-void ArrayList_add(ArrayList *list, void *item)
+void IntrusiveList_add(IntrusiveList *list, IntrusiveLink *link)
 {
-    if (list->size >= list->cap)
-        ArrayList_grow(list);
-    list->array[list->size++] = item;
+    _IntrusiveList_link(list, list->head.prev, link);
 }
 
-void *ArrayList_pop(ArrayList *list)
+void IntrusiveList_enqueue(IntrusiveList *list, IntrusiveLink *link)
 {
-    if (list->size == 0)
-        return NULL;
-    return list->array[--list->size];
+    _IntrusiveList_link(list, &list->head, link);
 }
 
-void *ArrayList_remove(ArrayList *list, int index)
+void IntrusiveList_remove(IntrusiveList *list, IntrusiveLink *link)
 {
-    int size = (int)list->size;
-    if (index < 0)
-        index += size;
-    if (index < 0 || index >= size) // check bounds
-        return NULL;
-    void **dest = list->array + index;
-    void *value = *dest;
-    memmove(dest, dest + 1, (list->size - index) * sizeof(void*));
+    assert(list != NULL);
+    assert(link != &list->head);
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->prev = link->next = NULL;
     list->size--;
-    return value;
 }
 
-bool ArrayList_insert(ArrayList *list, int index, void *value)
+IntrusiveLink *IntrusiveList_pop(IntrusiveList *list)
 {
-    if ((list->size == 0 && index == 0) || index == -1)
-    {
-        ArrayList_add(list, value);
-        return true;
-    }
-    int size = (int)list->size;
-    if (index < 0)
-        index += size;
-    if (index < 0 || index >= size) // check bounds
-        return false;
-    void **dest = list->array + index;
-    list->size++;
-    if (list->size >= list->cap)
-        ArrayList_grow(list);
-    memmove(dest + 1, dest, (list->size - index) * sizeof(void*));
-    *dest = value;
-    return true;
+    IntrusiveLink *last = IntrusiveList_last(list);
+    if (last != NULL)
+        IntrusiveList_remove(list, last);
+    return last;
 }
 
-int ArrayList_find(ArrayList *list, void *value)
+IntrusiveLink *IntrusiveList_first(IntrusiveList *list)
 {
-    uint i;
-    for (i = 0; i < list->size; i++)
-        if (list->array[i] == value)
-            return i;
-    return -1;
+    return IntrusiveList_next(list, &list->head);
 }
 
-bool ArrayList_has(ArrayList *list, void *value)
+IntrusiveLink *IntrusiveList_last(IntrusiveList *list)
 {
-    return (ArrayList_find(list, value) == -1)?false:true;
+    return IntrusiveList_prev(list, &list->head);
 }
 
-ArrayList *ArrayList_join(ArrayList *listA, ArrayList *listB)
+IntrusiveLink *IntrusiveList_next(IntrusiveList *list, IntrusiveLink *link)
 {
-    ArrayList *newlist = _ArrayList_new(listA->cap + listB->cap);
-    memcpy(newlist->array, listA->array, listA->size * sizeof(void*));
-    memcpy(newlist->array + listA->size, listB->array, listB->size * sizeof(void*));
-    newlist->size = listA->size + listB->size;
-    return newlist;
+    return (link->next == &list->head)? NULL : link->next;
 }
 
-void ArrayList_reverse(ArrayList *list)
+IntrusiveLink *IntrusiveList_prev(IntrusiveList *list, IntrusiveLink *link)
 {
-    uint size = list->size;
-    uint i;
-    for (i = 0; i < (size >> 1); i++)
-        swap(list[i], list[size - 1 - i]);
+    return (link->prev == &list->head)? NULL : link->prev;
 }
 
-void ArrayList_del(ArrayList *list)
+bool IntrusiveList_linked(IntrusiveLink *link)
+{
+    return link->next != NULL;
+}
+
+// The list does not own its elements, so only the list itself is freed
+void IntrusiveList_del(IntrusiveList *list)
 {
-    free(list->array);
     free(list);
 }
 
-void ArrayList_test()
+void IntrusiveList_test()
 {
-    ArrayList *list = ArrayList_new();
-    // Test insert()
-    ArrayList_insert(list, 0, (void*)1);
-    ArrayList_insert(list, 0, (void*)2);
-    ArrayList_insert(list, 1, (void*)3);
-    ArrayList_insert(list, 1, (void*)4);
-    ArrayList_insert(list, 1, (void*)5);
-    ArrayList_insert(list, 1, (void*)6);
-    // Test index()
-    CU_ASSERT(ArrayList_index(list, 0) == (void*)2);
-    CU_ASSERT(ArrayList_index(list, -1) == (void*)1);
-    CU_ASSERT(ArrayList_index(list, 5) == (void*)1);
-    // Test remove()
-    ArrayList_remove(list, 3);
-    CU_ASSERT(ArrayList_index(list, 0) == (void*)2);
-    CU_ASSERT(ArrayList_index(list, -1) == (void*)1);
-    CU_ASSERT(ArrayList_index(list, 5) == NULL);
-    ArrayList_del(list);
+    typedef struct
+    {
+        int id;
+        IntrusiveLink link;
+    } Job;
+    Job jobs[4];
+    IntrusiveList queue;
+    IntrusiveList_init(&queue);
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        jobs[i].id = i;
+        IntrusiveList_enqueue(&queue, &jobs[i].link);
+    }
+    CU_ASSERT(queue.size == 4);
+    // Remove from the middle given only the object
+    IntrusiveList_remove(&queue, &jobs[2].link);
+    CU_ASSERT(!IntrusiveList_linked(&jobs[2].link));
+    IntrusiveList_insert_after(&queue, &jobs[3].link, &jobs[2].link);
+    // Elements come back out in the order they were enqueued
+    for (i = 0; i < 4; i++)
+    {
+        IntrusiveLink *link = IntrusiveList_pop(&queue);
+        CU_ASSERT(container_of(link, Job, link)->id == i);
+    }
+    CU_ASSERT(IntrusiveList_pop(&queue) == NULL);
+    CU_ASSERT(queue.size == 0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Map
-// An incrementally resizing hashtable map with open addressing
+// UnrolledList
+// A doubly-linked list of chunks, each holding up to UNROLLED_CHUNK values
 ////////////////////////////////////////////////////////////////////////////////
 
-uint stringhash(void *stringptr)
+UnrolledList *UnrolledList_new()
 {
-    char *string = (char*)stringptr;
-    /* "Jenkin's Hash" */
-    uint hash;
-    uint i;
-    uint len = strlen(string);
-    for (hash = i = 0; i < len; i++)
-    {
-        hash += string[i];
-        hash += (hash << 10);
-        hash ^= (hash >> 6);
-    }
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    hash += (hash << 15);
-    return hash;
+    UnrolledList *list = malloc(sizeof(UnrolledList));
+    list->first = NULL;
+    list->last = NULL;
+    list->size = 0;
+    return list;
 }
 
-uint ptrhash(void *ptr)
+static UnrolledListNode *_UnrolledList_new_node(UnrolledList *list,
+                                                UnrolledListNode *prev)
 {
-    return (uint)ptr >> 2;
+    UnrolledListNode *node = malloc(sizeof(UnrolledListNode));
+    node->count = 0;
+    node->prev = prev;
+    node->next = (prev == NULL)? list->first : prev->next;
+    if (node->next != NULL)
+        node->next->prev = node;
+    else
+        list->last = node;
+    if (prev != NULL)
+        prev->next = node;
+    else
+        list->first = node;
+    return node;
 }
 
-bool stringcomp(void *str1, void *str2)
+static void _UnrolledList_free_node(UnrolledList *list, UnrolledListNode *node)
 {
-    if (str1 == NULL)
-        return str2 == NULL;
-    return strcmp(str1, str2) == 0;
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    else
+        list->first = node->next;
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+    else
+        list->last = node->prev;
+    free(node);
 }
 
-bool ptrcomp(void *ptr1, void *ptr2)
+// Find the node holding the value at index, which must be in bounds, walking
+// whole chunks from the nearer end. *offset is set to its position in the node.
+static UnrolledListNode *_UnrolledList_find(UnrolledList *list, uint index,
+                                            uint *offset)
 {
-    return ptr1 == ptr2;
+    UnrolledListNode *node;
+    if (index < (list->size >> 1)) // count up
+    {
+        node = list->first;
+        while (index >= node->count)
+        {
+            index -= node->count;
+            node = node->next;
+        }
+    }
+    else // count down
+    {
+        uint end = list->size;
+        node = list->last;
+        while (index < end - node->count)
+        {
+            end -= node->count;
+            node = node->prev;
+        }
+        index -= end - node->count;
+    }
+    *offset = index;
+    return node;
 }
 
-static void _Map_add(Map *map, void *key, void *value, bool recurrant);
-static void _Map_transfer(Map *map);
-static Map *_Map_new(int log2tablesize, uint (*hash)(void*), bool (*comp)(void*,void*));
-static MapBucket *_Map_get(Map *map, void *key);
+// Handle negative indices, returning false when out of bounds
+static inline bool _UnrolledList_bound(UnrolledList *list, int *index, uint size)
+{
+    if (*index < 0)
+        *index += (int)list->size;
+    return *index >= 0 && (uint)*index < size;
+}
 
-// add an item to tableB only
-static void _Map_add(Map *map, void *key, void *value, bool recurrant)
+void *UnrolledList_index(UnrolledList *list, int index)
 {
-    assert(map != NULL);
-    assert(key != NULL);
-    uint hash = map->hash(key);
-    uint size_mod_B = mask(map->log2capB);
-    uint index = hash; // modulus
-    MapBucket *bucket;
-    do
-    {
-        index &= size_mod_B;
-        bucket = &map->tableB[index];
-        index++;
-    } while (bucket->key != NULL);
-    bucket->key = key;
-    bucket->value = value;
-    map->sizeB++;
-    // also move an item from tableA to tableB
-    if (!recurrant)
-        _Map_transfer(map);
+    assert(list != NULL);
+    if (!_UnrolledList_bound(list, &index, list->size))
+        return NULL;
+    uint offset;
+    UnrolledListNode *node = _UnrolledList_find(list, index, &offset);
+    return node->values[offset];
 }
 
-// transfer any item from tableA to tableB
-static void _Map_transfer(Map *map)
+// Inserts before the value currently at index; index may equal the size
+bool UnrolledList_insert(UnrolledList *list, int index, void *value)
 {
-    uint cap = pow2(map->log2capA);
-    if (map->tableA != NULL)
+    assert(list != NULL);
+    if (!_UnrolledList_bound(list, &index, list->size + 1))
+        return false;
+    UnrolledListNode *node;
+    uint offset;
+    if ((uint)index == list->size)
     {
-        while (map->indexA < cap)
+        node = list->last;
+        if (node == NULL || node->count == UNROLLED_CHUNK)
+            node = _UnrolledList_new_node(list, node);
+        offset = node->count;
+    }
+    else
+        node = _UnrolledList_find(list, index, &offset);
+    if (node->count == UNROLLED_CHUNK)
+    {
+        // split the full node, moving its upper half into a new node
+        UnrolledListNode *next = _UnrolledList_new_node(list, node);
+        uint half = UNROLLED_CHUNK >> 1;
+        memcpy(next->values, node->values + half,
+               (UNROLLED_CHUNK - half) * sizeof(void*));
+        next->count = UNROLLED_CHUNK - half;
+        node->count = half;
+        if (offset > half)
         {
-            MapBucket *bucket = &map->tableA[map->indexA];
-            if (bucket->key != NULL)
-            {
-                _Map_add(map, bucket->key, bucket->value, true);
-                bucket->key = NULL;
-                map->sizeA--;
-                return;
-            }
-            map->indexA++;
+            node = next;
+            offset -= half;
         }
-        // We have emptied tableA
-        assert(map->sizeA == 0);
-        free(map->tableA);
-        map->tableA = NULL;
     }
-    
-    // check to see if table B has reached 75% cap.
-    uint high_load = pow2(map->log2capB - 2) + pow2(map->log2capB - 1);
-    if (map->sizeB < high_load)
-        return;
-    
-    uint log2newtablesize = map->log2capB + 1; // grow by 2x
-    if (map->tableA != NULL)
-        free(map->tableA);
-    map->tableA = map->tableB;
-    map->log2capA = map->log2capB;
-    map->sizeA = map->sizeB;
-    map->indexA = 0;
-    map->tableB = calloc(pow2(log2newtablesize), sizeof(MapBucket));
-    map->log2capB = log2newtablesize;
-    map->sizeB = 0;
-}
-
-Map *Map_new_sized(int log2tablesize,
-                   uint (*hash)(void*), bool (*comp)(void*,void*))
-{
-    Map *map = malloc(sizeof(Map));
-    map->hash = hash;
-    map->comp = comp;
-    map->indexA = 0;
-    map->sizeA = 0;
-    map->sizeB = 0;
-    map->log2capA = 0;
-    map->log2capB = log2tablesize;
-    map->tableA = NULL;
-    map->tableB = calloc(pow2(log2tablesize), sizeof(MapBucket));
-    return map;
+    memmove(node->values + offset + 1, node->values + offset,
+            (node->count - offset) * sizeof(void*));
+    node->values[offset] = value;
+    node->count++;
+    list->size++;
+    return true;
 }
 
-Map *Map_new(uint (*hash)(void*), bool (*comp)(void*,void*))
+bool UnrolledList_add(UnrolledList *list, void *value)
 {
-    return Map_new_sized(4, hash, comp);
+    return UnrolledList_insert(list, list->size, value);
 }
 
-MapIterator Map_iter(Map *map)
+bool UnrolledList_enqueue(UnrolledList *list, void *value)
 {
-    MapIterator iter;
-    iter.map = map;
-    iter.tableA = false;
-    iter.index = -1;
-    return iter;
+    return UnrolledList_insert(list, 0, value);
 }
 
-static MapBucket *_Map_iter_next(MapIterator *iter)
+// Keep nodes at least half full by merging with or borrowing from the next one
+static void _UnrolledList_rebalance(UnrolledList *list, UnrolledListNode *node)
 {
-    Map *map = iter->map;
-    MapBucket *table = (iter->tableA)? map->tableA : map->tableB;
-    if (iter.index < 0)
+    uint half = UNROLLED_CHUNK >> 1;
+    if (node->count >= half)
+        return;
+    if (node->count == 0)
     {
-        
+        _UnrolledList_free_node(list, node);
+        return;
     }
-    MapBucket *bucket = &table[iter.index];
-    /// how do we ensure that after the first call, the iterator is still
-    /// pointing at the first element (which may be at index 0)? Maybe use -1
-    /// for the "uninitialized" step? Maybe rethink how iterators should work?
-    
+    UnrolledListNode *next = node->next;
+    if (next == NULL)
+        return;
+    if (node->count + next->count <= UNROLLED_CHUNK)
+    {
+        memcpy(node->values + node->count, next->values,
+               next->count * sizeof(void*));
+        node->count += next->count;
+        _UnrolledList_free_node(list, next);
+        return;
+    }
+    uint moved = half - node->count;
+    memcpy(node->values + node->count, next->values, moved * sizeof(void*));
+    memmove(next->values, next->values + moved,
+            (next->count - moved) * sizeof(void*));
+    node->count += moved;
+    next->count -= moved;
 }
 
-static MapBucket *_Map_get(Map *map, void *key)
+void *UnrolledList_remove(UnrolledList *list, int index)
 {
-    assert(key != NULL);
-    uint hash = map->hash(key);
-    uint size_mod_B = mask(map->log2capB);
-    uint indexB = hash & size_mod_B; // modulus
-    uint i = indexB;
-    MapBucket *bucket;
-    do
-    {
-        bucket = &map->tableB[i];
-        if (bucket->key != NULL && map->comp(bucket->key, key))
-            return bucket;
-        i++;
-        i &= size_mod_B;
-    } while (i != indexB);
-    
-    // The key wasn't found in table B, now look in table A
-    
-    if (map->tableA == NULL)
+    assert(list != NULL);
+    if (!_UnrolledList_bound(list, &index, list->size))
         return NULL;
-        
-    uint size_mod_A = mask(map->log2capA);
-    uint indexA = hash & size_mod_A; // modulus
-    i = indexA;
-    do
-    {
-        bucket = &map->tableA[i];
-        if (bucket->key != NULL && map->comp(bucket->key, key))
-            return bucket;
-        i++;
-        i &= size_mod_A;
-    } while (i != indexA);
-    return NULL;
+    uint offset;
+    UnrolledListNode *node = _UnrolledList_find(list, index, &offset);
+    void *value = node->values[offset];
+    node->count--;
+    memmove(node->values + offset, node->values + offset + 1,
+            (node->count - offset) * sizeof(void*));
+    list->size--;
+    _UnrolledList_rebalance(list, node);
+    return value;
 }
 
-bool Map_has(Map *map, void *key)
+void *UnrolledList_pop(UnrolledList *list)
 {
-    MapBucket *bucket = _Map_get(map, key);
-    if (bucket == NULL)
-        return false;
-    return true;
+    return UnrolledList_remove(list, -1);
 }
 
-void *Map_get(Map *map, void *key)
+int UnrolledList_find(UnrolledList *list, void *value)
 {
-    MapBucket *bucket = _Map_get(map, key);
-    if (bucket == NULL)
-        return NULL;
-    return bucket->value;
+    assert(list != NULL);
+    UnrolledListNode *node;
+    int index = 0;
+    uint i;
+    for (node = list->first; node != NULL; node = node->next)
+    {
+        for (i = 0; i < node->count; i++)
+            if (node->values[i] == value)
+                return index + i;
+        index += node->count;
+    }
+    return -1;
 }
 
-void *Map_remove(Map *map, void *key)
+UnrolledListIterator UnrolledList_iter(UnrolledList *list)
 {
-    MapBucket *bucket = _Map_get(map, key);
-    if (bucket == NULL)
-        return NULL;
-    void *value = bucket->value;
-    bucket->key = NULL;
-    // check which table the bucket was in:
-    if (bucket >= map->tableA && bucket < map->tableA + pow2(map->log2capA))
-        map->sizeA--;
-    else
-        map->sizeB--;
-    return value;
+    UnrolledListIterator iter;
+    iter.node = list->first;
+    iter.index = 0;
+    return iter;
 }
 
-void *Map_set(Map *map, void *key, void *value)
+void **UnrolledList_iter_next(UnrolledListIterator *iter)
 {
-    MapBucket *bucket = _Map_get(map, key);
-    void *oldvalue = NULL;
-    
-    if (bucket == NULL)
+    while (iter->node != NULL && iter->index >= iter->node->count)
     {
-        _Map_add(map, key, value, false);
+        iter->node = iter->node->next;
+        iter->index = 0;
     }
-    else
+    if (iter->node == NULL)
+        return NULL;
+    return &iter->node->values[iter->index++];
+}
+
+void UnrolledList_del(UnrolledList *list)
+{
+    assert(list != NULL);
+    UnrolledListNode *node = list->first;
+    while (node != NULL)
     {
-        oldvalue = bucket->value;
-        bucket->value = value;
+        UnrolledListNode *next = node->next;
+        free(node);
+        node = next;
     }
-    return oldvalue;
+    free(list);
 }
 
-void Map_del(Map *map)
+void UnrolledList_test()
 {
-    if (map->tableA != NULL)
-        free(map->tableA);
-    free(map->tableB);
-    free(map);
+    UnrolledList *list = UnrolledList_new();
+    uint i;
+    // Test insert()
+    UnrolledList_insert(list, 0, (void*)1);
+    UnrolledList_insert(list, 0, (void*)2);
+    UnrolledList_insert(list, 1, (void*)3);
+    UnrolledList_insert(list, 1, (void*)4);
+    UnrolledList_insert(list, 1, (void*)5);
+    UnrolledList_insert(list, 1, (void*)6);
+    // Test index()
+    CU_ASSERT(UnrolledList_index(list, 0) == (void*)2);
+    CU_ASSERT(UnrolledList_index(list, -1) == (void*)1);
+    CU_ASSERT(UnrolledList_index(list, 5) == (void*)1);
+    // Test remove()
+    UnrolledList_remove(list, 3);
+    CU_ASSERT(UnrolledList_index(list, 0) == (void*)2);
+    CU_ASSERT(UnrolledList_index(list, -1) == (void*)1);
+    CU_ASSERT(UnrolledList_index(list, 5) == NULL);
+    UnrolledList_del(list);
+    
+    // Spread values across many chunks, then insert and remove in the middle
+    list = UnrolledList_new();
+    for (i = 0; i < 100; i++)
+        UnrolledList_add(list, (void*)i);
+    UnrolledList_insert(list, 50, (void*)1000);
+    CU_ASSERT(UnrolledList_index(list, 50) == (void*)1000);
+    CU_ASSERT(UnrolledList_index(list, 51) == (void*)50);
+    CU_ASSERT(UnrolledList_find(list, (void*)99) == 100);
+    for (i = 0; i < 60; i++)
+        UnrolledList_remove(list, 20);
+    CU_ASSERT(list->size == 41);
+    CU_ASSERT(UnrolledList_index(list, 19) == (void*)19);
+    CU_ASSERT(UnrolledList_index(list, 20) == (void*)79);
+    UnrolledListIterator iter = UnrolledList_iter(list);
+    void **slot;
+    uint count = 0;
+    while ((slot = UnrolledList_iter_next(&iter)) != NULL)
+        count++;
+    CU_ASSERT(count == 41);
+    UnrolledList_del(list);
 }
 
-void Map_test()
+////////////////////////////////////////////////////////////////////////////////
+// BTreeList
+// A sequence kept in a B+tree. Leaves and branches both start with their
+// count, so code that works on either kind of node takes its height instead.
+////////////////////////////////////////////////////////////////////////////////
+
+BTreeList *BTreeList_new()
 {
-    Map *map = Map_new(stringhash, stringcomp);
-    Map_set(map, "test0", "a");
-    Map_set(map, "test1", "b");
-    Map_set(map, "test2", "c");
-    Map_set(map, "test3", "d");
-    Map_set(map, "test0", "e");
-    CU_ASSERT(strcmp(Map_get(map, "test0"), "e") == 0);
-    CU_ASSERT(strcmp(Map_get(map, "test1"), "b") == 0);
-    CU_ASSERT(strcmp(Map_get(map, "test2"), "c") == 0);
-    CU_ASSERT(strcmp(Map_get(map, "test3"), "d") == 0);
-    Map_remove(map, "test2");
-    CU_ASSERT(strcmp(Map_get(map, "test0"), "e") == 0);
-    CU_ASSERT(strcmp(Map_get(map, "test1"), "b") == 0);
-    CU_ASSERT(Map_get(map, "test2") == NULL);
-    CU_ASSERT(strcmp(Map_get(map, "test3"), "d") == 0);
-    Map_del(map);
+    BTreeList *list = malloc(sizeof(BTreeList));
+    list->root = NULL;
+    list->height = 0;
+    list->size = 0;
+    return list;
 }
 
-void Map_profile()
+static inline uint _BTree_max(uint height)
 {
-    /// todo
+    return (height == 0)? BTREE_LEAF : BTREE_BRANCH;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// ChainedMap
-// An incrementally resizing hashtable map with chaining
-////////////////////////////////////////////////////////////////////////////////
+static inline void **_BTree_slots(void *node, uint height)
+{
+    if (height == 0)
+        return ((BTreeLeaf*)node)->values;
+    return ((BTreeBranch*)node)->children;
+}
 
-static void _ChainedMap_add(ChainedMap *map, void *key, void *value, bool recurrant);
+static void *_BTree_new_node(uint height)
+{
+    if (height == 0)
+    {
+        BTreeLeaf *leaf = malloc(sizeof(BTreeLeaf));
+        leaf->count = 0;
+        leaf->prev = leaf->next = NULL;
+        return leaf;
+    }
+    BTreeBranch *branch = malloc(sizeof(BTreeBranch));
+    branch->count = 0;
+    return branch;
+}
 
-ChainedMap *ChainedMap_new_sized(int log2tablesize,
-                                 uint (*hash)(void*), bool (*comp)(void*,void*))
+// Number of values under a node
+static uint _BTree_total(void *node, uint height)
 {
-    ChainedMap *map = malloc(sizeof(ChainedMap));
-    map->hash = hash;
-    map->comp = comp;
-    map->indexA = 0;
-    map->sizeA = 0;
-    map->sizeB = 0;
-    map->log2capA = 0;
-    map->log2capB = log2tablesize;
-    map->tableA = NULL;
-    map->tableB = calloc(pow2(log2tablesize), sizeof(ChainedMapBucket));
-    return map;
+    if (height == 0)
+        return ((BTreeLeaf*)node)->count;
+    BTreeBranch *branch = node;
+    uint i, total = 0;
+    for (i = 0; i < branch->count; i++)
+        total += branch->sizes[i];
+    return total;
 }
 
-ChainedMap *ChainedMap_new(uint (*hash)(void*), bool (*comp)(void*,void*))
+// Move n entries (values, or children with their sizes) from src to dest,
+// which may overlap. Counts are left to the caller.
+static void _BTree_move(void *dest, uint to, void *src, uint from, uint n,
+                        uint height)
 {
-    return ChainedMap_new_sized(4, hash, comp);
+    memmove(_BTree_slots(dest, height) + to, _BTree_slots(src, height) + from,
+            n * sizeof(void*));
+    if (height > 0)
+        memmove(((BTreeBranch*)dest)->sizes + to,
+                ((BTreeBranch*)src)->sizes + from, n * sizeof(uint));
 }
 
-static ChainedMapBucket *_ChainedMap_get(ChainedMap *map, ChainedMapBucket *maptable,
-                                  uint index, void *key)
+// Move the upper half of a node into a new node that follows it
+static void *_BTree_split_node(void *node, uint height)
 {
-    ChainedMapBucket *bucket = &maptable[index];
-    if (bucket->key != NULL)
+    uint *count = node;
+    void *next = _BTree_new_node(height);
+    uint half = *count >> 1;
+    _BTree_move(next, 0, node, half, *count - half, height);
+    *(uint*)next = *count - half;
+    *count = half;
+    if (height == 0)
     {
-        do
-        {
-            if (map->comp(bucket->key, key))
-                return bucket;
-            bucket = bucket->next;
-        } while (bucket != NULL);
+        BTreeLeaf *leaf = node, *after = next;
+        after->prev = leaf;
+        after->next = leaf->next;
+        if (leaf->next != NULL)
+            leaf->next->prev = after;
+        leaf->next = after;
     }
-    return NULL;
+    return next;
 }
 
-// Move one entry from tableA to tableB
-static void _ChainedMap_transfer(ChainedMap *map)
+// Even out two neighbouring nodes, or merge them if they fit in one. Returns
+// true if right was merged into left and freed.
+static bool _BTree_balance(void *left, void *right, uint height)
 {
-    assert(map != NULL);
-    if (map->tableA != NULL)
+    uint *left_count = left, *right_count = right;
+    uint total = *left_count + *right_count;
+    if (total <= _BTree_max(height))
     {
-        uint i = map->indexA;
-        uint cap = pow2(map->log2capA);
-        ChainedMapBucket *bucket, *next;
-        for (i = 0; i < cap; i++)
+        _BTree_move(left, *left_count, right, 0, *right_count, height);
+        *left_count = total;
+        if (height == 0)
         {
-            bucket = &map->tableA[i];
-            if (bucket->key != NULL)
-            {
-                next = bucket->next->next;
-                void *key = bucket->key;
-                void *value = bucket->value;
-                bucket->key = next->key;
-                bucket->value = next->value;
-                free(bucket->next);
-                bucket->next = next;
-                _ChainedMap_add(map, key, value, true);
-                map->indexA = i;
-                return;
-            }
+            BTreeLeaf *leaf = left, *gone = right;
+            leaf->next = gone->next;
+            if (gone->next != NULL)
+                gone->next->prev = leaf;
         }
+        free(right);
+        return true;
     }
-    
-    // check to see if table B has reached 75% cap.
-    uint high_load = pow2(map->log2capB + 2) + pow2(map->log2capB + 1);
-    if (map->sizeB < high_load)
-        return;
-    
-    uint log2newtablesize = map->log2capB + 1; // grow by 2x
-    if (map->tableA != NULL)
-        free(map->tableA);
-    map->tableA = map->tableB;
-    map->log2capA = map->log2capB;
-    map->sizeA = map->sizeB;
-    map->indexA = 0;
-    map->tableB = calloc(pow2(log2newtablesize), sizeof(ChainedMapBucket));
-    map->log2capB = log2newtablesize;
-    map->sizeB = 0;
+    uint half = total >> 1;
+    if (*left_count > half)
+    {
+        uint n = *left_count - half;
+        _BTree_move(right, n, right, 0, *right_count, height);
+        _BTree_move(right, 0, left, half, n, height);
+    }
+    else
+    {
+        uint n = half - *left_count;
+        _BTree_move(left, *left_count, right, 0, n, height);
+        _BTree_move(right, 0, right, n, *right_count - n, height);
+    }
+    *left_count = half;
+    *right_count = total - half;
+    return false;
 }
 
-void *ChainedMap_get(ChainedMap *map, void *key)
+static void _BTree_insert_child(BTreeBranch *branch, uint i, void *child,
+                                uint size)
 {
-    assert(map != NULL);
-    assert(key != NULL);
-    uint hash = map->hash(key);
-    uint indexB = hash & mask(map->log2capB);
-    ChainedMapBucket *bucket = _ChainedMap_get(map, map->tableB, indexB, key);
-    if (bucket != NULL)
-        return bucket->value;
-    if (map->tableA == NULL)
-        return NULL;
-    uint indexA = hash & mask(map->log2capA);
-    bucket = _ChainedMap_get(map, map->tableA, indexA, key);
-    if (bucket == NULL)
-        return NULL;
-    return bucket->value;
+    _BTree_move(branch, i + 1, branch, i, branch->count - i, 1);
+    branch->children[i] = child;
+    branch->sizes[i] = size;
+    branch->count++;
 }
 
-bool ChainedMap_has(ChainedMap *map, void *key)
+// Balance children i and i + 1 of a branch, updating their sizes
+static void _BTree_fix_children(BTreeBranch *branch, uint i, uint height)
 {
-    assert(key != NULL);
-    uint hash = map->hash(key);
-    uint indexB = hash & mask(map->log2capB);
-    ChainedMapBucket *bucket = _ChainedMap_get(map, map->tableB, indexB, key);
-    if (bucket != NULL)
-        return true;
-    uint indexA = hash & mask(map->log2capA);
-    bucket = _ChainedMap_get(map, map->tableA, indexA, key);
-    return bucket != NULL;
+    uint total = branch->sizes[i] + branch->sizes[i + 1];
+    if (_BTree_balance(branch->children[i], branch->children[i + 1],
+                       height - 1))
+    {
+        _BTree_move(branch, i + 1, branch, i + 2, branch->count - i - 2, 1);
+        branch->count--;
+        branch->sizes[i] = total;
+    }
+    else
+    {
+        branch->sizes[i] = _BTree_total(branch->children[i], height - 1);
+        branch->sizes[i + 1] = total - branch->sizes[i];
+    }
 }
 
-void *ChainedMap_remove(ChainedMap *map, void *key)
+// Find the child holding *index, making *index relative to that child. An
+// index just past the end lands in the last child.
+static inline uint _BTree_child(BTreeBranch *branch, uint *index)
 {
-    uint hash = map->hash(key);
-    uint indexB = hash & mask(map->log2capB);
-    ChainedMapBucket *bucket = &map->tableB[indexB];
-    void *value = NULL;
-    if (map->comp(bucket->key, key))
+    uint i = 0;
+    while (i + 1 < branch->count && *index >= branch->sizes[i])
     {
-        value = bucket->value;
-        ChainedMapBucket *next = bucket->next;
-        if (bucket->next != NULL)
-        {
-            bucket->key = next->key;
-            bucket->value = next->value;
-            bucket->next = next->next;
-            free(next);
-        }
-        else
-            bucket->key = NULL;
-        map->sizeB--;
-        return value;
+        *index -= branch->sizes[i];
+        i++;
     }
-    ChainedMapBucket *prev = bucket;
-    for (bucket = bucket->next; bucket != NULL; bucket = bucket->next)
+    return i;
+}
+
+// Insert value before position index under node. Returns the new right
+// sibling if node had to split, for the parent to take in.
+static void *_BTree_insert(void *node, uint height, uint index, void *value)
+{
+    void *next = NULL;
+    if (height == 0)
     {
-        if (map->comp(bucket->key, key))
+        BTreeLeaf *leaf = node;
+        if (leaf->count == BTREE_LEAF)
         {
-            prev->next = bucket->next;
-            value = bucket->value;
-            free(bucket);
-            map->sizeB--;
-            return value;
+            next = _BTree_split_node(leaf, 0);
+            if (index > leaf->count)
+            {
+                index -= leaf->count;
+                leaf = next;
+            }
         }
-        prev = bucket;
+        memmove(leaf->values + index + 1, leaf->values + index,
+                (leaf->count - index) * sizeof(void*));
+        leaf->values[index] = value;
+        leaf->count++;
+        return next;
     }
-    uint indexA = hash & mask(map->log2capA);
-    bucket = &map->tableA[indexA];
-    if (map->comp(bucket->key, key))
+    BTreeBranch *branch = node;
+    uint i = _BTree_child(branch, &index);
+    void *child = _BTree_insert(branch->children[i], height - 1, index, value);
+    branch->sizes[i]++;
+    if (child == NULL)
+        return NULL;
+    uint size = _BTree_total(child, height - 1);
+    branch->sizes[i] -= size;
+    if (branch->count == BTREE_BRANCH)
     {
-        value = bucket->value;
-        ChainedMapBucket *next = bucket->next;
-        if (bucket->next != NULL)
+        next = _BTree_split_node(branch, height);
+        if (i >= branch->count)
         {
-            bucket->key = next->key;
-            bucket->value = next->value;
-            bucket->next = next->next;
-            free(next);
+            i -= branch->count;
+            branch = next;
         }
-        else
-            bucket->key = NULL;
-        map->sizeA--;
+    }
+    _BTree_insert_child(branch, i + 1, child, size);
+    return next;
+}
+
+// Remove the value at index under node. Children left less than half full
+// are balanced with a neighbour; node itself is left to its parent.
+static void *_BTree_remove(void *node, uint height, uint index)
+{
+    if (height == 0)
+    {
+        BTreeLeaf *leaf = node;
+        void *value = leaf->values[index];
+        leaf->count--;
+        memmove(leaf->values + index, leaf->values + index + 1,
+                (leaf->count - index) * sizeof(void*));
         return value;
     }
-    prev = bucket;
-    for (bucket = bucket->next; bucket != NULL; bucket = bucket->next)
+    BTreeBranch *branch = node;
+    uint i = _BTree_child(branch, &index);
+    void *value = _BTree_remove(branch->children[i], height - 1, index);
+    branch->sizes[i]--;
+    if (*(uint*)branch->children[i] < _BTree_max(height - 1) / 2 &&
+        branch->count > 1)
+        _BTree_fix_children(branch, (i + 1 == branch->count)? i - 1 : i, height);
+    return value;
+}
+
+// Drop a root that has one child or none
+static void *_BTree_trim(void *root, uint *height)
+{
+    while (*height > 0 && ((BTreeBranch*)root)->count <= 1)
     {
-        if (map->comp(bucket->key, key))
+        BTreeBranch *branch = root;
+        root = (branch->count == 0)? NULL : branch->children[0];
+        free(branch);
+        (*height)--;
+        if (root == NULL)
+            return NULL;
+    }
+    if (*height == 0 && ((BTreeLeaf*)root)->count == 0)
+    {
+        free(root);
+        return NULL;
+    }
+    return root;
+}
+
+// Append the tree right, of height below node's, to the tree under node.
+// Right's root is balanced against the last node at its height, so only the
+// root of the result can be less than half full. Returns a new right sibling
+// if node had to split.
+static void *_BTree_join_right(void *node, uint height, void *right,
+                               uint right_height, uint right_size)
+{
+    BTreeBranch *branch = node;
+    uint last = branch->count - 1;
+    void *child;
+    uint size;
+    if (height - 1 == right_height)
+    {
+        uint total = branch->sizes[last] + right_size;
+        if (_BTree_balance(branch->children[last], right, right_height))
         {
-            prev->next = bucket->next;
-            value = bucket->value;
-            free(bucket);
-            map->sizeA--;
-            return value;
+            branch->sizes[last] = total;
+            return NULL;
         }
-        prev = bucket;
+        branch->sizes[last] = _BTree_total(branch->children[last], right_height);
+        child = right;
+        size = total - branch->sizes[last];
     }
-    return NULL;
+    else
+    {
+        child = _BTree_join_right(branch->children[last], height - 1, right,
+                                  right_height, right_size);
+        branch->sizes[last] += right_size;
+        if (child == NULL)
+            return NULL;
+        size = _BTree_total(child, height - 1);
+        branch->sizes[last] -= size;
+    }
+    void *next = NULL;
+    if (branch->count == BTREE_BRANCH)
+        branch = next = _BTree_split_node(branch, height);
+    _BTree_insert_child(branch, branch->count, child, size);
+    return next;
 }
 
-// Add to table B, requires that the key is not yet in map
-static void _ChainedMap_add(ChainedMap *map, void *key, void *value, bool recurrant)
+// As above, but prepending the shorter tree left to the tree under node
+static void *_BTree_join_left(void *node, uint height, void *left,
+                              uint left_height, uint left_size)
 {
-    uint index = map->hash(key) & mask(map->log2capB);
-    ChainedMapBucket *bucket = &map->tableB[index];
-    ChainedMapBucket *new_bucket = malloc(sizeof(ChainedMapBucket));
-    new_bucket->key = bucket->key;
-    new_bucket->value = bucket->value;
-    new_bucket->next = bucket->next;
-    bucket->key = key;
-    bucket->value = value;
-    bucket->next = new_bucket;
-    map->sizeB++;
-    if (!recurrant)
-        _ChainedMap_transfer(map); // also move an item from tableA to tableB
+    BTreeBranch *branch = node;
+    void *child;
+    uint size, at;
+    if (height - 1 == left_height)
+    {
+        uint total = left_size + branch->sizes[0];
+        if (_BTree_balance(left, branch->children[0], left_height))
+        {
+            branch->children[0] = left;
+            branch->sizes[0] = total;
+            return NULL;
+        }
+        child = left;
+        size = _BTree_total(left, left_height);
+        branch->sizes[0] = total - size;
+        at = 0;
+    }
+    else
+    {
+        child = _BTree_join_left(branch->children[0], height - 1, left,
+                                 left_height, left_size);
+        branch->sizes[0] += left_size;
+        if (child == NULL)
+            return NULL;
+        size = _BTree_total(child, height - 1);
+        branch->sizes[0] -= size;
+        at = 1;
+    }
+    void *next = NULL;
+    if (branch->count == BTREE_BRANCH)
+        next = _BTree_split_node(branch, height); // keeps at in branch
+    _BTree_insert_child(branch, at, child, size);
+    return next;
 }
 
-void *ChainedMap_set(ChainedMap *map, void *key, void *value)
+// Join two trees, either of which may be NULL, in O(difference in height).
+// Returns the new root and sets *height.
+static void *_BTree_join(void *left, uint left_height, uint left_size,
+                         void *right, uint right_height, uint right_size,
+                         uint *height)
 {
-    assert(map != NULL);
-    assert(key != NULL);
-    uint hash = map->hash(key);
-    uint indexB = hash & mask(map->log2capB);
-    ChainedMapBucket *bucketB = _ChainedMap_get(map, map->tableB, indexB, key);
-    void *old_value;
-    if (bucketB != NULL)
+    if (left == NULL || right == NULL)
     {
-        old_value = bucketB->value;
-        bucketB->value = value;
-        return old_value;
+        *height = (left == NULL)? right_height : left_height;
+        return (left == NULL)? right : left;
     }
-    if (map->tableA != NULL)
+    void *root, *next;
+    if (left_height == right_height)
     {
-        uint indexA = hash & mask(map->log2capA);
-        ChainedMapBucket *bucketA =
-            _ChainedMap_get(map, map->tableA, indexA, key);
-        if (bucketA != NULL)
+        *height = left_height;
+        if (_BTree_balance(left, right, left_height))
+            return left;
+        root = left;
+        next = right;
+    }
+    else if (left_height > right_height)
+    {
+        *height = left_height;
+        root = left;
+        next = _BTree_join_right(left, left_height, right, right_height,
+                                 right_size);
+    }
+    else
+    {
+        *height = right_height;
+        root = right;
+        next = _BTree_join_left(right, right_height, left, left_height,
+                                left_size);
+    }
+    if (next == NULL)
+        return root;
+    BTreeBranch *branch = _BTree_new_node(*height + 1);
+    uint next_size = _BTree_total(next, *height);
+    _BTree_insert_child(branch, 0, root, left_size + right_size - next_size);
+    _BTree_insert_child(branch, 1, next, next_size);
+    (*height)++;
+    return branch;
+}
+
+// Split the tree under node into the first index values and the rest. On the
+// way back up, each level's children left and right of the split are joined
+// onto the two halves from below.
+static void _BTree_split(void *node, uint height, uint index,
+                         void **left, uint *left_height,
+                         void **right, uint *right_height)
+{
+    if (height == 0)
+    {
+        BTreeLeaf *leaf = node;
+        *left_height = *right_height = 0;
+        *left = (index == 0)? NULL : leaf;
+        *right = (index == leaf->count)? NULL : leaf;
+        if (index > 0 && index < leaf->count)
         {
-            old_value = bucketB->value;
-            bucketA->value = value;
-            return old_value;
+            BTreeLeaf *next = _BTree_new_node(0);
+            _BTree_move(next, 0, leaf, index, leaf->count - index, 0);
+            next->count = leaf->count - index;
+            leaf->count = index;
+            next->prev = leaf;
+            next->next = leaf->next;
+            if (leaf->next != NULL)
+                leaf->next->prev = next;
+            leaf->next = next;
+            *right = next;
         }
+        return;
+    }
+    BTreeBranch *branch = node;
+    uint i = _BTree_child(branch, &index);
+    void *child_left, *child_right;
+    uint child_left_height, child_right_height;
+    uint child_size = branch->sizes[i];
+    _BTree_split(branch->children[i], height - 1, index,
+                 &child_left, &child_left_height,
+                 &child_right, &child_right_height);
+    // branch keeps the children before i; those after move to a new branch
+    BTreeBranch *after = _BTree_new_node(height);
+    _BTree_move(after, 0, branch, i + 1, branch->count - i - 1, height);
+    after->count = branch->count - i - 1;
+    branch->count = i;
+    uint before_size = _BTree_total(branch, height);
+    uint after_size = _BTree_total(after, height);
+    uint before_height = height, after_height = height;
+    void *before = _BTree_trim(branch, &before_height);
+    void *rest = _BTree_trim(after, &after_height);
+    *left = _BTree_join(before, before_height, before_size,
+                        child_left, child_left_height, index, left_height);
+    *right = _BTree_join(child_right, child_right_height, child_size - index,
+                         rest, after_height, after_size, right_height);
+}
+
+static BTreeLeaf *_BTree_first_leaf(void *root, uint height)
+{
+    for (; height > 0; height--)
+        root = ((BTreeBranch*)root)->children[0];
+    return root;
+}
+
+static BTreeLeaf *_BTree_last_leaf(void *root, uint height)
+{
+    for (; height > 0; height--)
+    {
+        BTreeBranch *branch = root;
+        root = branch->children[branch->count - 1];
+    }
+    return root;
+}
+
+// Handle negative indices, returning false when out of bounds
+static inline bool _BTreeList_bound(BTreeList *list, int *index, uint size)
+{
+    if (*index < 0)
+        *index += (int)list->size;
+    return *index >= 0 && (uint)*index < size;
+}
+
+void *BTreeList_index(BTreeList *list, int index)
+{
+    assert(list != NULL);
+    if (!_BTreeList_bound(list, &index, list->size))
+        return NULL;
+    void *node = list->root;
+    uint height, offset = index;
+    for (height = list->height; height > 0; height--)
+    {
+        BTreeBranch *branch = node;
+        node = branch->children[_BTree_child(branch, &offset)];
+    }
+    return ((BTreeLeaf*)node)->values[offset];
+}
+
+// Inserts before the value currently at index; index may equal the size
+bool BTreeList_insert(BTreeList *list, int index, void *value)
+{
+    assert(list != NULL);
+    if (!_BTreeList_bound(list, &index, list->size + 1))
+        return false;
+    if (list->root == NULL)
+    {
+        list->root = _BTree_new_node(0);
+        list->height = 0;
+    }
+    void *next = _BTree_insert(list->root, list->height, index, value);
+    list->size++;
+    if (next != NULL) // grow a new root
+    {
+        BTreeBranch *root = _BTree_new_node(list->height + 1);
+        uint next_size = _BTree_total(next, list->height);
+        _BTree_insert_child(root, 0, list->root, list->size - next_size);
+        _BTree_insert_child(root, 1, next, next_size);
+        list->root = root;
+        list->height++;
+    }
+    return true;
+}
+
+bool BTreeList_add(BTreeList *list, void *value)
+{
+    return BTreeList_insert(list, list->size, value);
+}
+
+void *BTreeList_remove(BTreeList *list, int index)
+{
+    assert(list != NULL);
+    if (!_BTreeList_bound(list, &index, list->size))
+        return NULL;
+    void *value = _BTree_remove(list->root, list->height, index);
+    list->size--;
+    list->root = _BTree_trim(list->root, &list->height);
+    return value;
+}
+
+// Leaves list with the values before index and returns a new list of the rest
+BTreeList *BTreeList_split(BTreeList *list, int index)
+{
+    assert(list != NULL);
+    BTreeList *rest = BTreeList_new();
+    if (!_BTreeList_bound(list, &index, list->size + 1) ||
+        (uint)index == list->size)
+        return rest;
+    void *left, *right;
+    uint left_height, right_height;
+    _BTree_split(list->root, list->height, index,
+                 &left, &left_height, &right, &right_height);
+    // cut the chain of leaves between the two
+    BTreeLeaf *first = _BTree_first_leaf(right, right_height);
+    if (first->prev != NULL)
+        first->prev->next = NULL;
+    first->prev = NULL;
+    rest->root = right;
+    rest->height = right_height;
+    rest->size = list->size - index;
+    list->root = left;
+    list->height = (left == NULL)? 0 : left_height;
+    list->size = index;
+    return rest;
+}
+
+// Moves all of other's values onto the end of list and deletes other
+void BTreeList_concat(BTreeList *list, BTreeList *other)
+{
+    assert(list != NULL && other != NULL);
+    if (list->root != NULL && other->root != NULL)
+    {
+        BTreeLeaf *last = _BTree_last_leaf(list->root, list->height);
+        BTreeLeaf *first = _BTree_first_leaf(other->root, other->height);
+        last->next = first;
+        first->prev = last;
+    }
+    list->root = _BTree_join(list->root, list->height, list->size,
+                             other->root, other->height, other->size,
+                             &list->height);
+    list->size += other->size;
+    free(other);
+}
+
+// Starts at the value at index
+BTreeListIterator BTreeList_iter(BTreeList *list, int index)
+{
+    assert(list != NULL);
+    BTreeListIterator iter;
+    iter.leaf = NULL;
+    iter.index = 0;
+    if (!_BTreeList_bound(list, &index, list->size))
+        return iter;
+    void *node = list->root;
+    uint height, offset = index;
+    for (height = list->height; height > 0; height--)
+    {
+        BTreeBranch *branch = node;
+        node = branch->children[_BTree_child(branch, &offset)];
+    }
+    iter.leaf = node;
+    iter.index = offset;
+    return iter;
+}
+
+void **BTreeList_iter_next(BTreeListIterator *iter)
+{
+    while (iter->leaf != NULL && iter->index >= iter->leaf->count)
+    {
+        iter->leaf = iter->leaf->next;
+        iter->index = 0;
+    }
+    if (iter->leaf == NULL)
+        return NULL;
+    return &iter->leaf->values[iter->index++];
+}
+
+static void _BTree_free(void *node, uint height)
+{
+    if (height > 0)
+    {
+        BTreeBranch *branch = node;
+        uint i;
+        for (i = 0; i < branch->count; i++)
+            _BTree_free(branch->children[i], height - 1);
+    }
+    free(node);
+}
+
+void BTreeList_del(BTreeList *list)
+{
+    assert(list != NULL);
+    if (list->root != NULL)
+        _BTree_free(list->root, list->height);
+    free(list);
+}
+
+void BTreeList_test()
+{
+    BTreeList *list = BTreeList_new();
+    uint i;
+    // Test insert()
+    BTreeList_insert(list, 0, (void*)1);
+    BTreeList_insert(list, 0, (void*)2);
+    BTreeList_insert(list, 1, (void*)3);
+    BTreeList_insert(list, 1, (void*)4);
+    BTreeList_insert(list, 1, (void*)5);
+    BTreeList_insert(list, 1, (void*)6);
+    // Test index()
+    CU_ASSERT(BTreeList_index(list, 0) == (void*)2);
+    CU_ASSERT(BTreeList_index(list, -1) == (void*)1);
+    CU_ASSERT(BTreeList_index(list, 5) == (void*)1);
+    // Test remove()
+    BTreeList_remove(list, 3);
+    CU_ASSERT(BTreeList_index(list, 0) == (void*)2);
+    CU_ASSERT(BTreeList_index(list, -1) == (void*)1);
+    CU_ASSERT(BTreeList_index(list, 5) == NULL);
+    BTreeList_del(list);
+
+    // Build a few levels of tree, then edit the middle
+    list = BTreeList_new();
+    for (i = 0; i < 10000; i++)
+        BTreeList_add(list, (void*)i);
+    CU_ASSERT(list->height >= 2);
+    BTreeList_insert(list, 5000, (void*)100000);
+    CU_ASSERT(BTreeList_index(list, 5000) == (void*)100000);
+    CU_ASSERT(BTreeList_index(list, 5001) == (void*)5000);
+    for (i = 0; i < 3000; i++)
+        BTreeList_remove(list, 4000);
+    CU_ASSERT(list->size == 7001);
+    CU_ASSERT(BTreeList_index(list, 4000) == (void*)6999);
+    // Test split() and concat() by moving the front to the back
+    BTreeList *rest = BTreeList_split(list, 1234);
+    CU_ASSERT(list->size == 1234 && rest->size == 5767);
+    CU_ASSERT(BTreeList_index(rest, 0) == (void*)1234);
+    BTreeList_concat(rest, list);
+    CU_ASSERT(rest->size == 7001);
+    CU_ASSERT(BTreeList_index(rest, -1) == (void*)1233);
+    BTreeListIterator iter = BTreeList_iter(rest, 5767);
+    void **slot;
+    bool ok = true;
+    for (i = 0; (slot = BTreeList_iter_next(&iter)) != NULL; i++)
+        ok = ok && *slot == (void*)i;
+    CU_ASSERT(ok && i == 1234);
+    BTreeList_del(rest);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PVector
+// A persistent vector: a 32-way trie of leaves plus a tail leaf. Versions
+// share nodes, which are reference counted. A node is only changed in place
+// while nothing else refers to it, and is copied first otherwise, so that a
+// version can never see another's changes.
+////////////////////////////////////////////////////////////////////////////////
+
+#define PVECTOR_MASK (PVECTOR_WIDTH - 1)
+
+static PVectorNode *_PVector_new_node()
+{
+    PVectorNode *node = calloc(1, sizeof(PVectorNode));
+    node->refs = 1;
+    return node;
+}
+
+static inline void _PVector_retain(PVectorNode *node)
+{
+    __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Drop a reference to a node at the given level, 0 being the leaves
+static void _PVector_release(PVectorNode *node, uint level)
+{
+    if (node == NULL || __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    if (level > 0)
+    {
+        uint i;
+        for (i = 0; i < PVECTOR_WIDTH; i++)
+            _PVector_release(node->slots[i], level - PVECTOR_BITS);
+    }
+    free(node);
+}
+
+// Return a node that can be changed in place, copying it if it is shared
+static PVectorNode *_PVector_own(PVectorNode *node, uint level)
+{
+    if (__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 1)
+        return node;
+    PVectorNode *copy = _PVector_new_node();
+    memcpy(copy->slots, node->slots, sizeof(node->slots));
+    if (level > 0)
+    {
+        uint i;
+        for (i = 0; i < PVECTOR_WIDTH; i++)
+            if (copy->slots[i] != NULL)
+                _PVector_retain(copy->slots[i]);
+    }
+    _PVector_release(node, level);
+    return copy;
+}
+
+// Index of the first value in the tail
+static inline uint _PVector_tail_offset(PVector *vec)
+{
+    if (vec->size < PVECTOR_WIDTH)
+        return 0;
+    return (vec->size - 1) & ~(uint)PVECTOR_MASK;
+}
+
+PVector *PVector_new()
+{
+    PVector *vec = malloc(sizeof(PVector));
+    vec->size = 0;
+    vec->shift = PVECTOR_BITS;
+    vec->root = _PVector_new_node();
+    vec->tail = _PVector_new_node();
+    return vec;
+}
+
+PVector *PVector_copy(PVector *vec)
+{
+    PVector *copy = malloc(sizeof(PVector));
+    *copy = *vec;
+    _PVector_retain(vec->root);
+    _PVector_retain(vec->tail);
+    return copy;
+}
+
+void *PVector_index(PVector *vec, int index)
+{
+    int size = (int)vec->size;
+    if (index < 0)
+        index += size;
+    if (index < 0 || index >= size) // check bounds
+        return NULL;
+    if ((uint)index >= _PVector_tail_offset(vec))
+        return vec->tail->slots[index & PVECTOR_MASK];
+    PVectorNode *node = vec->root;
+    uint level;
+    for (level = vec->shift; level > 0; level -= PVECTOR_BITS)
+        node = node->slots[(index >> level) & PVECTOR_MASK];
+    return node->slots[index & PVECTOR_MASK];
+}
+
+// A chain of new nodes down from level to leaf
+static PVectorNode *_PVector_new_path(uint level, PVectorNode *leaf)
+{
+    if (level == 0)
+        return leaf;
+    PVectorNode *node = _PVector_new_node();
+    node->slots[0] = _PVector_new_path(level - PVECTOR_BITS, leaf);
+    return node;
+}
+
+// Put a full tail leaf into the trie as the leaf holding index
+static PVectorNode *_PVector_push_leaf(PVectorNode *node, uint level,
+                                       uint index, PVectorNode *leaf)
+{
+    node = _PVector_own(node, level);
+    uint i = (index >> level) & PVECTOR_MASK;
+    if (level == PVECTOR_BITS)
+        node->slots[i] = leaf;
+    else if (node->slots[i] != NULL)
+        node->slots[i] = _PVector_push_leaf(node->slots[i], level - PVECTOR_BITS,
+                                            index, leaf);
+    else
+        node->slots[i] = _PVector_new_path(level - PVECTOR_BITS, leaf);
+    return node;
+}
+
+void PVector_push(PVector *vec, void *value)
+{
+    uint tail_size = vec->size - _PVector_tail_offset(vec);
+    if (tail_size < PVECTOR_WIDTH)
+    {
+        vec->tail = _PVector_own(vec->tail, 0);
+        vec->tail->slots[tail_size] = value;
+        vec->size++;
+        return;
+    }
+    // The tail is full, so it moves into the trie, which our reference to it
+    // now belongs to
+    if ((vec->size >> PVECTOR_BITS) > (1ul << vec->shift)) // the root is full
+    {
+        PVectorNode *root = _PVector_new_node();
+        root->slots[0] = vec->root;
+        root->slots[1] = _PVector_new_path(vec->shift, vec->tail);
+        vec->root = root;
+        vec->shift += PVECTOR_BITS;
+    }
+    else
+        vec->root = _PVector_push_leaf(vec->root, vec->shift, vec->size - 1,
+                                       vec->tail);
+    vec->tail = _PVector_new_node();
+    vec->tail->slots[0] = value;
+    vec->size++;
+}
+
+static PVectorNode *_PVector_update(PVectorNode *node, uint level, uint index,
+                                    void *value)
+{
+    node = _PVector_own(node, level);
+    uint i = (index >> level) & PVECTOR_MASK;
+    if (level == 0)
+        node->slots[i] = value;
+    else
+        node->slots[i] = _PVector_update(node->slots[i], level - PVECTOR_BITS,
+                                         index, value);
+    return node;
+}
+
+bool PVector_update(PVector *vec, int index, void *value)
+{
+    int size = (int)vec->size;
+    if (index < 0)
+        index += size;
+    if (index < 0 || index >= size) // check bounds
+        return false;
+    if ((uint)index >= _PVector_tail_offset(vec))
+    {
+        vec->tail = _PVector_own(vec->tail, 0);
+        vec->tail->slots[index & PVECTOR_MASK] = value;
+    }
+    else
+        vec->root = _PVector_update(vec->root, vec->shift, index, value);
+    return true;
+}
+
+PVector *PVector_add(PVector *vec, void *value)
+{
+    PVector *version = PVector_copy(vec);
+    PVector_push(version, value);
+    return version;
+}
+
+PVector *PVector_set(PVector *vec, int index, void *value)
+{
+    PVector *version = PVector_copy(vec);
+    if (!PVector_update(version, index, value))
+    {
+        PVector_del(version);
+        return NULL;
+    }
+    return version;
+}
+
+// The leaf holding index, which must be in the trie rather than the tail
+static PVectorNode *_PVector_leaf(PVector *vec, uint index)
+{
+    PVectorNode *node = vec->root;
+    uint level;
+    for (level = vec->shift; level > 0; level -= PVECTOR_BITS)
+        node = node->slots[(index >> level) & PVECTOR_MASK];
+    return node;
+}
+
+// Appends b's values to a copy of a, a leaf at a time. After the first push
+// copies a's tail path, the rest change the new version in place.
+PVector *PVector_concat(PVector *a, PVector *b)
+{
+    PVector *vec = PVector_copy(a);
+    uint tail_offset = _PVector_tail_offset(b), i, j;
+    for (i = 0; i < b->size; i += PVECTOR_WIDTH)
+    {
+        PVectorNode *leaf = (i < tail_offset)? _PVector_leaf(b, i) : b->tail;
+        uint count = min(b->size - i, PVECTOR_WIDTH);
+        for (j = 0; j < count; j++)
+            PVector_push(vec, leaf->slots[j]);
+    }
+    return vec;
+}
+
+void PVector_del(PVector *vec)
+{
+    _PVector_release(vec->root, vec->shift);
+    _PVector_release(vec->tail, 0);
+    free(vec);
+}
+
+void PVector_test()
+{
+    PVector *vec = PVector_new();
+    uint i;
+    for (i = 0; i < 5000; i++)
+        PVector_push(vec, (void*)i);
+    CU_ASSERT(vec->size == 5000);
+    CU_ASSERT(PVector_index(vec, 4321) == (void*)4321);
+    CU_ASSERT(PVector_index(vec, -1) == (void*)4999);
+    CU_ASSERT(PVector_index(vec, 5000) == NULL);
+    // Changes to a snapshot leave the original alone, and vice versa
+    PVector *snapshot = PVector_copy(vec);
+    PVector_update(vec, 100, (void*)1000000);
+    PVector_update(vec, -1, (void*)1000001);
+    for (i = 0; i < 2000; i++)
+        PVector_push(vec, (void*)i);
+    CU_ASSERT(PVector_index(vec, 100) == (void*)1000000);
+    CU_ASSERT(PVector_index(vec, 4999) == (void*)1000001);
+    CU_ASSERT(PVector_index(snapshot, 100) == (void*)100);
+    CU_ASSERT(PVector_index(snapshot, 4999) == (void*)4999);
+    CU_ASSERT(snapshot->size == 5000 && vec->size == 7000);
+    PVector *added = PVector_add(snapshot, (void*)5000);
+    PVector *set = PVector_set(added, 0, (void*)7);
+    CU_ASSERT(snapshot->size == 5000 && added->size == 5001);
+    CU_ASSERT(PVector_index(added, 0) == (void*)0);
+    CU_ASSERT(PVector_index(set, 0) == (void*)7);
+    CU_ASSERT(PVector_set(set, 5001, NULL) == NULL);
+    PVector *joined = PVector_concat(set, vec);
+    CU_ASSERT(joined->size == 12001);
+    CU_ASSERT(PVector_index(joined, 5000) == (void*)5000);
+    CU_ASSERT(PVector_index(joined, 5001 + 100) == (void*)1000000);
+    CU_ASSERT(PVector_index(joined, -1) == (void*)1999);
+    PVector_del(vec);
+    PVector_del(snapshot);
+    PVector_del(added);
+    CU_ASSERT(PVector_index(joined, 4999) == (void*)4999);
+    PVector_del(set);
+    PVector_del(joined);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MPMCQueue
+// A bounded lock-free multi-producer multi-consumer ring queue, after Dmitry
+// Vyukov's design: each cell carries a sequence number saying whether it is
+// ready to be written or read on the current lap around the ring.
+////////////////////////////////////////////////////////////////////////////////
+
+#if defined(__linux__)
+// syscall() is only declared with _DEFAULT_SOURCE, which would clash with our
+// own uint typedef
+long syscall(long number, ...);
+
+static inline void _futex_wait(unsigned int *address, unsigned int expected)
+{
+    syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static inline void _futex_wake(unsigned int *address)
+{
+    syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 0x7fffffff, NULL, NULL, 0);
+}
+#else
+static inline void _futex_wait(unsigned int *address, unsigned int expected)
+{
+    sched_yield();
+}
+
+static inline void _futex_wake(unsigned int *address)
+{
+}
+#endif
+
+// Wake everyone waiting on the event, but only pay for the syscall when
+// somebody actually is
+static void _QueueEvent_signal(QueueEvent *event)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&event->waiters, __ATOMIC_SEQ_CST) == 0)
+        return;
+    __atomic_add_fetch(&event->sequence, 1, __ATOMIC_SEQ_CST);
+    _futex_wake(&event->sequence);
+}
+
+// Sleep until try(queue, value) succeeds
+static void _QueueEvent_wait(QueueEvent *event, bool (*try)(void*, void**),
+                             void *queue, void **value)
+{
+    while (!try(queue, value))
+    {
+        unsigned int sequence = __atomic_load_n(&event->sequence, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&event->waiters, 1, __ATOMIC_SEQ_CST);
+        // check again now that a signal can no longer be missed
+        bool done = try(queue, value);
+        if (!done)
+            _futex_wait(&event->sequence, sequence);
+        __atomic_sub_fetch(&event->waiters, 1, __ATOMIC_SEQ_CST);
+        if (done)
+            return;
+    }
+}
+
+MPMCQueue *MPMCQueue_new(uint log2cap)
+{
+    MPMCQueue *queue = malloc(sizeof(MPMCQueue));
+    queue->mask = mask(log2cap);
+    queue->cells = malloc(pow2(log2cap) * sizeof(MPMCQueueCell));
+    uint i;
+    for (i = 0; i < pow2(log2cap); i++)
+        queue->cells[i].sequence = i;
+    queue->enqueue_pos = 0;
+    queue->dequeue_pos = 0;
+    queue->not_empty.sequence = queue->not_empty.waiters = 0;
+    queue->not_full.sequence = queue->not_full.waiters = 0;
+    return queue;
+}
+
+// Claim up to n cells starting at the enqueue (or dequeue) position. A cell is
+// ready when its sequence is pos + lap, where lap is 0 for producers and 1 for
+// consumers. Returns the first position claimed.
+static uint _MPMCQueue_claim(MPMCQueue *queue, uint *position, uint lap,
+                             uint *n)
+{
+    uint pos = __atomic_load_n(position, __ATOMIC_RELAXED);
+    while (true)
+    {
+        uint count = 0;
+        while (count < *n)
+        {
+            MPMCQueueCell *cell = &queue->cells[(pos + count) & queue->mask];
+            uint sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+            if (sequence != pos + count + lap)
+                break;
+            count++;
+        }
+        if (count == 0)
+        {
+            // either the queue is full (or empty), or we fell behind
+            uint sequence = __atomic_load_n(
+                &queue->cells[pos & queue->mask].sequence, __ATOMIC_ACQUIRE);
+            if ((long)(sequence - (pos + lap)) < 0)
+            {
+                *n = 0;
+                return pos;
+            }
+            pos = __atomic_load_n(position, __ATOMIC_RELAXED);
+            continue;
+        }
+        // on failure pos is reloaded with the current position
+        if (__atomic_compare_exchange_n(position, &pos, pos + count, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            *n = count;
+            return pos;
+        }
+    }
+}
+
+uint MPMCQueue_enqueue_batch(MPMCQueue *queue, void **values, uint n)
+{
+    uint pos = _MPMCQueue_claim(queue, &queue->enqueue_pos, 0, &n);
+    uint i;
+    for (i = 0; i < n; i++)
+    {
+        MPMCQueueCell *cell = &queue->cells[(pos + i) & queue->mask];
+        cell->value = values[i];
+        __atomic_store_n(&cell->sequence, pos + i + 1, __ATOMIC_RELEASE);
+    }
+    if (n > 0)
+        _QueueEvent_signal(&queue->not_empty);
+    return n;
+}
+
+uint MPMCQueue_dequeue_batch(MPMCQueue *queue, void **values, uint n)
+{
+    uint pos = _MPMCQueue_claim(queue, &queue->dequeue_pos, 1, &n);
+    uint i;
+    for (i = 0; i < n; i++)
+    {
+        MPMCQueueCell *cell = &queue->cells[(pos + i) & queue->mask];
+        values[i] = cell->value;
+        // ready for the producer on the next lap
+        __atomic_store_n(&cell->sequence, pos + i + queue->mask + 1,
+                         __ATOMIC_RELEASE);
+    }
+    if (n > 0)
+        _QueueEvent_signal(&queue->not_full);
+    return n;
+}
+
+bool MPMCQueue_enqueue(MPMCQueue *queue, void *value)
+{
+    return MPMCQueue_enqueue_batch(queue, &value, 1) == 1;
+}
+
+bool MPMCQueue_dequeue(MPMCQueue *queue, void **value)
+{
+    return MPMCQueue_dequeue_batch(queue, value, 1) == 1;
+}
+
+static bool _MPMCQueue_try_enqueue(void *queue, void **value)
+{
+    return MPMCQueue_enqueue(queue, *value);
+}
+
+static bool _MPMCQueue_try_dequeue(void *queue, void **value)
+{
+    return MPMCQueue_dequeue(queue, value);
+}
+
+void MPMCQueue_enqueue_wait(MPMCQueue *queue, void *value)
+{
+    _QueueEvent_wait(&queue->not_full, _MPMCQueue_try_enqueue, queue, &value);
+}
+
+void *MPMCQueue_dequeue_wait(MPMCQueue *queue)
+{
+    void *value;
+    _QueueEvent_wait(&queue->not_empty, _MPMCQueue_try_dequeue, queue, &value);
+    return value;
+}
+
+void MPMCQueue_del(MPMCQueue *queue)
+{
+    free(queue->cells);
+    free(queue);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SPSCQueue
+// The single-producer single-consumer fast path: with only one thread on each
+// end, positions are owned outright and no compare-and-swap is needed. Each
+// side caches the other's position so that it rarely touches its cache line.
+////////////////////////////////////////////////////////////////////////////////
+
+SPSCQueue *SPSCQueue_new(uint log2cap)
+{
+    SPSCQueue *queue = malloc(sizeof(SPSCQueue));
+    queue->mask = mask(log2cap);
+    queue->values = malloc(pow2(log2cap) * sizeof(void*));
+    queue->head = queue->cached_tail = 0;
+    queue->tail = queue->cached_head = 0;
+    queue->not_empty.sequence = queue->not_empty.waiters = 0;
+    queue->not_full.sequence = queue->not_full.waiters = 0;
+    return queue;
+}
+
+uint SPSCQueue_enqueue_batch(SPSCQueue *queue, void **values, uint n)
+{
+    uint tail = queue->tail;
+    uint capacity = queue->mask + 1;
+    if (tail - queue->cached_head + n > capacity)
+    {
+        queue->cached_head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        n = min(n, capacity - (tail - queue->cached_head));
+    }
+    uint i;
+    for (i = 0; i < n; i++)
+        queue->values[(tail + i) & queue->mask] = values[i];
+    __atomic_store_n(&queue->tail, tail + n, __ATOMIC_RELEASE);
+    if (n > 0)
+        _QueueEvent_signal(&queue->not_empty);
+    return n;
+}
+
+uint SPSCQueue_dequeue_batch(SPSCQueue *queue, void **values, uint n)
+{
+    uint head = queue->head;
+    if (queue->cached_tail - head < n)
+    {
+        queue->cached_tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+        n = min(n, queue->cached_tail - head);
+    }
+    uint i;
+    for (i = 0; i < n; i++)
+        values[i] = queue->values[(head + i) & queue->mask];
+    __atomic_store_n(&queue->head, head + n, __ATOMIC_RELEASE);
+    if (n > 0)
+        _QueueEvent_signal(&queue->not_full);
+    return n;
+}
+
+bool SPSCQueue_enqueue(SPSCQueue *queue, void *value)
+{
+    return SPSCQueue_enqueue_batch(queue, &value, 1) == 1;
+}
+
+bool SPSCQueue_dequeue(SPSCQueue *queue, void **value)
+{
+    return SPSCQueue_dequeue_batch(queue, value, 1) == 1;
+}
+
+static bool _SPSCQueue_try_enqueue(void *queue, void **value)
+{
+    return SPSCQueue_enqueue(queue, *value);
+}
+
+static bool _SPSCQueue_try_dequeue(void *queue, void **value)
+{
+    return SPSCQueue_dequeue(queue, value);
+}
+
+void SPSCQueue_enqueue_wait(SPSCQueue *queue, void *value)
+{
+    _QueueEvent_wait(&queue->not_full, _SPSCQueue_try_enqueue, queue, &value);
+}
+
+void *SPSCQueue_dequeue_wait(SPSCQueue *queue)
+{
+    void *value;
+    _QueueEvent_wait(&queue->not_empty, _SPSCQueue_try_dequeue, queue, &value);
+    return value;
+}
+
+void SPSCQueue_del(SPSCQueue *queue)
+{
+    free(queue->values);
+    free(queue);
+}
+
+// Producers each send the numbers 1..n, which consumers add up
+typedef struct
+{
+    MPMCQueue *mpmc;
+    SPSCQueue *spsc;
+    uint n, total;
+} _QueueTest;
+
+static void _QueueTest_mpmc(void *test_ptr, uint t)
+{
+    _QueueTest *test = test_ptr;
+    uint i;
+    if (t % 2 == 0)
+    {
+        for (i = 1; i <= test->n; i++)
+            MPMCQueue_enqueue_wait(test->mpmc, (void*)i);
+    }
+    else
+    {
+        uint total = 0;
+        for (i = 0; i < test->n; i++)
+            total += (uint)MPMCQueue_dequeue_wait(test->mpmc);
+        __atomic_add_fetch(&test->total, total, __ATOMIC_RELAXED);
+    }
+}
+
+static void _QueueTest_spsc(void *test_ptr, uint t)
+{
+    _QueueTest *test = test_ptr;
+    void *batch[16];
+    uint i, j;
+    if (t == 0)
+    {
+        for (i = 1; i <= test->n; i += 16)
+        {
+            for (j = 0; j < 16; j++)
+                batch[j] = (void*)(i + j);
+            for (j = 0; j < 16; j += SPSCQueue_enqueue_batch(test->spsc,
+                                                           batch + j, 16 - j));
+        }
+    }
+    else
+    {
+        for (i = 0; i < test->n; i++)
+            test->total += (uint)SPSCQueue_dequeue_wait(test->spsc);
+    }
+}
+
+void Queue_test()
+{
+    MPMCQueue *mpmc = MPMCQueue_new(4);
+    void *value;
+    void *values[20];
+    uint i;
+    CU_ASSERT(!MPMCQueue_dequeue(mpmc, &value));
+    for (i = 0; i < 20; i++)
+        values[i] = (void*)(i + 1);
+    CU_ASSERT(MPMCQueue_enqueue_batch(mpmc, values, 20) == 16);
+    CU_ASSERT(!MPMCQueue_enqueue(mpmc, values[0]));
+    CU_ASSERT(MPMCQueue_dequeue_batch(mpmc, values, 3) == 3);
+    CU_ASSERT(values[2] == (void*)3);
+    CU_ASSERT(MPMCQueue_dequeue(mpmc, &value) && value == (void*)4);
+    
+    _QueueTest test;
+    test.n = 100000;
+    test.total = 0;
+    test.mpmc = MPMCQueue_new(6);
+    _parallel_run(4, _QueueTest_mpmc, &test);
+    CU_ASSERT(test.total == 2 * (test.n * (test.n + 1) / 2));
+    MPMCQueue_del(test.mpmc);
+    
+    test.total = 0;
+    test.spsc = SPSCQueue_new(6);
+    _parallel_run(2, _QueueTest_spsc, &test);
+    CU_ASSERT(test.total == test.n * (test.n + 1) / 2);
+    SPSCQueue_del(test.spsc);
+    MPMCQueue_del(mpmc);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ThreadPool
+// Runs parallel loops on a fixed set of threads. Each thread keeps a deque of
+// index ranges: it splits ranges in half until they are no bigger than the
+// grain or its deque is full, pushing the halves it isn't working on, and
+// takes the most recent back once done. Idle threads steal the oldest, and so largest, range from
+// another thread's deque.
+////////////////////////////////////////////////////////////////////////////////
+
+#define POOL_DEQUE 64 // ranges per thread's deque
+
+typedef struct
+{
+    uint begin, end;
+} _PoolRange;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    uint top, bottom; // the ranges waiting are ranges[top..bottom)
+    _PoolRange ranges[POOL_DEQUE];
+} _PoolDeque;
+
+typedef struct
+{
+    ThreadPool *pool;
+    uint index;
+} _PoolWorker;
+
+struct threadPool
+{
+    uint nthreads; // including whichever thread calls ThreadPool_run()
+    pthread_t *threads;
+    _PoolWorker *workers;
+    _PoolDeque *deques;
+    pthread_mutex_t run_lock; // one loop at a time
+    pthread_mutex_t lock; // guards generation and stopping
+    pthread_cond_t wake;
+    uint generation; // bumped for each new loop
+    bool stopping;
+    // The current loop
+    void (*fn)(void*, uint, uint);
+    void *arg;
+    uint grain;
+    uint remaining; // number of indices not yet done
+};
+
+static bool _PoolDeque_push(_PoolDeque *deque, _PoolRange range)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == POOL_DEQUE && deque->top > 0) // slide down
+    {
+        memmove(deque->ranges, deque->ranges + deque->top,
+                (deque->bottom - deque->top) * sizeof(_PoolRange));
+        deque->bottom -= deque->top;
+        deque->top = 0;
+    }
+    bool pushed = deque->bottom < POOL_DEQUE;
+    if (pushed)
+        deque->ranges[deque->bottom++] = range;
+    pthread_mutex_unlock(&deque->lock);
+    return pushed;
+}
+
+// The owner pops the newest range
+static bool _PoolDeque_pop(_PoolDeque *deque, _PoolRange *range)
+{
+    pthread_mutex_lock(&deque->lock);
+    bool popped = deque->bottom > deque->top;
+    if (popped)
+        *range = deque->ranges[--deque->bottom];
+    if (deque->bottom == deque->top)
+        deque->top = deque->bottom = 0;
+    pthread_mutex_unlock(&deque->lock);
+    return popped;
+}
+
+// Thieves take the oldest
+static bool _PoolDeque_steal(_PoolDeque *deque, _PoolRange *range)
+{
+    pthread_mutex_lock(&deque->lock);
+    bool stolen = deque->bottom > deque->top;
+    if (stolen)
+        *range = deque->ranges[deque->top++];
+    pthread_mutex_unlock(&deque->lock);
+    return stolen;
+}
+
+// The pools whose loops this thread is working on, innermost first
+typedef struct _PoolFrame
+{
+    ThreadPool *pool;
+    struct _PoolFrame *outer;
+} _PoolFrame;
+
+static __thread _PoolFrame *_PoolFrame_current;
+
+// Work on the current loop as thread w until every index is done
+static void _ThreadPool_work(ThreadPool *pool, uint w)
+{
+    _PoolDeque *deque = &pool->deques[w];
+    _PoolFrame frame = {pool, _PoolFrame_current};
+    _PoolFrame_current = &frame;
+    while (__atomic_load_n(&pool->remaining, __ATOMIC_ACQUIRE) > 0)
+    {
+        _PoolRange range;
+        bool found = _PoolDeque_pop(deque, &range);
+        uint i;
+        for (i = 1; !found && i < pool->nthreads; i++)
+            found = _PoolDeque_steal(&pool->deques[(w + i) % pool->nthreads],
+                                     &range);
+        if (!found)
+        {
+            sched_yield();
+            continue;
+        }
+        while (range.end - range.begin > pool->grain)
+        {
+            uint middle = range.begin + ((range.end - range.begin) >> 1);
+            _PoolRange upper = {middle, range.end};
+            if (!_PoolDeque_push(deque, upper))
+                break;
+            range.end = middle;
+        }
+        pool->fn(pool->arg, range.begin, range.end);
+        __atomic_sub_fetch(&pool->remaining, range.end - range.begin,
+                           __ATOMIC_RELEASE);
+    }
+    _PoolFrame_current = frame.outer;
+}
+
+static void *_ThreadPool_thread(void *worker_ptr)
+{
+    _PoolWorker *worker = worker_ptr;
+    ThreadPool *pool = worker->pool;
+    uint seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (true)
+    {
+        while (pool->generation == seen && !pool->stopping)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->stopping)
+            break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        _ThreadPool_work(pool, worker->index);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+ThreadPool *ThreadPool_new(uint nthreads)
+{
+    ThreadPool *pool = malloc(sizeof(ThreadPool));
+    pool->nthreads = max(nthreads, 1);
+    pool->threads = malloc(pool->nthreads * sizeof(pthread_t));
+    pool->workers = malloc(pool->nthreads * sizeof(_PoolWorker));
+    pool->deques = malloc(pool->nthreads * sizeof(_PoolDeque));
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pool->generation = 0;
+    pool->stopping = false;
+    pool->remaining = 0;
+    uint i;
+    for (i = 0; i < pool->nthreads; i++)
+    {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->deques[i].top = pool->deques[i].bottom = 0;
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+    }
+    for (i = 1; i < pool->nthreads; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, _ThreadPool_thread,
+                           &pool->workers[i]) != 0)
+        {
+            // Make do with the threads already started
+            uint j;
+            for (j = i; j < pool->nthreads; j++)
+                pthread_mutex_destroy(&pool->deques[j].lock);
+            pool->nthreads = i;
+        }
+    }
+    return pool;
+}
+
+static ThreadPool *_ThreadPool_shared;
+
+static void _ThreadPool_shared_init()
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    _ThreadPool_shared = ThreadPool_new((ncpus > 0)? (uint)ncpus : 1);
+}
+
+ThreadPool *ThreadPool_shared()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, _ThreadPool_shared_init);
+    return _ThreadPool_shared;
+}
+
+uint ThreadPool_size(ThreadPool *pool)
+{
+    return pool->nthreads;
+}
+
+void ThreadPool_run(ThreadPool *pool, void (*fn)(void*, uint, uint), void *arg,
+                    uint size, uint grain)
+{
+    if (size == 0)
+        return;
+    if (pool == NULL)
+        pool = ThreadPool_shared();
+    // A loop started from inside one on the same pool would wait on itself
+    _PoolFrame *frame;
+    for (frame = _PoolFrame_current; frame != NULL; frame = frame->outer)
+    {
+        if (frame->pool == pool)
+        {
+            fn(arg, 0, size);
+            return;
+        }
+    }
+    pthread_mutex_lock(&pool->run_lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->grain = max(grain, 1);
+    __atomic_store_n(&pool->remaining, size, __ATOMIC_RELEASE);
+    // Start each thread off with an equal share
+    uint i;
+    for (i = 0; i < pool->nthreads; i++)
+    {
+        _PoolRange range = {size * i / pool->nthreads,
+                            size * (i + 1) / pool->nthreads};
+        if (range.end > range.begin)
+            _PoolDeque_push(&pool->deques[i], range);
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    _ThreadPool_work(pool, 0);
+    pthread_mutex_unlock(&pool->run_lock);
+}
+
+void ThreadPool_del(ThreadPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    uint i;
+    for (i = 1; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+    for (i = 0; i < pool->nthreads; i++)
+        pthread_mutex_destroy(&pool->deques[i].lock);
+    pthread_mutex_destroy(&pool->run_lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool->deques);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ArrayList
+// A dynamically growing/shrinking array list
+////////////////////////////////////////////////////////////////////////////////
+
+#if defined(__linux__)
+// mremap() and madvise() are only declared with _GNU_SOURCE or
+// _DEFAULT_SOURCE, which would clash with our own uint typedef
+void *mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...);
+int madvise(void *address, size_t length, int advice);
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS 0x20
+#endif
+#ifndef MREMAP_MAYMOVE
+#define MREMAP_MAYMOVE 1
+#endif
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+#endif
+
+// Arrays of at least this many bytes are mapped directly, in multiples of the
+// huge page size, so that growing them remaps pages instead of copying bytes
+#define ARRAYLIST_MAP_BYTES (2ul << 20)
+
+static void _ArrayList_resize(ArrayList *list, uint cap)
+{
+    size_t bytes = cap * sizeof(void*);
+#if defined(__linux__)
+    if (bytes >= ARRAYLIST_MAP_BYTES)
+    {
+        size_t mapbytes = (bytes + ARRAYLIST_MAP_BYTES - 1) & ~(ARRAYLIST_MAP_BYTES - 1);
+        void *array;
+        if (list->mapped)
+        {
+            array = mremap(list->array, list->cap * sizeof(void*), mapbytes,
+                           MREMAP_MAYMOVE);
+        }
+        else
+        {
+            array = mmap(NULL, mapbytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (array != MAP_FAILED)
+            {
+                memcpy(array, list->array, list->size * sizeof(void*));
+                free(list->array);
+            }
+        }
+        if (array != MAP_FAILED)
+        {
+            madvise(array, mapbytes, MADV_HUGEPAGE); // only a hint
+            list->array = array;
+            list->cap = mapbytes / sizeof(void*);
+            list->mapped = true;
+            return;
+        }
+        // Out of mappings, so fall back to the heap
+    }
+    if (list->mapped) // shrinking below the mapping threshold, or remap failed
+    {
+        void **array = malloc(bytes);
+        memcpy(array, list->array, min(list->size, cap) * sizeof(void*));
+        munmap(list->array, list->cap * sizeof(void*));
+        list->array = array;
+        list->cap = cap;
+        list->mapped = false;
+        return;
+    }
+#endif
+    list->array = (void**)realloc(list->array, bytes);
+    list->cap = cap;
+}
+
+static ArrayList *_ArrayList_new(int cap)
+{
+    ArrayList *list = malloc(sizeof(ArrayList));
+    list->size = 0;
+    list->cap = 0;
+    list->mapped = false;
+    list->array = NULL;
+    _ArrayList_resize(list, cap);
+    return list;
+}
+
+ArrayList *ArrayList_new()
+{
+    return _ArrayList_new(8);
+}
+
+void *ArrayList_index(ArrayList *list, int index)
+{
+    int size = (int)list->size;
+    if (index < 0)
+        index += size;
+    if (index < 0 || index >= size) // check bounds
+        return NULL;
+    return list->array[index];
+}
+
+void ArrayList_growby(ArrayList *list, int additional_cap)
+{
+    _ArrayList_resize(list, list->cap + additional_cap);
+}
+
+void ArrayList_reserve(ArrayList *list, uint cap)
+{
+    if (cap > list->cap)
+        _ArrayList_resize(list, cap);
+}
+
+void ArrayList_shrink_to_fit(ArrayList *list)
+{
+    _ArrayList_resize(list, max(list->size, 1));
+}
+
+void ArrayList_grow(ArrayList *list)
+{
+    ArrayList_growby(list, max(list->cap >> 1, 1));
+}
+
+void ArrayList_add(ArrayList *list, void *item)
+{
+    if (list->size >= list->cap)
+        ArrayList_grow(list);
+    list->array[list->size++] = item;
+}
+
+void *ArrayList_pop(ArrayList *list)
+{
+    if (list->size == 0)
+        return NULL;
+    return list->array[--list->size];
+}
+
+void *ArrayList_remove(ArrayList *list, int index)
+{
+    int size = (int)list->size;
+    if (index < 0)
+        index += size;
+    if (index < 0 || index >= size) // check bounds
+        return NULL;
+    void **dest = list->array + index;
+    void *value = *dest;
+    memmove(dest, dest + 1, (list->size - index - 1) * sizeof(void*));
+    list->size--;
+    return value;
+}
+
+bool ArrayList_insert(ArrayList *list, int index, void *value)
+{
+    if ((list->size == 0 && index == 0) || index == -1)
+    {
+        ArrayList_add(list, value);
+        return true;
+    }
+    int size = (int)list->size;
+    if (index < 0)
+        index += size;
+    if (index < 0 || index >= size) // check bounds
+        return false;
+    if (list->size >= list->cap)
+        ArrayList_grow(list);
+    void **dest = list->array + index;
+    memmove(dest + 1, dest, (list->size - index) * sizeof(void*));
+    list->size++;
+    *dest = value;
+    return true;
+}
+
+// Compare pointers a vector at a time where the CPU allows. A vector's mask
+// has a bit set for each lane that compared equal.
+#if defined(__AVX2__) && UINTPTR_MAX == 0xFFFFFFFFFFFFFFFFu
+#define PTRVEC_LANES 4
+typedef __m256i _PtrVec;
+#define _PtrVec_set1(_ptr) _mm256_set1_epi64x((long long)(_ptr))
+#define _PtrVec_load(_array) _mm256_loadu_si256((__m256i*)(_array))
+#define _PtrVec_or(_a, _b) _mm256_or_si256(_a, _b)
+#define _PtrVec_eq(_a, _b) _mm256_cmpeq_epi64(_a, _b)
+#define _PtrVec_mask(_v) (uint)_mm256_movemask_pd(_mm256_castsi256_pd(_v))
+#elif defined(__SSE2__) && UINTPTR_MAX == 0xFFFFFFFFFFFFFFFFu
+#define PTRVEC_LANES 2
+typedef __m128i _PtrVec;
+#define _PtrVec_set1(_ptr) _mm_set1_epi64x((long long)(_ptr))
+#define _PtrVec_load(_array) _mm_loadu_si128((__m128i*)(_array))
+#define _PtrVec_or(_a, _b) _mm_or_si128(_a, _b)
+#define _PtrVec_mask(_v) (uint)_mm_movemask_pd(_mm_castsi128_pd(_v))
+// SSE2 has no 64-bit compare, so both 32-bit halves must compare equal
+static inline __m128i _PtrVec_eq(__m128i a, __m128i b)
+{
+    __m128i eq = _mm_cmpeq_epi32(a, b);
+    return _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+#endif
+
+#define FIND_ANY_SIMD 16 // above this many values find_any() binary searches
+
+// Index of the first occurrence of value, or size if there is none
+static uint _ArrayList_scan(void **array, uint size, void *value)
+{
+    uint i = 0;
+#if defined(PTRVEC_LANES)
+    _PtrVec needle = _PtrVec_set1(value);
+    // Check four vectors per branch
+    for (; i + 4 * PTRVEC_LANES <= size; i += 4 * PTRVEC_LANES)
+    {
+        _PtrVec eq0 = _PtrVec_eq(_PtrVec_load(array + i), needle);
+        _PtrVec eq1 = _PtrVec_eq(_PtrVec_load(array + i + PTRVEC_LANES), needle);
+        _PtrVec eq2 = _PtrVec_eq(_PtrVec_load(array + i + 2 * PTRVEC_LANES), needle);
+        _PtrVec eq3 = _PtrVec_eq(_PtrVec_load(array + i + 3 * PTRVEC_LANES), needle);
+        if (_PtrVec_mask(_PtrVec_or(_PtrVec_or(eq0, eq1), _PtrVec_or(eq2, eq3))))
+        {
+            uint found = _PtrVec_mask(eq0) |
+                         _PtrVec_mask(eq1) << PTRVEC_LANES |
+                         _PtrVec_mask(eq2) << (2 * PTRVEC_LANES) |
+                         _PtrVec_mask(eq3) << (3 * PTRVEC_LANES);
+            return i + __builtin_ctz(found);
+        }
+    }
+    for (; i + PTRVEC_LANES <= size; i += PTRVEC_LANES)
+    {
+        uint found = _PtrVec_mask(_PtrVec_eq(_PtrVec_load(array + i), needle));
+        if (found)
+            return i + __builtin_ctz(found);
+    }
+#endif
+    for (; i < size; i++)
+        if (array[i] == value)
+            return i;
+    return size;
+}
+
+int ArrayList_find(ArrayList *list, void *value)
+{
+    uint i = _ArrayList_scan(list->array, list->size, value);
+    return (i == list->size)? -1 : (int)i;
+}
+
+bool ArrayList_has(ArrayList *list, void *value)
+{
+    return (ArrayList_find(list, value) == -1)?false:true;
+}
+
+static void _ArrayList_sort(void **array, uint size, int (*cmp)(void*,void*));
+
+static bool _ArrayList_bsearch(void **sorted, uint size, void *value)
+{
+    while (size > 0)
+    {
+        uint half = size >> 1;
+        if ((uint)sorted[half] < (uint)value)
+        {
+            sorted += half + 1;
+            size -= half + 1;
+        }
+        else
+            size = half;
+    }
+    return *sorted == value;
+}
+
+int ArrayList_find_any(ArrayList *list, void **values, uint k)
+{
+    void **array = list->array;
+    uint size = list->size, i = 0;
+    if (k == 0)
+        return -1;
+    if (k > FIND_ANY_SIMD)
+    {
+        // Look each value up in a sorted copy of the values. The copy keeps
+        // one extra slot so that a search past the end reads something.
+        void **sorted = malloc((k + 1) * sizeof(void*));
+        memcpy(sorted, values, k * sizeof(void*));
+        _ArrayList_sort(sorted, k, ptrorder);
+        sorted[k] = sorted[k - 1];
+        for (; i < size; i++)
+            if (_ArrayList_bsearch(sorted, k, array[i]))
+                break;
+        free(sorted);
+        return (i == size)? -1 : (int)i;
+    }
+#if defined(PTRVEC_LANES)
+    _PtrVec needles[FIND_ANY_SIMD];
+    uint j;
+    for (j = 0; j < k; j++)
+        needles[j] = _PtrVec_set1(values[j]);
+    for (; i + PTRVEC_LANES <= size; i += PTRVEC_LANES)
+    {
+        _PtrVec v = _PtrVec_load(array + i);
+        _PtrVec eq = _PtrVec_eq(v, needles[0]);
+        for (j = 1; j < k; j++)
+            eq = _PtrVec_or(eq, _PtrVec_eq(v, needles[j]));
+        uint found = _PtrVec_mask(eq);
+        if (found)
+            return i + __builtin_ctz(found);
+    }
+#endif
+    for (; i < size; i++)
+    {
+        uint j;
+        for (j = 0; j < k; j++)
+            if (array[i] == values[j])
+                return i;
+    }
+    return -1;
+}
+
+uint ArrayList_count(ArrayList *list, void *value)
+{
+    void **array = list->array;
+    uint size = list->size, i = 0, count = 0;
+#if defined(PTRVEC_LANES)
+    _PtrVec needle = _PtrVec_set1(value);
+    for (; i + PTRVEC_LANES <= size; i += PTRVEC_LANES)
+        count += __builtin_popcount(
+            _PtrVec_mask(_PtrVec_eq(_PtrVec_load(array + i), needle)));
+#endif
+    for (; i < size; i++)
+        count += (array[i] == value);
+    return count;
+}
+
+ArrayList *ArrayList_join(ArrayList *listA, ArrayList *listB)
+{
+    ArrayList *newlist = _ArrayList_new(listA->cap + listB->cap);
+    memcpy(newlist->array, listA->array, listA->size * sizeof(void*));
+    memcpy(newlist->array + listA->size, listB->array, listB->size * sizeof(void*));
+    newlist->size = listA->size + listB->size;
+    return newlist;
+}
+
+void ArrayList_reverse(ArrayList *list)
+{
+    uint size = list->size;
+    uint i;
+    for (i = 0; i < (size >> 1); i++)
+        swap(list[i], list[size - 1 - i]);
+}
+
+#define SORT_INSERTION 24 // below this many values use insertion sort
+#define SORT_BLOCK 64 // values classified at a time by the block partition
+#define SORT_PARALLEL 4096 // below this many values sort on one thread
+
+static void _ArrayList_insertion_sort(void **array, uint size,
+                                      int (*cmp)(void*,void*))
+{
+    uint i;
+    for (i = 1; i < size; i++)
+    {
+        void *value = array[i];
+        uint j = i;
+        for (; j > 0 && cmp(value, array[j - 1]) < 0; j--)
+            array[j] = array[j - 1];
+        array[j] = value;
+    }
+}
+
+static void _ArrayList_sift_down(void **array, uint root, uint size,
+                                 int (*cmp)(void*,void*))
+{
+    uint child;
+    while ((child = 2 * root + 1) < size)
+    {
+        if (child + 1 < size && cmp(array[child], array[child + 1]) < 0)
+            child++;
+        if (cmp(array[root], array[child]) >= 0)
+            return;
+        swap(array[root], array[child]);
+        root = child;
+    }
+}
+
+static void _ArrayList_heap_sort(void **array, uint size,
+                                 int (*cmp)(void*,void*))
+{
+    uint i;
+    for (i = size >> 1; i > 0; i--)
+        _ArrayList_sift_down(array, i - 1, size, cmp);
+    for (i = size - 1; i > 0; i--)
+    {
+        swap(array[0], array[i]);
+        _ArrayList_sift_down(array, 0, i, cmp);
+    }
+}
+
+// Order a, b and c so that the median ends up in b
+static void _ArrayList_sort3(void **a, void **b, void **c,
+                             int (*cmp)(void*,void*))
+{
+    if (cmp(*b, *a) < 0)
+        swap(*a, *b);
+    if (cmp(*c, *b) < 0)
+    {
+        swap(*b, *c);
+        if (cmp(*b, *a) < 0)
+            swap(*a, *b);
+    }
+}
+
+// Partition array[1..size) around the pivot in array[0], which is then moved
+// to its final position and that position returned. Values equal to the pivot
+// go right. Full blocks on each side are classified without branching into
+// lists of misplaced offsets, which are then swapped pairwise; whatever is
+// left over is finished with a plain Hoare partition.
+static uint _ArrayList_partition(void **array, uint size,
+                                 int (*cmp)(void*,void*))
+{
+    void *pivot = array[0];
+    void **left = array + 1, **right = array + size; // unpartitioned values
+    uchar offsets_left[SORT_BLOCK], offsets_right[SORT_BLOCK];
+    uint num_left = 0, num_right = 0, start_left = 0, start_right = 0;
+    uint i;
+    while (right - left > 2 * SORT_BLOCK)
+    {
+        if (num_left == 0)
+        {
+            start_left = 0;
+            for (i = 0; i < SORT_BLOCK; i++)
+            {
+                offsets_left[num_left] = i;
+                num_left += cmp(left[i], pivot) >= 0;
+            }
+        }
+        if (num_right == 0)
+        {
+            start_right = 0;
+            for (i = 0; i < SORT_BLOCK; i++)
+            {
+                offsets_right[num_right] = i;
+                num_right += cmp(right[-1 - (int)i], pivot) < 0;
+            }
+        }
+        uint num = min(num_left, num_right);
+        for (i = 0; i < num; i++)
+            swap(left[offsets_left[start_left + i]],
+                 right[-1 - (int)offsets_right[start_right + i]]);
+        num_left -= num;
+        num_right -= num;
+        start_left += num;
+        start_right += num;
+        if (num_left == 0)
+            left += SORT_BLOCK;
+        if (num_right == 0)
+            right -= SORT_BLOCK;
+    }
+    // A block with offsets left over has not been moved past, so its values
+    // are simply looked at again here
+    while (true)
+    {
+        while (left < right && cmp(*left, pivot) < 0)
+            left++;
+        while (left < right && cmp(right[-1], pivot) >= 0)
+            right--;
+        if (left >= right)
+            break;
+        right--;
+        swap(*left, *right);
+        left++;
+    }
+    left--;
+    swap(array[0], *left);
+    return left - array;
+}
+
+// Move the values equal to the pivot in array[0] to the left, for when the
+// pivot is known to be the smallest value. Returns the size of the left side.
+static uint _ArrayList_partition_equal(void **array, uint size,
+                                       int (*cmp)(void*,void*))
+{
+    void *pivot = array[0];
+    uint i, left = 1;
+    for (i = 1; i < size; i++)
+        if (cmp(pivot, array[i]) >= 0)
+        {
+            swap(array[left], array[i]);
+            left++;
+        }
+    return left;
+}
+
+// Introsort: quicksort that switches to heap sort once depth runs out. If the
+// pivot equals the value just before this range, which is no larger than
+// anything in the range, the run of equal values is split off and skipped.
+static void _ArrayList_introsort(void **array, uint size, bool leftmost,
+                                 uint depth, int (*cmp)(void*,void*))
+{
+    while (size > SORT_INSERTION)
+    {
+        if (depth == 0)
+        {
+            _ArrayList_heap_sort(array, size, cmp);
+            return;
+        }
+        depth--;
+        uint half = size >> 1;
+        if (size > 128) // median of medians of three
+        {
+            uint eighth = size >> 3;
+            _ArrayList_sort3(array, array + eighth, array + 2 * eighth, cmp);
+            _ArrayList_sort3(array + half - eighth, array + half,
+                             array + half + eighth, cmp);
+            _ArrayList_sort3(array + size - 1 - 2 * eighth,
+                             array + size - 1 - eighth, array + size - 1, cmp);
+            _ArrayList_sort3(array + eighth, array + half,
+                             array + size - 1 - eighth, cmp);
+        }
+        else
+            _ArrayList_sort3(array, array + half, array + size - 1, cmp);
+        swap(array[0], array[half]);
+        if (!leftmost && cmp(array[-1], array[0]) >= 0)
+        {
+            uint equal = _ArrayList_partition_equal(array, size, cmp);
+            array += equal;
+            size -= equal;
+            continue;
+        }
+        uint pivot = _ArrayList_partition(array, size, cmp);
+        // Recurse into the smaller side and loop on the larger
+        if (pivot < size - pivot)
+        {
+            _ArrayList_introsort(array, pivot, leftmost, depth, cmp);
+            array += pivot + 1;
+            size -= pivot + 1;
+            leftmost = false;
+        }
+        else
+        {
+            _ArrayList_introsort(array + pivot + 1, size - pivot - 1, false,
+                                 depth, cmp);
+            size = pivot;
+        }
+    }
+    _ArrayList_insertion_sort(array, size, cmp);
+}
+
+static void _ArrayList_sort(void **array, uint size, int (*cmp)(void*,void*))
+{
+    uint depth = 0;
+    uint n;
+    for (n = size; n > 1; n >>= 1)
+        depth += 2;
+    _ArrayList_introsort(array, size, true, depth, cmp);
+}
+
+void ArrayList_sort(ArrayList *list, int (*cmp)(void*,void*))
+{
+    assert(list != NULL);
+    _ArrayList_sort(list->array, list->size, cmp);
+}
+
+typedef struct
+{
+    void **src, **dest;
+    uint size;
+    uint width; // size of the sorted runs being merged
+    uint nslices; // how many pieces each round of merging is split into
+    int (*cmp)(void*,void*);
+} _ParallelSort;
+
+// Sorts runs first to last-1
+static void _ArrayList_sort_runs(void *sort_ptr, uint first, uint last)
+{
+    _ParallelSort *sort = sort_ptr;
+    uint t;
+    for (t = first; t < last; t++)
+    {
+        uint begin = min(t * sort->width, sort->size);
+        uint end = min(begin + sort->width, sort->size);
+        _ArrayList_sort(sort->src + begin, end - begin, sort->cmp);
+    }
+}
+
+// How many of the first i values of the merge of a and b come from a. Ties
+// are taken from a first.
+static uint _ArrayList_corank(uint i, void **a, uint size_a, void **b,
+                              uint size_b, int (*cmp)(void*,void*))
+{
+    uint low = (i > size_b)? i - size_b : 0, high = min(i, size_a);
+    while (low < high)
+    {
+        uint j = (low + high) >> 1;
+        if (cmp(b[i - j - 1], a[j]) < 0)
+            high = j;
+        else
+            low = j + 1;
+    }
+    return low;
+}
+
+// Each slice of the output is written in one go, whichever merges it falls
+// in. The slice ends are split between the two runs by binary search.
+static void _ArrayList_merge_slice(_ParallelSort *sort, uint t)
+{
+    uint size = sort->size, width = sort->width;
+    uint begin = size * t / sort->nslices;
+    uint end = size * (t + 1) / sort->nslices;
+    uint pair;
+    for (pair = begin - begin % (2 * width); pair < end; pair += 2 * width)
+    {
+        uint middle = min(pair + width, size), stop = min(pair + 2 * width, size);
+        void **a = sort->src + pair, **b = sort->src + middle;
+        uint size_a = middle - pair, size_b = stop - middle;
+        uint first = max(begin, pair) - pair, last = min(end, stop) - pair;
+        uint ia = _ArrayList_corank(first, a, size_a, b, size_b, sort->cmp);
+        uint ja = _ArrayList_corank(last, a, size_a, b, size_b, sort->cmp);
+        uint ib = first - ia, jb = last - ja;
+        void **out = sort->dest + pair + first;
+        while (ia < ja && ib < jb)
+        {
+            if (sort->cmp(b[ib], a[ia]) < 0)
+                *out++ = b[ib++];
+            else
+                *out++ = a[ia++];
+        }
+        memcpy(out, a + ia, (ja - ia) * sizeof(void*));
+        memcpy(out + (ja - ia), b + ib, (jb - ib) * sizeof(void*));
+    }
+}
+
+static void _ArrayList_merge_slices(void *sort_ptr, uint first, uint last)
+{
+    uint t;
+    for (t = first; t < last; t++)
+        _ArrayList_merge_slice(sort_ptr, t);
+}
+
+// Sort a run per thread, then merge pairs of runs until one is left. Every
+// round of merging is spread evenly over all the threads.
+void ArrayList_sort_parallel(ArrayList *list, int (*cmp)(void*,void*),
+                             ThreadPool *pool)
+{
+    assert(list != NULL);
+    if (pool == NULL)
+        pool = ThreadPool_shared();
+    uint nthreads = ThreadPool_size(pool);
+    if (nthreads <= 1 || list->size < SORT_PARALLEL)
+    {
+        ArrayList_sort(list, cmp);
+        return;
+    }
+    _ParallelSort sort;
+    sort.src = list->array;
+    sort.dest = malloc(list->size * sizeof(void*));
+    sort.size = list->size;
+    sort.width = (list->size + nthreads - 1) / nthreads;
+    sort.nslices = nthreads;
+    sort.cmp = cmp;
+    ThreadPool_run(pool, _ArrayList_sort_runs, &sort, nthreads, 1);
+    for (; sort.width < sort.size; sort.width <<= 1)
+    {
+        ThreadPool_run(pool, _ArrayList_merge_slices, &sort, nthreads, 1);
+        swap(sort.src, sort.dest);
+    }
+    if (sort.src != list->array)
+    {
+        memcpy(list->array, sort.src, list->size * sizeof(void*));
+        sort.dest = sort.src;
+    }
+    free(sort.dest);
+}
+
+// Stable LSD radix sort on a byte at a time of key(value), or of the value
+// itself if key is NULL. Bytes on which every key agrees are skipped.
+void ArrayList_radix_sort(ArrayList *list, uint (*key)(void*))
+{
+    assert(list != NULL);
+    uint size = list->size;
+    if (size < 2)
+        return;
+    uint counts[sizeof(uint)][256];
+    memset(counts, 0, sizeof(counts));
+    uint i, digit;
+    for (i = 0; i < size; i++)
+    {
+        uint k = (key == NULL)? (uint)list->array[i] : key(list->array[i]);
+        for (digit = 0; digit < sizeof(uint); digit++)
+            counts[digit][(k >> (8 * digit)) & 0xff]++;
+    }
+    void **src = list->array, **dest = malloc(size * sizeof(void*));
+    for (digit = 0; digit < sizeof(uint); digit++)
+    {
+        uint *count = counts[digit];
+        uint shift = 8 * digit;
+        uint k = (key == NULL)? (uint)src[0] : key(src[0]);
+        if (count[(k >> shift) & 0xff] == size)
+            continue;
+        uint offset = 0, b;
+        for (b = 0; b < 256; b++) // counts become starting offsets
+        {
+            uint c = count[b];
+            count[b] = offset;
+            offset += c;
+        }
+        for (i = 0; i < size; i++)
+        {
+            k = (key == NULL)? (uint)src[i] : key(src[i]);
+            dest[count[(k >> shift) & 0xff]++] = src[i];
+        }
+        swap(src, dest);
+    }
+    if (src != list->array)
+    {
+        memcpy(list->array, src, size * sizeof(void*));
+        dest = src;
+    }
+    free(dest);
+}
+
+#define PARALLEL_GRAIN 1024 // values per task in the parallel ArrayList loops
+
+typedef struct
+{
+    ArrayList *list, *result;
+    void *fn;
+    void *arg;
+    uchar *keep; // filter() marks the values it keeps
+    uint *offsets; // and where each block's values go
+    void **partials; // reduce() results for each block
+} _ParallelList;
+
+static void _ArrayList_for_range(void *job_ptr, uint begin, uint end)
+{
+    _ParallelList *job = job_ptr;
+    void (*fn)(void*, void**) = job->fn;
+    uint i;
+    for (i = begin; i < end; i++)
+        fn(job->arg, &job->list->array[i]);
+}
+
+void ArrayList_parallel_for(ArrayList *list, void (*fn)(void*, void**),
+                            void *arg, ThreadPool *pool)
+{
+    _ParallelList job = {list, NULL, fn, arg, NULL, NULL, NULL};
+    ThreadPool_run(pool, _ArrayList_for_range, &job, list->size,
+                   PARALLEL_GRAIN);
+}
+
+static void _ArrayList_map_range(void *job_ptr, uint begin, uint end)
+{
+    _ParallelList *job = job_ptr;
+    void *(*fn)(void*, void*) = job->fn;
+    uint i;
+    for (i = begin; i < end; i++)
+        job->result->array[i] = fn(job->arg, job->list->array[i]);
+}
+
+ArrayList *ArrayList_map(ArrayList *list, void *(*fn)(void*, void*),
+                         void *arg, ThreadPool *pool)
+{
+    ArrayList *result = _ArrayList_new(max(list->size, 8));
+    result->size = list->size;
+    _ParallelList job = {list, result, fn, arg, NULL, NULL, NULL};
+    ThreadPool_run(pool, _ArrayList_map_range, &job, list->size,
+                   PARALLEL_GRAIN);
+    return result;
+}
+
+// Filter first counts the values kept in each block, then writes them out at
+// offsets given by a prefix sum of the counts
+static void _ArrayList_filter_count(void *job_ptr, uint begin, uint end)
+{
+    _ParallelList *job = job_ptr;
+    bool (*keep)(void*, void*) = job->fn;
+    uint block;
+    for (block = begin; block < end; block++)
+    {
+        uint i = block * PARALLEL_GRAIN;
+        uint stop = min(i + PARALLEL_GRAIN, job->list->size);
+        uint count = 0;
+        for (; i < stop; i++)
+        {
+            job->keep[i] = keep(job->arg, job->list->array[i]) != false;
+            count += job->keep[i];
+        }
+        job->offsets[block + 1] = count;
+    }
+}
+
+static void _ArrayList_filter_write(void *job_ptr, uint begin, uint end)
+{
+    _ParallelList *job = job_ptr;
+    uint block;
+    for (block = begin; block < end; block++)
+    {
+        uint i = block * PARALLEL_GRAIN;
+        uint stop = min(i + PARALLEL_GRAIN, job->list->size);
+        void **out = job->result->array + job->offsets[block];
+        for (; i < stop; i++)
+            if (job->keep[i])
+                *out++ = job->list->array[i];
+    }
+}
+
+ArrayList *ArrayList_filter(ArrayList *list, bool (*keep)(void*, void*),
+                            void *arg, ThreadPool *pool)
+{
+    uint nblocks = (list->size + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+    _ParallelList job = {list, NULL, keep, arg, NULL, NULL, NULL};
+    job.keep = malloc(max(list->size, 1));
+    job.offsets = malloc((nblocks + 1) * sizeof(uint));
+    job.offsets[0] = 0;
+    ThreadPool_run(pool, _ArrayList_filter_count, &job, nblocks, 1);
+    uint block;
+    for (block = 0; block < nblocks; block++)
+        job.offsets[block + 1] += job.offsets[block];
+    job.result = _ArrayList_new(max(job.offsets[nblocks], 8));
+    job.result->size = job.offsets[nblocks];
+    ThreadPool_run(pool, _ArrayList_filter_write, &job, nblocks, 1);
+    free(job.keep);
+    free(job.offsets);
+    return job.result;
+}
+
+static void _ArrayList_reduce_range(void *job_ptr, uint begin, uint end)
+{
+    _ParallelList *job = job_ptr;
+    void *(*fn)(void*, void*, void*) = job->fn;
+    uint block;
+    for (block = begin; block < end; block++)
+    {
+        uint i = block * PARALLEL_GRAIN;
+        uint stop = min(i + PARALLEL_GRAIN, job->list->size);
+        void *partial = job->list->array[i++];
+        for (; i < stop; i++)
+            partial = fn(job->arg, partial, job->list->array[i]);
+        job->partials[block] = partial;
+    }
+}
+
+// fn must be associative: blocks are reduced in parallel and their results
+// then combined in order, starting from init
+void *ArrayList_reduce(ArrayList *list, void *(*fn)(void*, void*, void*),
+                       void *init, void *arg, ThreadPool *pool)
+{
+    uint nblocks = (list->size + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+    _ParallelList job = {list, NULL, fn, arg, NULL, NULL, NULL};
+    job.partials = malloc(max(nblocks, 1) * sizeof(void*));
+    ThreadPool_run(pool, _ArrayList_reduce_range, &job, nblocks, 1);
+    void *result = init;
+    uint block;
+    for (block = 0; block < nblocks; block++)
+        result = fn(arg, result, job.partials[block]);
+    free(job.partials);
+    return result;
+}
+
+void ArrayList_del(ArrayList *list)
+{
+#if defined(__linux__)
+    if (list->mapped)
+        munmap(list->array, list->cap * sizeof(void*));
+    else
+#endif
+        free(list->array);
+    free(list);
+}
+
+static uint _sort_key(void *value)
+{
+    return (uint)value >> 16;
+}
+
+static void _parallel_double(void *arg, void **value)
+{
+    *value = (void*)((uint)*value * 2);
+}
+
+static void *_parallel_increment(void *arg, void *value)
+{
+    return (void*)((uint)value + 1);
+}
+
+static void *_parallel_add(void *arg, void *a, void *b)
+{
+    return (void*)((uint)a + (uint)b + (uint)arg);
+}
+
+static bool _parallel_is_multiple(void *arg, void *value)
+{
+    return (uint)value % (uint)arg == 0;
+}
+
+static void _parallel_count(void *count, uint begin, uint end)
+{
+    __atomic_add_fetch((uint*)count, end - begin, __ATOMIC_RELAXED);
+}
+
+// Counts to the value with a loop on the pool the outer loop is running on
+static void _parallel_nested(void *pool, void **value)
+{
+    uint count = 0;
+    ThreadPool_run(pool, _parallel_count, &count, (uint)*value, 1);
+    *value = (void*)count;
+}
+
+void ArrayList_test()
+{
+    ArrayList *list = ArrayList_new();
+    // Test insert()
+    ArrayList_insert(list, 0, (void*)1);
+    ArrayList_insert(list, 0, (void*)2);
+    ArrayList_insert(list, 1, (void*)3);
+    ArrayList_insert(list, 1, (void*)4);
+    ArrayList_insert(list, 1, (void*)5);
+    ArrayList_insert(list, 1, (void*)6);
+    // Test index()
+    CU_ASSERT(ArrayList_index(list, 0) == (void*)2);
+    CU_ASSERT(ArrayList_index(list, -1) == (void*)1);
+    CU_ASSERT(ArrayList_index(list, 5) == (void*)1);
+    // Test remove()
+    ArrayList_remove(list, 3);
+    CU_ASSERT(ArrayList_index(list, 0) == (void*)2);
+    CU_ASSERT(ArrayList_index(list, -1) == (void*)1);
+    CU_ASSERT(ArrayList_index(list, 5) == NULL);
+    ArrayList_del(list);
+    // Test the sorts on a scrambled list with runs of equal values
+    uint i;
+    ArrayList *sorts[3];
+    for (i = 0; i < 3; i++)
+        sorts[i] = ArrayList_new();
+    for (i = 0; i < 20000; i++)
+    {
+        void *value = (void*)((((i * 7919) % 20000) / 4 << 16) | i);
+        ArrayList_add(sorts[0], value);
+        ArrayList_add(sorts[1], value);
+        ArrayList_add(sorts[2], value);
+    }
+    ArrayList_sort(sorts[0], _tagged_order);
+    ThreadPool *pool = ThreadPool_new(4);
+    ArrayList_sort_parallel(sorts[1], ptrorder, pool);
+    ArrayList_radix_sort(sorts[2], _sort_key);
+    bool ok = true;
+    for (i = 1; i < 20000; i++)
+    {
+        if (_tagged_order(sorts[0]->array[i - 1], sorts[0]->array[i]) > 0 ||
+            (uint)sorts[1]->array[i - 1] >= (uint)sorts[1]->array[i])
+            ok = false;
+        // the radix sort is stable, so equal keys keep their order
+        if ((uint)sorts[2]->array[i - 1] > (uint)sorts[2]->array[i])
+            ok = false;
+    }
+    CU_ASSERT(ok);
+    CU_ASSERT((uint)sorts[2]->array[19999] >> 16 == 4999);
+    // Test find(), find_any() and count()
+    void *needles[20];
+    for (i = 0; i < 20; i++)
+        needles[i] = (void*)(100000ul + i);
+    needles[19] = sorts[1]->array[777];
+    CU_ASSERT(ArrayList_find(sorts[1], needles[19]) == 777);
+    CU_ASSERT(ArrayList_find(sorts[1], needles[0]) == -1);
+    CU_ASSERT(ArrayList_find_any(sorts[1], needles, 19) == -1);
+    CU_ASSERT(ArrayList_find_any(sorts[1], needles, 20) == 777);
+    CU_ASSERT(ArrayList_find_any(sorts[1], needles + 16, 4) == 777);
+    CU_ASSERT(ArrayList_count(sorts[1], needles[19]) == 1);
+    for (i = 0; i < 20000; i += 3)
+        sorts[1]->array[i] = NULL;
+    CU_ASSERT(ArrayList_count(sorts[1], NULL) == 6667);
+    CU_ASSERT(ArrayList_has(sorts[1], NULL));
+    // Test growing past the mapping threshold and shrinking back below it
+    list = ArrayList_new();
+    ArrayList_reserve(list, 300000);
+    CU_ASSERT(list->cap >= 300000);
+    for (i = 0; i < 1000000; i++)
+        ArrayList_add(list, (void*)i);
+    CU_ASSERT(ArrayList_index(list, 999999) == (void*)999999);
+    CU_ASSERT(ArrayList_index(list, 123456) == (void*)123456);
+    list->size = 1000;
+    ArrayList_shrink_to_fit(list);
+    CU_ASSERT(list->cap == 1000);
+    CU_ASSERT(ArrayList_index(list, 999) == (void*)999);
+    ArrayList_del(list);
+    // Test adding after shrinking to a single slot
+    list = ArrayList_new();
+    ArrayList_add(list, (void*)1);
+    ArrayList_shrink_to_fit(list);
+    CU_ASSERT(list->cap == 1);
+    ArrayList_add(list, (void*)2);
+    ArrayList_add(list, (void*)3);
+    CU_ASSERT(list->size == 3 && list->cap >= 3);
+    CU_ASSERT(ArrayList_index(list, 2) == (void*)3);
+    ArrayList_del(list);
+    // Test the parallel loops on a pool, and on the shared pool
+    list = ArrayList_new();
+    for (i = 0; i < 100000; i++)
+        ArrayList_add(list, (void*)i);
+    ArrayList_parallel_for(list, _parallel_double, NULL, pool);
+    CU_ASSERT(ArrayList_index(list, 77777) == (void*)155554);
+    ArrayList *mapped = ArrayList_map(list, _parallel_increment, NULL, pool);
+    CU_ASSERT(mapped->size == 100000);
+    CU_ASSERT(ArrayList_index(mapped, 12345) == (void*)24691);
+    ArrayList *filtered = ArrayList_filter(list, _parallel_is_multiple,
+                                           (void*)6, NULL);
+    CU_ASSERT(filtered->size == 33334);
+    CU_ASSERT(ArrayList_index(filtered, 1) == (void*)6);
+    CU_ASSERT(ArrayList_index(filtered, -1) == (void*)199998);
+    CU_ASSERT(ArrayList_reduce(list, _parallel_add, (void*)0, NULL, pool) ==
+              (void*)(99999ul * 100000));
+    ArrayList_del(filtered);
+    ArrayList_del(mapped);
+    ArrayList_del(list);
+    // Test a loop on the pool from inside one on the same pool
+    list = ArrayList_new();
+    for (i = 0; i < 1000; i++)
+        ArrayList_add(list, (void*)i);
+    ArrayList_parallel_for(list, _parallel_nested, pool, pool);
+    CU_ASSERT(ArrayList_index(list, 0) == (void*)0);
+    CU_ASSERT(ArrayList_index(list, 999) == (void*)999);
+    ArrayList_del(list);
+    ThreadPool_del(pool);
+    for (i = 0; i < 3; i++)
+        ArrayList_del(sorts[i]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Vec
+// Vectors of inline values, defined in the header by DS_DEFINE_VEC
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+    int x, y;
+} _Point;
+
+DS_DEFINE_VEC(_PointVec, _Point)
+
+void Vec_test()
+{
+    _PointVec *vec = _PointVec_new();
+    int i;
+    for (i = 0; i < 100; i++)
+    {
+        _Point point = {i, -i};
+        _PointVec_add(vec, point);
+    }
+    CU_ASSERT(vec->size == 100);
+    CU_ASSERT(_PointVec_index(vec, -1)->x == 99);
+    CU_ASSERT(_PointVec_index(vec, 100) == NULL);
+    // Test insert() and remove()
+    _Point point = {1000, 1000};
+    CU_ASSERT(_PointVec_insert(vec, 1, point));
+    CU_ASSERT(_PointVec_find(vec, point) == 1);
+    CU_ASSERT(_PointVec_index(vec, 2)->x == 1);
+    CU_ASSERT(_PointVec_remove(vec, 0, &point) && point.x == 0);
+    CU_ASSERT(_PointVec_pop(vec, &point) && point.y == -99);
+    CU_ASSERT(vec->size == 99);
+    // Test reverse(), join() and take()
+    _PointVec_reverse(vec);
+    CU_ASSERT(_PointVec_index(vec, 0)->x == 98);
+    CU_ASSERT(_PointVec_index(vec, -1)->x == 1000);
+    _PointVec *taken = _PointVec_take(vec);
+    CU_ASSERT(vec->size == 0 && taken->size == 99);
+    _PointVec *joined = _PointVec_join(taken, taken);
+    CU_ASSERT(joined->size == 198 && _PointVec_index(joined, 99)->x == 98);
+    uint size;
+    _Point *array = _PointVec_release_buffer(joined, &size);
+    CU_ASSERT(size == 198 && array[197].x == 1000);
+    free(array);
+    _PointVec_del(taken);
+    _PointVec_del(vec);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ArrayDeque
+// A double-ended queue in a growable circular array
+////////////////////////////////////////////////////////////////////////////////
+
+ArrayDeque *ArrayDeque_new()
+{
+    ArrayDeque *deque = malloc(sizeof(ArrayDeque));
+    deque->first = 0;
+    deque->size = 0;
+    deque->cap = 8;
+    deque->array = malloc(deque->cap * sizeof(void*));
+    return deque;
+}
+
+// Grow to fit at least n more values. The values are unwrapped into the start
+// of the new array, so each value is copied once per growth.
+static void _ArrayDeque_reserve(ArrayDeque *deque, uint n)
+{
+    if (deque->size + n <= deque->cap)
+        return;
+    uint cap = deque->cap;
+    while (cap < deque->size + n)
+        cap <<= 1;
+    void **array = malloc(cap * sizeof(void*));
+    uint first_part = min(deque->size, deque->cap - deque->first);
+    memcpy(array, deque->array + deque->first, first_part * sizeof(void*));
+    memcpy(array + first_part, deque->array,
+           (deque->size - first_part) * sizeof(void*));
+    free(deque->array);
+    deque->array = array;
+    deque->cap = cap;
+    deque->first = 0;
+}
+
+void *ArrayDeque_index(ArrayDeque *deque, int index)
+{
+    int size = (int)deque->size;
+    if (index < 0)
+        index += size;
+    if (index < 0 || index >= size) // check bounds
+        return NULL;
+    return deque->array[(deque->first + index) & (deque->cap - 1)];
+}
+
+void ArrayDeque_add(ArrayDeque *deque, void *value)
+{
+    _ArrayDeque_reserve(deque, 1);
+    deque->array[(deque->first + deque->size) & (deque->cap - 1)] = value;
+    deque->size++;
+}
+
+void ArrayDeque_add_first(ArrayDeque *deque, void *value)
+{
+    _ArrayDeque_reserve(deque, 1);
+    deque->first = (deque->first - 1) & (deque->cap - 1);
+    deque->array[deque->first] = value;
+    deque->size++;
+}
+
+// Add n values to the end with at most two copies
+void ArrayDeque_add_all(ArrayDeque *deque, void **values, uint n)
+{
+    _ArrayDeque_reserve(deque, n);
+    uint end = (deque->first + deque->size) & (deque->cap - 1);
+    uint first_part = min(n, deque->cap - end);
+    memcpy(deque->array + end, values, first_part * sizeof(void*));
+    memcpy(deque->array, values + first_part, (n - first_part) * sizeof(void*));
+    deque->size += n;
+}
+
+void *ArrayDeque_pop(ArrayDeque *deque)
+{
+    if (deque->size == 0)
+        return NULL;
+    deque->size--;
+    return deque->array[(deque->first + deque->size) & (deque->cap - 1)];
+}
+
+void *ArrayDeque_pop_first(ArrayDeque *deque)
+{
+    if (deque->size == 0)
+        return NULL;
+    void *value = deque->array[deque->first];
+    deque->first = (deque->first + 1) & (deque->cap - 1);
+    deque->size--;
+    return value;
+}
+
+void ArrayDeque_del(ArrayDeque *deque)
+{
+    free(deque->array);
+    free(deque);
+}
+
+void ArrayDeque_test()
+{
+    ArrayDeque *deque = ArrayDeque_new();
+    uint i;
+    // Wrap around the end of the array before growing
+    for (i = 1; i <= 6; i++)
+        ArrayDeque_add(deque, (void*)i);
+    for (i = 1; i <= 4; i++)
+        CU_ASSERT(ArrayDeque_pop_first(deque) == (void*)i);
+    for (i = 7; i <= 12; i++)
+        ArrayDeque_add(deque, (void*)i);
+    ArrayDeque_add_first(deque, (void*)4);
+    void *values[20];
+    for (i = 0; i < 20; i++)
+        values[i] = (void*)(13 + i);
+    ArrayDeque_add_all(deque, values, 20);
+    CU_ASSERT(deque->size == 29);
+    CU_ASSERT(ArrayDeque_index(deque, 0) == (void*)4);
+    CU_ASSERT(ArrayDeque_index(deque, -1) == (void*)32);
+    CU_ASSERT(ArrayDeque_index(deque, 29) == NULL);
+    for (i = 4; i <= 32; i++)
+        CU_ASSERT(ArrayDeque_index(deque, i - 4) == (void*)i);
+    CU_ASSERT(ArrayDeque_pop(deque) == (void*)32);
+    CU_ASSERT(ArrayDeque_pop_first(deque) == (void*)4);
+    ArrayDeque_del(deque);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SlotMap
+// Values packed in a dense array, found through a sparse array of slots
+////////////////////////////////////////////////////////////////////////////////
+
+#define SLOTMAP_NONE 0xFFFFFFFFu // ends the free list
+
+SlotMap *SlotMap_new()
+{
+    SlotMap *map = malloc(sizeof(SlotMap));
+    map->size = 0;
+    map->cap = 8;
+    map->values = malloc(map->cap * sizeof(void*));
+    map->owners = malloc(map->cap * sizeof(uint32_t));
+    map->nslots = 0;
+    map->slots = NULL;
+    map->free = SLOTMAP_NONE;
+    return map;
+}
+
+static inline uint _SlotMap_handle(SlotMap *map, uint32_t slot)
+{
+    return ((uint)map->slots[slot].generation << 32) | slot;
+}
+
+// The slot a handle refers to, or NULL if it is stale or was never valid
+static inline SlotMapSlot *_SlotMap_slot(SlotMap *map, uint handle)
+{
+    uint32_t slot = (uint32_t)handle, generation = (uint32_t)(handle >> 32);
+    if (slot >= map->nslots || map->slots[slot].generation != generation ||
+        !(generation & 1))
+        return NULL;
+    return &map->slots[slot];
+}
+
+uint SlotMap_insert(SlotMap *map, void *value)
+{
+    uint32_t slot = map->free;
+    if (slot == SLOTMAP_NONE)
+    {
+        // the sparse array only grows when no freed slot can be reused
+        assert(map->nslots < SLOTMAP_NONE);
+        if ((map->nslots & (map->nslots - 1)) == 0) // a power of 2, or 0
+            map->slots = realloc(map->slots,
+                                 max(map->nslots << 1, 8) * sizeof(SlotMapSlot));
+        slot = map->nslots++;
+        map->slots[slot].generation = 0;
+    }
+    else
+        map->free = map->slots[slot].index;
+    if (map->size == map->cap)
+    {
+        map->cap <<= 1;
+        map->values = realloc(map->values, map->cap * sizeof(void*));
+        map->owners = realloc(map->owners, map->cap * sizeof(uint32_t));
+    }
+    map->values[map->size] = value;
+    map->owners[map->size] = slot;
+    map->slots[slot].index = map->size++;
+    map->slots[slot].generation++; // odd while in use
+    return _SlotMap_handle(map, slot);
+}
+
+bool SlotMap_has(SlotMap *map, uint handle)
+{
+    return _SlotMap_slot(map, handle) != NULL;
+}
+
+void *SlotMap_get(SlotMap *map, uint handle)
+{
+    SlotMapSlot *slot = _SlotMap_slot(map, handle);
+    return (slot == NULL)? NULL : map->values[slot->index];
+}
+
+bool SlotMap_set(SlotMap *map, uint handle, void *value)
+{
+    SlotMapSlot *slot = _SlotMap_slot(map, handle);
+    if (slot == NULL)
+        return false;
+    map->values[slot->index] = value;
+    return true;
+}
+
+// The handle of the value at a position in map->values
+uint SlotMap_handle_at(SlotMap *map, uint index)
+{
+    assert(index < map->size);
+    return _SlotMap_handle(map, map->owners[index]);
+}
+
+// The last value moves into the removed one's place, so removing while
+// iterating over map->values should revisit the current position
+void *SlotMap_remove(SlotMap *map, uint handle)
+{
+    SlotMapSlot *slot = _SlotMap_slot(map, handle);
+    if (slot == NULL)
+        return NULL;
+    uint index = slot->index, last = --map->size;
+    void *value = map->values[index];
+    map->values[index] = map->values[last];
+    map->owners[index] = map->owners[last];
+    map->slots[map->owners[index]].index = index;
+    slot->generation++; // even while free, which makes old handles stale
+    slot->index = map->free;
+    map->free = (uint32_t)handle;
+    return value;
+}
+
+void SlotMap_del(SlotMap *map)
+{
+    free(map->values);
+    free(map->owners);
+    free(map->slots);
+    free(map);
+}
+
+void SlotMap_test()
+{
+    SlotMap *map = SlotMap_new();
+    uint handles[100];
+    uint i;
+    for (i = 0; i < 100; i++)
+        handles[i] = SlotMap_insert(map, (void*)(i + 1));
+    CU_ASSERT(map->size == 100);
+    CU_ASSERT(SlotMap_get(map, handles[42]) == (void*)43);
+    CU_ASSERT(!SlotMap_has(map, 0));
+    // Remove the even values; the odd ones keep their handles
+    for (i = 0; i < 100; i += 2)
+        CU_ASSERT(SlotMap_remove(map, handles[i]) == (void*)(i + 1));
+    CU_ASSERT(map->size == 50);
+    CU_ASSERT(SlotMap_get(map, handles[42]) == NULL);
+    CU_ASSERT(SlotMap_remove(map, handles[42]) == NULL);
+    CU_ASSERT(SlotMap_get(map, handles[43]) == (void*)44);
+    // Freed slots are reused with new generations
+    uint handle = SlotMap_insert(map, (void*)1000);
+    CU_ASSERT((uint32_t)handle == (uint32_t)handles[98]);
+    CU_ASSERT(handle != handles[98] && !SlotMap_has(map, handles[98]));
+    CU_ASSERT(SlotMap_set(map, handle, (void*)1001));
+    CU_ASSERT(SlotMap_get(map, handle) == (void*)1001);
+    // Dense iteration sees every live value once
+    uint total = 0;
+    for (i = 0; i < map->size; i++)
+    {
+        CU_ASSERT(SlotMap_get(map, SlotMap_handle_at(map, i)) == map->values[i]);
+        total += (uint)map->values[i];
+    }
+    CU_ASSERT(total == 1001 + 50 * 51);
+    SlotMap_del(map);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Map
+// An incrementally resizing hashtable map with open addressing
+////////////////////////////////////////////////////////////////////////////////
+
+uint stringhash(void *stringptr)
+{
+    char *string = (char*)stringptr;
+    /* "Jenkin's Hash" */
+    uint hash;
+    uint i;
+    uint len = strlen(string);
+    for (hash = i = 0; i < len; i++)
+    {
+        hash += string[i];
+        hash += (hash << 10);
+        hash ^= (hash >> 6);
+    }
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
+    return hash;
+}
+
+uint ptrhash(void *ptr)
+{
+    return (uint)ptr >> 2;
+}
+
+bool stringcomp(void *str1, void *str2)
+{
+    if (str1 == NULL)
+        return str2 == NULL;
+    return strcmp(str1, str2) == 0;
+}
+
+bool ptrcomp(void *ptr1, void *ptr2)
+{
+    return ptr1 == ptr2;
+}
+
+static void _Map_add(Map *map, void *key, void *value, bool recurrant);
+static void _Map_transfer(Map *map);
+static Map *_Map_new(int log2tablesize, uint (*hash)(void*), bool (*comp)(void*,void*));
+static MapBucket *_Map_get(Map *map, void *key);
+
+// The open addressing machinery below is shared by Map and Set. A table is an
+// array of slots, each "stride" pointers wide, where the first pointer of a
+// slot is the key (NULL when the slot is empty). Linear probing is used.
+// Removing a key leaves the "deleted" marker behind rather than NULL, so that
+// a lookup can stop at the first empty slot instead of scanning the table.
+// Markers count towards the load that triggers a rehash, so a quarter of the
+// slots always stay empty.
+
+static char _OATable_deleted_marker;
+#define deleted ((void*)&_OATable_deleted_marker)
+#define occupied(_key) ((_key) != NULL && (_key) != deleted)
+
+// Find the slot holding key, or NULL if there is no such slot
+static void **_OATable_find(void **table, uint log2cap, uint stride, uint hash,
+                            bool (*comp)(void*,void*), void *key)
+{
+    uint size_mod = mask(log2cap);
+    uint start = hash & size_mod; // modulus
+    uint i = start;
+    do
+    {
+        void **slot = table + i * stride;
+        if (*slot == NULL)
+            return NULL;
+        if (*slot != deleted && comp(*slot, key))
+            return slot;
+        i++;
+        i &= size_mod;
+    } while (i != start);
+    return NULL;
+}
+
+// Find the first empty or deleted slot along the probe sequence of the hash
+static void **_OATable_empty(void **table, uint log2cap, uint stride, uint hash)
+{
+    uint size_mod = mask(log2cap);
+    uint index = hash; // modulus
+    void **slot;
+    do
+    {
+        index &= size_mod;
+        slot = table + index * stride;
+        index++;
+    } while (occupied(*slot));
+    return slot;
+}
+
+// check to see if a table has reached 75% cap.
+static inline bool _OATable_full(uint size, uint log2cap)
+{
+    return size >= pow2(log2cap - 2) + pow2(log2cap - 1);
+}
+
+// The capacity to rehash a full table into. It doubles, unless under 37.5% of
+// the table is live and the rest is deleted markers. Then rehashing at the same
+// size is enough to clear the markers, and churn at a steady size doesn't keep
+// growing the table.
+static inline uint _OATable_regrow(uint size, uint log2cap)
+{
+    return _OATable_full(size << 1, log2cap) ? log2cap + 1 : log2cap;
+}
+
+#define MAP_STRIDE (sizeof(MapBucket) / sizeof(void*))
+
+// add an item to tableB only
+static void _Map_add(Map *map, void *key, void *value, bool recurrant)
+{
+    assert(map != NULL);
+    assert(key != NULL);
+    MapBucket *bucket = (MapBucket*)_OATable_empty((void**)map->tableB,
+        map->log2capB, MAP_STRIDE, map->hash(key));
+    if (bucket->key == deleted)
+        map->deletedB--;
+    bucket->key = key;
+    bucket->value = value;
+    map->sizeB++;
+    // also move an item from tableA to tableB
+    if (!recurrant)
+        _Map_transfer(map);
+}
+
+// transfer any item from tableA to tableB
+static void _Map_transfer(Map *map)
+{
+    uint cap = pow2(map->log2capA);
+    if (map->tableA != NULL)
+    {
+        while (map->indexA < cap)
+        {
+            MapBucket *bucket = &map->tableA[map->indexA];
+            if (occupied(bucket->key))
+            {
+                _Map_add(map, bucket->key, bucket->value, true);
+                bucket->key = deleted;
+                map->sizeA--;
+                return;
+            }
+            map->indexA++;
+        }
+        // We have emptied tableA
+        assert(map->sizeA == 0);
+        free(map->tableA);
+        map->tableA = NULL;
+    }
+    
+    if (!_OATable_full(map->sizeB + map->deletedB, map->log2capB))
+        return;
+    
+    uint log2newtablesize = _OATable_regrow(map->sizeB, map->log2capB);
+    if (map->tableA != NULL)
+        free(map->tableA);
+    map->tableA = map->tableB;
+    map->log2capA = map->log2capB;
+    map->sizeA = map->sizeB;
+    map->indexA = 0;
+    map->tableB = calloc(pow2(log2newtablesize), sizeof(MapBucket));
+    map->log2capB = log2newtablesize;
+    map->sizeB = 0;
+    map->deletedB = 0;
+}
+
+Map *Map_new_sized(int log2tablesize,
+                   uint (*hash)(void*), bool (*comp)(void*,void*))
+{
+    Map *map = malloc(sizeof(Map));
+    map->hash = hash;
+    map->comp = comp;
+    map->indexA = 0;
+    map->sizeA = 0;
+    map->sizeB = 0;
+    map->deletedB = 0;
+    map->log2capA = 0;
+    map->log2capB = log2tablesize;
+    map->tableA = NULL;
+    map->tableB = calloc(pow2(log2tablesize), sizeof(MapBucket));
+    return map;
+}
+
+Map *Map_new(uint (*hash)(void*), bool (*comp)(void*,void*))
+{
+    return Map_new_sized(4, hash, comp);
+}
+
+MapIterator Map_iter(Map *map)
+{
+    MapIterator iter;
+    iter.map = map;
+    iter.tableA = false;
+    iter.index = -1;
+    return iter;
+}
+
+static MapBucket *_Map_iter_next(MapIterator *iter)
+{
+    Map *map = iter->map;
+    MapBucket *table = (iter->tableA)? map->tableA : map->tableB;
+    if (iter.index < 0)
+    {
+        
+    }
+    MapBucket *bucket = &table[iter.index];
+    /// how do we ensure that after the first call, the iterator is still
+    /// pointing at the first element (which may be at index 0)? Maybe use -1
+    /// for the "uninitialized" step? Maybe rethink how iterators should work?
+    
+}
+
+static MapBucket *_Map_get(Map *map, void *key)
+{
+    assert(key != NULL);
+    uint hash = map->hash(key);
+    MapBucket *bucket = (MapBucket*)_OATable_find((void**)map->tableB,
+        map->log2capB, MAP_STRIDE, hash, map->comp, key);
+    if (bucket != NULL)
+        return bucket;
+    
+    // The key wasn't found in table B, now look in table A
+    
+    if (map->tableA == NULL)
+        return NULL;
+    return (MapBucket*)_OATable_find((void**)map->tableA, map->log2capA,
+                                     MAP_STRIDE, hash, map->comp, key);
+}
+
+bool Map_has(Map *map, void *key)
+{
+    MapBucket *bucket = _Map_get(map, key);
+    if (bucket == NULL)
+        return false;
+    return true;
+}
+
+void *Map_get(Map *map, void *key)
+{
+    MapBucket *bucket = _Map_get(map, key);
+    if (bucket == NULL)
+        return NULL;
+    return bucket->value;
+}
+
+void *Map_remove(Map *map, void *key)
+{
+    MapBucket *bucket = _Map_get(map, key);
+    if (bucket == NULL)
+        return NULL;
+    void *value = bucket->value;
+    bucket->key = deleted;
+    // check which table the bucket was in:
+    if (bucket >= map->tableA && bucket < map->tableA + pow2(map->log2capA))
+        map->sizeA--;
+    else
+    {
+        map->sizeB--;
+        map->deletedB++;
+    }
+    return value;
+}
+
+void *Map_set(Map *map, void *key, void *value)
+{
+    MapBucket *bucket = _Map_get(map, key);
+    void *oldvalue = NULL;
+    
+    if (bucket == NULL)
+    {
+        _Map_add(map, key, value, false);
+    }
+    else
+    {
+        oldvalue = bucket->value;
+        bucket->value = value;
+    }
+    return oldvalue;
+}
+
+void Map_del(Map *map)
+{
+    if (map->tableA != NULL)
+        free(map->tableA);
+    free(map->tableB);
+    free(map);
+}
+
+// Number of empty slots, where a lookup that misses stops probing
+static uint _OATable_empties(void **table, uint log2cap, uint stride)
+{
+    uint i, count = 0;
+    for (i = 0; i < pow2(log2cap); i++)
+        count += table[i * stride] == NULL;
+    return count;
+}
+
+void Map_test()
+{
+    Map *map = Map_new(stringhash, stringcomp);
+    Map_set(map, "test0", "a");
+    Map_set(map, "test1", "b");
+    Map_set(map, "test2", "c");
+    Map_set(map, "test3", "d");
+    Map_set(map, "test0", "e");
+    CU_ASSERT(strcmp(Map_get(map, "test0"), "e") == 0);
+    CU_ASSERT(strcmp(Map_get(map, "test1"), "b") == 0);
+    CU_ASSERT(strcmp(Map_get(map, "test2"), "c") == 0);
+    CU_ASSERT(strcmp(Map_get(map, "test3"), "d") == 0);
+    Map_remove(map, "test2");
+    CU_ASSERT(strcmp(Map_get(map, "test0"), "e") == 0);
+    CU_ASSERT(strcmp(Map_get(map, "test1"), "b") == 0);
+    CU_ASSERT(Map_get(map, "test2") == NULL);
+    CU_ASSERT(strcmp(Map_get(map, "test3"), "d") == 0);
+    Map_del(map);
+    // Churn at a steady size must not fill the table with deleted markers
+    map = Map_new(ptrhash, ptrcomp);
+    uint i;
+    for (i = 1; i <= 100000; i++)
+    {
+        Map_set(map, (void*)i, (void*)i);
+        if (i > 50)
+            Map_remove(map, (void*)(i - 50));
+    }
+    CU_ASSERT(map->sizeA + map->sizeB == 50 && map->log2capB <= 8);
+    CU_ASSERT(_OATable_empties((void**)map->tableB, map->log2capB, MAP_STRIDE)
+              >= pow2(map->log2capB) / 4);
+    CU_ASSERT(Map_get(map, (void*)99951) == (void*)99951);
+    CU_ASSERT(!Map_has(map, (void*)99950));
+    Map_del(map);
+}
+
+void Map_profile()
+{
+    /// todo
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ChainedMap
+// An incrementally resizing hashtable map with chaining
+////////////////////////////////////////////////////////////////////////////////
+
+static void _ChainedMap_add(ChainedMap *map, void *key, void *value, bool recurrant);
+
+ChainedMap *ChainedMap_new_sized(int log2tablesize,
+                                 uint (*hash)(void*), bool (*comp)(void*,void*))
+{
+    ChainedMap *map = malloc(sizeof(ChainedMap));
+    map->hash = hash;
+    map->comp = comp;
+    map->indexA = 0;
+    map->sizeA = 0;
+    map->sizeB = 0;
+    map->log2capA = 0;
+    map->log2capB = log2tablesize;
+    map->tableA = NULL;
+    map->tableB = calloc(pow2(log2tablesize), sizeof(ChainedMapBucket));
+    return map;
+}
+
+ChainedMap *ChainedMap_new(uint (*hash)(void*), bool (*comp)(void*,void*))
+{
+    return ChainedMap_new_sized(4, hash, comp);
+}
+
+static ChainedMapBucket *_ChainedMap_get(ChainedMap *map, ChainedMapBucket *maptable,
+                                  uint index, void *key)
+{
+    ChainedMapBucket *bucket = &maptable[index];
+    if (bucket->key != NULL)
+    {
+        do
+        {
+            if (map->comp(bucket->key, key))
+                return bucket;
+            bucket = bucket->next;
+        } while (bucket != NULL);
+    }
+    return NULL;
+}
+
+// Move one entry from tableA to tableB
+static void _ChainedMap_transfer(ChainedMap *map)
+{
+    assert(map != NULL);
+    if (map->tableA != NULL)
+    {
+        uint i = map->indexA;
+        uint cap = pow2(map->log2capA);
+        ChainedMapBucket *bucket, *next;
+        for (i = 0; i < cap; i++)
+        {
+            bucket = &map->tableA[i];
+            if (bucket->key != NULL)
+            {
+                next = bucket->next->next;
+                void *key = bucket->key;
+                void *value = bucket->value;
+                bucket->key = next->key;
+                bucket->value = next->value;
+                free(bucket->next);
+                bucket->next = next;
+                _ChainedMap_add(map, key, value, true);
+                map->indexA = i;
+                return;
+            }
+        }
+    }
+    
+    // check to see if table B has reached 75% cap.
+    uint high_load = pow2(map->log2capB + 2) + pow2(map->log2capB + 1);
+    if (map->sizeB < high_load)
+        return;
+    
+    uint log2newtablesize = map->log2capB + 1; // grow by 2x
+    if (map->tableA != NULL)
+        free(map->tableA);
+    map->tableA = map->tableB;
+    map->log2capA = map->log2capB;
+    map->sizeA = map->sizeB;
+    map->indexA = 0;
+    map->tableB = calloc(pow2(log2newtablesize), sizeof(ChainedMapBucket));
+    map->log2capB = log2newtablesize;
+    map->sizeB = 0;
+}
+
+void *ChainedMap_get(ChainedMap *map, void *key)
+{
+    assert(map != NULL);
+    assert(key != NULL);
+    uint hash = map->hash(key);
+    uint indexB = hash & mask(map->log2capB);
+    ChainedMapBucket *bucket = _ChainedMap_get(map, map->tableB, indexB, key);
+    if (bucket != NULL)
+        return bucket->value;
+    if (map->tableA == NULL)
+        return NULL;
+    uint indexA = hash & mask(map->log2capA);
+    bucket = _ChainedMap_get(map, map->tableA, indexA, key);
+    if (bucket == NULL)
+        return NULL;
+    return bucket->value;
+}
+
+bool ChainedMap_has(ChainedMap *map, void *key)
+{
+    assert(key != NULL);
+    uint hash = map->hash(key);
+    uint indexB = hash & mask(map->log2capB);
+    ChainedMapBucket *bucket = _ChainedMap_get(map, map->tableB, indexB, key);
+    if (bucket != NULL)
+        return true;
+    uint indexA = hash & mask(map->log2capA);
+    bucket = _ChainedMap_get(map, map->tableA, indexA, key);
+    return bucket != NULL;
+}
+
+void *ChainedMap_remove(ChainedMap *map, void *key)
+{
+    uint hash = map->hash(key);
+    uint indexB = hash & mask(map->log2capB);
+    ChainedMapBucket *bucket = &map->tableB[indexB];
+    void *value = NULL;
+    if (map->comp(bucket->key, key))
+    {
+        value = bucket->value;
+        ChainedMapBucket *next = bucket->next;
+        if (bucket->next != NULL)
+        {
+            bucket->key = next->key;
+            bucket->value = next->value;
+            bucket->next = next->next;
+            free(next);
+        }
+        else
+            bucket->key = NULL;
+        map->sizeB--;
+        return value;
+    }
+    ChainedMapBucket *prev = bucket;
+    for (bucket = bucket->next; bucket != NULL; bucket = bucket->next)
+    {
+        if (map->comp(bucket->key, key))
+        {
+            prev->next = bucket->next;
+            value = bucket->value;
+            free(bucket);
+            map->sizeB--;
+            return value;
+        }
+        prev = bucket;
+    }
+    uint indexA = hash & mask(map->log2capA);
+    bucket = &map->tableA[indexA];
+    if (map->comp(bucket->key, key))
+    {
+        value = bucket->value;
+        ChainedMapBucket *next = bucket->next;
+        if (bucket->next != NULL)
+        {
+            bucket->key = next->key;
+            bucket->value = next->value;
+            bucket->next = next->next;
+            free(next);
+        }
+        else
+            bucket->key = NULL;
+        map->sizeA--;
+        return value;
+    }
+    prev = bucket;
+    for (bucket = bucket->next; bucket != NULL; bucket = bucket->next)
+    {
+        if (map->comp(bucket->key, key))
+        {
+            prev->next = bucket->next;
+            value = bucket->value;
+            free(bucket);
+            map->sizeA--;
+            return value;
+        }
+        prev = bucket;
+    }
+    return NULL;
+}
+
+// Add to table B, requires that the key is not yet in map
+static void _ChainedMap_add(ChainedMap *map, void *key, void *value, bool recurrant)
+{
+    uint index = map->hash(key) & mask(map->log2capB);
+    ChainedMapBucket *bucket = &map->tableB[index];
+    ChainedMapBucket *new_bucket = malloc(sizeof(ChainedMapBucket));
+    new_bucket->key = bucket->key;
+    new_bucket->value = bucket->value;
+    new_bucket->next = bucket->next;
+    bucket->key = key;
+    bucket->value = value;
+    bucket->next = new_bucket;
+    map->sizeB++;
+    if (!recurrant)
+        _ChainedMap_transfer(map); // also move an item from tableA to tableB
+}
+
+void *ChainedMap_set(ChainedMap *map, void *key, void *value)
+{
+    assert(map != NULL);
+    assert(key != NULL);
+    uint hash = map->hash(key);
+    uint indexB = hash & mask(map->log2capB);
+    ChainedMapBucket *bucketB = _ChainedMap_get(map, map->tableB, indexB, key);
+    void *old_value;
+    if (bucketB != NULL)
+    {
+        old_value = bucketB->value;
+        bucketB->value = value;
+        return old_value;
+    }
+    if (map->tableA != NULL)
+    {
+        uint indexA = hash & mask(map->log2capA);
+        ChainedMapBucket *bucketA =
+            _ChainedMap_get(map, map->tableA, indexA, key);
+        if (bucketA != NULL)
+        {
+            old_value = bucketB->value;
+            bucketA->value = value;
+            return old_value;
+        }
+    }
+    // We didn't find an existing such key, so add it
+    _ChainedMap_add(map, key, value, false);
+    return NULL;
+}
+
+void ChainedMap_del(ChainedMap *map)
+{
+    uint i;
+    ChainedMapBucket *bucket, *next;
+    if (map->tableA != NULL)
+    {
+        for (i = 0; i < pow2(map->log2capA); i++)
+        {
+            bucket = &map->tableA[i];
+            next = bucket->next;
+            while (next != NULL)
+            {
+                free(next);
+                next = next->next;
+                bucket->next = next;
+            }
+        }
+        free(map->tableA);
+    }
+    for (i = 0; i < pow2(map->log2capB); i++)
+    {
+        bucket = &map->tableB[i];
+        next = bucket->next;
+        while (next != NULL)
+        {
+            free(next);
+            next = next->next;
+            bucket->next = next;
+        }
+    }
+    free(map->tableB);
+    free(map);
+}
+
+void ChainedMap_test()
+{
+    ChainedMap *map = ChainedMap_new(stringhash, stringcomp);
+    ChainedMap_set(map, "test0", "a");
+    ChainedMap_set(map, "test1", "b");
+    ChainedMap_set(map, "test2", "c");
+    ChainedMap_set(map, "test3", "d");
+    ChainedMap_set(map, "test0", "e");
+    CU_ASSERT(strcmp(ChainedMap_get(map, "test0"), "e") == 0);
+    CU_ASSERT(strcmp(ChainedMap_get(map, "test1"), "b") == 0);
+    CU_ASSERT(strcmp(ChainedMap_get(map, "test2"), "c") == 0);
+    CU_ASSERT(strcmp(ChainedMap_get(map, "test3"), "d") == 0);
+    ChainedMap_remove(map, "test2");
+    CU_ASSERT(strcmp(ChainedMap_get(map, "test0"), "e") == 0);
+    CU_ASSERT(strcmp(ChainedMap_get(map, "test1"), "b") == 0);
+    CU_ASSERT(ChainedMap_get(map, "test2") == NULL);
+    CU_ASSERT(strcmp(ChainedMap_get(map, "test3"), "d") == 0);
+    ChainedMap_del(map);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MultiMap
+// Like Map, but each key can have 1 or more values (instead of just 1).
+// An open addressing scheme is used. A key's first few values are stored inline
+// in its bucket; larger groups spill into a contiguous array.
+////////////////////////////////////////////////////////////////////////////////
+
+#define MULTIMAP_STRIDE (sizeof(MultiMapBucket) / sizeof(void*))
+
+static void _MultiMap_transfer(MultiMap *map);
+
+MultiMap *MultiMap_new_sized(uint log2tablesize,
+                             uint (*hash)(void*), bool (*comp)(void*,void*))
+{
+    MultiMap *map = malloc(sizeof(MultiMap));
+    map->hash = hash;
+    map->comp = comp;
+    map->indexA = 0;
+    map->sizeA = 0;
+    map->sizeB = 0;
+    map->deletedB = 0;
+    map->log2capA = 0;
+    map->log2capB = log2tablesize;
+    map->tableA = NULL;
+    map->tableB = calloc(pow2(log2tablesize), sizeof(MultiMapBucket));
+    return map;
+}
+
+MultiMap *MultiMap_new(uint (*hash)(void*), bool (*comp)(void*,void*))
+{
+    return MultiMap_new_sized(4, hash, comp);
+}
+
+static void _MultiMapBucket_promote(MultiMapBucket *bucket);
+
+static inline void **_MultiMapBucket_values(MultiMapBucket *bucket)
+{
+    return (bucket->cap == 0)? bucket->values.small : bucket->values.large;
+}
+
+static inline MultiMapSpan _MultiMapBucket_span(MultiMapBucket *bucket)
+{
+    MultiMapSpan span;
+    span.values = (bucket == NULL)? NULL : _MultiMapBucket_values(bucket);
+    span.size = (bucket == NULL)? 0 : bucket->size;
+    return span;
+}
+
+static void _MultiMapBucket_append(MultiMapBucket *bucket, void *value)
+{
+    if (bucket->cap == 0)
+    {
+        if (bucket->size < MULTIMAP_INLINE)
+        {
+            bucket->values.small[bucket->size++] = value;
+            return;
+        }
+        // The inline values are full, so spill them into an array
+        void **large = malloc(8 * sizeof(void*));
+        memcpy(large, bucket->values.small, bucket->size * sizeof(void*));
+        bucket->values.large = large;
+        bucket->cap = 8;
+    }
+    else if (bucket->size >= bucket->cap)
+    {
+        bucket->cap += bucket->cap >> 1;
+        bucket->values.large = realloc(bucket->values.large,
+                                       bucket->cap * sizeof(void*));
+    }
+    bucket->values.large[bucket->size++] = value;
+    // Positions are stored off by one, since NULL means "not found" in a Map
+    if (bucket->index != NULL)
+        Map_set(bucket->index, value, (void*)bucket->size);
+    else if (bucket->size > MULTIMAP_PROMOTE)
+        _MultiMapBucket_promote(bucket);
+}
+
+// Index a key's values by hash once there are too many to scan
+static void _MultiMapBucket_promote(MultiMapBucket *bucket)
+{
+    uint log2cap = 4;
+    while (_OATable_full(bucket->size << 1, log2cap))
+        log2cap++;
+    bucket->index = Map_new_sized(log2cap, ptrhash, ptrcomp);
+    uint i;
+    for (i = 0; i < bucket->size; i++)
+        Map_set(bucket->index, bucket->values.large[i], (void*)(i + 1));
+}
+
+// Move the values back inline once they fit again
+static void _MultiMapBucket_unspill(MultiMapBucket *bucket)
+{
+    if (bucket->cap == 0 || bucket->size > MULTIMAP_INLINE)
+        return;
+    void **large = bucket->values.large;
+    memcpy(bucket->values.small, large, bucket->size * sizeof(void*));
+    free(large);
+    bucket->cap = 0;
+}
+
+// Position of the value within the bucket's values, or -1
+static int _MultiMapBucket_find(MultiMapBucket *bucket, void *value)
+{
+    if (bucket->index != NULL)
+    {
+        uint position = (uint)Map_get(bucket->index, value);
+        return (int)position - 1;
+    }
+    void **values = _MultiMapBucket_values(bucket);
+    uint i;
+    for (i = 0; i < bucket->size; i++)
+        if (values[i] == value)
+            return i;
+    return -1;
+}
+
+// Indexed keys fill the gap with their last value, others keep their order
+static void _MultiMapBucket_remove(MultiMapBucket *bucket, uint position)
+{
+    void **values = _MultiMapBucket_values(bucket);
+    bucket->size--;
+    if (bucket->index == NULL)
+    {
+        memmove(values + position, values + position + 1,
+                (bucket->size - position) * sizeof(void*));
+        _MultiMapBucket_unspill(bucket);
+        return;
+    }
+    Map_remove(bucket->index, values[position]);
+    if (position != bucket->size)
+    {
+        values[position] = values[bucket->size];
+        Map_set(bucket->index, values[position], (void*)(position + 1));
+    }
+    // Demoting well below the promotion threshold avoids thrashing
+    if (bucket->size < MULTIMAP_DEMOTE)
+    {
+        Map_del(bucket->index);
+        bucket->index = NULL;
+    }
+}
+
+static void _MultiMapBucket_free(MultiMapBucket *bucket)
+{
+    if (bucket->cap != 0)
+        free(bucket->values.large);
+    if (bucket->index != NULL)
+        Map_del(bucket->index);
+}
+
+// Copy a bucket into an empty slot of tableB only
+static void _MultiMap_insert(MultiMap *map, MultiMapBucket *from, bool recurrant)
+{
+    assert(map != NULL);
+    assert(from->key != NULL);
+    MultiMapBucket *bucket = (MultiMapBucket*)_OATable_empty(
+        (void**)map->tableB, map->log2capB, MULTIMAP_STRIDE, map->hash(from->key));
+    if (bucket->key == deleted)
+        map->deletedB--;
+    *bucket = *from;
+    map->sizeB++;
+    // also move a bucket from tableA to tableB
+    if (!recurrant)
+        _MultiMap_transfer(map);
+}
+
+// transfer any bucket from tableA to tableB
+static void _MultiMap_transfer(MultiMap *map)
+{
+    if (map->tableA != NULL)
+    {
+        uint cap = pow2(map->log2capA);
+        while (map->indexA < cap)
+        {
+            MultiMapBucket *bucket = &map->tableA[map->indexA];
+            if (occupied(bucket->key))
+            {
+                _MultiMap_insert(map, bucket, true);
+                bucket->key = deleted;
+                map->sizeA--;
+                return;
+            }
+            map->indexA++;
+        }
+        // We have emptied tableA
+        assert(map->sizeA == 0);
+        free(map->tableA);
+        map->tableA = NULL;
+    }
+    
+    if (!_OATable_full(map->sizeB + map->deletedB, map->log2capB))
+        return;
+    
+    uint log2newtablesize = _OATable_regrow(map->sizeB, map->log2capB);
+    map->tableA = map->tableB;
+    map->log2capA = map->log2capB;
+    map->sizeA = map->sizeB;
+    map->indexA = 0;
+    map->tableB = calloc(pow2(log2newtablesize), sizeof(MultiMapBucket));
+    map->log2capB = log2newtablesize;
+    map->sizeB = 0;
+    map->deletedB = 0;
+}
+
+static MultiMapBucket *_MultiMap_get(MultiMap *map, void *key)
+{
+    assert(key != NULL);
+    uint hash = map->hash(key);
+    MultiMapBucket *bucket = (MultiMapBucket*)_OATable_find((void**)map->tableB,
+        map->log2capB, MULTIMAP_STRIDE, hash, map->comp, key);
+    if (bucket != NULL || map->tableA == NULL)
+        return bucket;
+    return (MultiMapBucket*)_OATable_find((void**)map->tableA, map->log2capA,
+                                          MULTIMAP_STRIDE, hash, map->comp, key);
+}
+
+// Empty a bucket belonging to one of the map's tables
+static void _MultiMap_remove_bucket(MultiMap *map, MultiMapBucket *bucket)
+{
+    _MultiMapBucket_free(bucket);
+    bucket->key = deleted;
+    // check which table the bucket was in:
+    if (bucket >= map->tableA && bucket < map->tableA + pow2(map->log2capA))
+        map->sizeA--;
+    else
+    {
+        map->sizeB--;
+        map->deletedB++;
+    }
+}
+
+bool MultiMap_has(MultiMap *map, void *key)
+{
+    return _MultiMap_get(map, key) != NULL;
+}
+
+bool MultiMap_has_pair(MultiMap *map, void *key, void *value)
+{
+    MultiMapBucket *bucket = _MultiMap_get(map, key);
+    if (bucket == NULL)
+        return false;
+    return _MultiMapBucket_find(bucket, value) >= 0;
+}
+
+MultiMapSpan MultiMap_get(MultiMap *map, void *key)
+{
+    return _MultiMapBucket_span(_MultiMap_get(map, key));
+}
+
+bool MultiMap_remove_key(MultiMap *map, void *key)
+{
+    MultiMapBucket *bucket = _MultiMap_get(map, key);
+    if (bucket == NULL)
+        return false;
+    _MultiMap_remove_bucket(map, bucket);
+    return true;
+}
+
+// The key itself is removed along with its last value.
+MultiMapSpan MultiMap_remove(MultiMap *map, void *key, void *value)
+{
+    MultiMapBucket *bucket = _MultiMap_get(map, key);
+    if (bucket == NULL)
+        return _MultiMapBucket_span(NULL);
+    int position = _MultiMapBucket_find(bucket, value);
+    if (position >= 0)
+        _MultiMapBucket_remove(bucket, position);
+    if (bucket->size == 0)
+    {
+        _MultiMap_remove_bucket(map, bucket);
+        return _MultiMapBucket_span(NULL);
+    }
+    return _MultiMapBucket_span(bucket);
+}
+
+// Adding a pair which is already present does nothing
+MultiMapSpan MultiMap_add(MultiMap *map, void *key, void *value)
+{
+    MultiMapBucket *bucket = _MultiMap_get(map, key);
+    if (bucket != NULL)
+    {
+        if (_MultiMapBucket_find(bucket, value) < 0)
+            _MultiMapBucket_append(bucket, value);
+        return _MultiMapBucket_span(bucket);
+    }
+    MultiMapBucket new;
+    new.key = key;
+    new.size = 1;
+    new.cap = 0;
+    new.index = NULL;
+    new.values.small[0] = value;
+    _MultiMap_insert(map, &new, false);
+    // the insert may have moved buckets around, so look it up again
+    return MultiMap_get(map, key);
+}
+
+void MultiMap_del(MultiMap *map)
+{
+    uint i;
+    if (map->tableA != NULL)
+    {
+        for (i = 0; i < pow2(map->log2capA); i++)
+            if (occupied(map->tableA[i].key))
+                _MultiMapBucket_free(&map->tableA[i]);
+        free(map->tableA);
+    }
+    for (i = 0; i < pow2(map->log2capB); i++)
+        if (occupied(map->tableB[i].key))
+            _MultiMapBucket_free(&map->tableB[i]);
+    free(map->tableB);
+    free(map);
+}
+
+void MultiMap_test()
+{
+    MultiMap *map = MultiMap_new(stringhash, stringcomp);
+    uint i;
+    MultiMap_add(map, "small", (void*)1);
+    MultiMap_add(map, "small", (void*)2);
+    for (i = 1; i <= 100; i++)
+        MultiMap_add(map, "large", (void*)i);
+    MultiMapSpan span = MultiMap_get(map, "large");
+    CU_ASSERT(span.size == 100);
+    CU_ASSERT(span.values[0] == (void*)1 && span.values[99] == (void*)100);
+    span = MultiMap_get(map, "small");
+    CU_ASSERT(span.size == 2 && span.values[1] == (void*)2);
+    CU_ASSERT(MultiMap_get(map, "none").size == 0);
+    CU_ASSERT(MultiMap_has_pair(map, "large", (void*)50));
+    CU_ASSERT(!MultiMap_has_pair(map, "small", (void*)50));
+    // "large" is past the promotion threshold, so it is indexed by value
+    MultiMap_add(map, "large", (void*)50);
+    CU_ASSERT(MultiMap_get(map, "large").size == 100);
+    MultiMap_remove(map, "large", (void*)50);
+    CU_ASSERT(!MultiMap_has_pair(map, "large", (void*)50));
+    CU_ASSERT(MultiMap_has_pair(map, "large", (void*)100));
+    MultiMap_add(map, "large", (void*)50);
+    // Shrink "large" until its values move back inline
+    for (i = 3; i <= 100; i++)
+        MultiMap_remove(map, "large", (void*)i);
+    span = MultiMap_get(map, "large");
+    CU_ASSERT(span.size == 2 && span.values[1] == (void*)2);
+    MultiMap_remove(map, "small", (void*)1);
+    MultiMap_remove(map, "small", (void*)2);
+    CU_ASSERT(!MultiMap_has(map, "small"));
+    CU_ASSERT(MultiMap_remove_key(map, "large"));
+    CU_ASSERT(!MultiMap_has(map, "large"));
+    MultiMap_del(map);
+    // Churn at a steady size must not fill the table with deleted markers
+    map = MultiMap_new(ptrhash, ptrcomp);
+    for (i = 1; i <= 100000; i++)
+    {
+        MultiMap_add(map, (void*)i, (void*)i);
+        if (i > 50)
+            MultiMap_remove_key(map, (void*)(i - 50));
+    }
+    CU_ASSERT(map->sizeA + map->sizeB == 50 && map->log2capB <= 8);
+    CU_ASSERT(_OATable_empties((void**)map->tableB, map->log2capB, MULTIMAP_STRIDE)
+              >= pow2(map->log2capB) / 4);
+    CU_ASSERT(MultiMap_has(map, (void*)99951) && !MultiMap_has(map, (void*)99950));
+    MultiMap_del(map);
+}
+
+// Scramble a hash so that its top bits can select a partition
+static inline uint _FrozenMultiMap_mix(uint hash)
+{
+    return hash * 0x9E3779B97F4A7C15ul;
+}
+
+// State shared by the threads building a FrozenMultiMap
+typedef struct
+{
+    void **keys, **values;
+    uint n, nchunks;  // the input is hashed and scattered in nchunks chunks
+    uint (*hash)(void*);
+    bool (*comp)(void*,void*);
+    uint *hashes;     // mixed hash of each input pair
+    uint *cursors;    // nchunks x nparts histogram, then scatter positions
+    uint *pstart;     // first pair of each partition, nparts + 1 entries
+    uint *kstart;     // first key of each partition, nparts + 1 entries
+    void **pkeys, **pvalues; // pairs scattered by partition
+    uint *phashes;
+    uint *groups;     // key number of each scattered pair within its partition
+    FrozenMultiMap *map;
+} _FrozenBuild;
+
+#define _partition(_map, _mixed) ((_mixed) >> (64 - (_map)->log2parts))
+
+// Hash contiguous chunks of the input and count their pairs per partition
+static void _FrozenBuild_histogram(void *build_ptr, uint first, uint last)
+{
+    _FrozenBuild *build = build_ptr;
+    uint nparts = pow2(build->map->log2parts);
+    uint t, i;
+    for (t = first; t < last; t++)
+    {
+        uint *histogram = build->cursors + t * nparts;
+        for (i = build->n * t / build->nchunks;
+             i < build->n * (t + 1) / build->nchunks; i++)
+        {
+            build->hashes[i] = _FrozenMultiMap_mix(build->hash(build->keys[i]));
+            histogram[_partition(build->map, build->hashes[i])]++;
+        }
+    }
+}
+
+// Scatter the same chunks into their partitions, keeping the input order
+static void _FrozenBuild_scatter(void *build_ptr, uint first, uint last)
+{
+    _FrozenBuild *build = build_ptr;
+    uint nparts = pow2(build->map->log2parts);
+    uint t, i;
+    for (t = first; t < last; t++)
+    {
+        uint *cursors = build->cursors + t * nparts;
+        for (i = build->n * t / build->nchunks;
+             i < build->n * (t + 1) / build->nchunks; i++)
+        {
+            uint position = cursors[_partition(build->map, build->hashes[i])]++;
+            build->pkeys[position] = build->keys[i];
+            build->pvalues[position] = build->values[i];
+            build->phashes[position] = build->hashes[i];
+        }
+    }
+}
+
+// Number the distinct keys of each partition, in order of first appearance
+static void _FrozenBuild_group(void *build_ptr, uint first, uint last)
+{
+    _FrozenBuild *build = build_ptr;
+    uint p;
+    for (p = first; p < last; p++)
+    {
+        uint start = build->pstart[p];
+        uint size = build->pstart[p + 1] - start;
+        uint log2cap = 2;
+        while (_OATable_full(size, log2cap))
+            log2cap++;
+        uint *table = calloc(pow2(log2cap), sizeof(uint)); // first pair + 1
+        uint nkeys = 0;
+        uint i;
+        for (i = start; i < start + size; i++)
+        {
+            uint slot = build->phashes[i] & mask(log2cap);
+            while (table[slot] != 0)
+            {
+                uint first = table[slot] - 1;
+                if (build->phashes[first] == build->phashes[i] &&
+                    build->comp(build->pkeys[first], build->pkeys[i]))
+                    break;
+                slot = (slot + 1) & mask(log2cap);
+            }
+            if (table[slot] == 0)
+            {
+                table[slot] = i + 1;
+                build->groups[i] = nkeys++;
+            }
+            else
+                build->groups[i] = build->groups[table[slot] - 1];
+        }
+        free(table);
+        build->kstart[p + 1] = nkeys;
+    }
+}
+
+// Write each partition's keys, offsets, values and lookup region
+static void _FrozenBuild_emit(void *build_ptr, uint first, uint last)
+{
+    _FrozenBuild *build = build_ptr;
+    FrozenMultiMap *map = build->map;
+    uint p;
+    for (p = first; p < last; p++)
+    {
+        uint start = build->pstart[p], end = build->pstart[p + 1];
+        uint kstart = build->kstart[p];
+        uint nkeys = build->kstart[p + 1] - kstart;
+        uint *cursors = calloc(nkeys + 1, sizeof(uint));
+        uint i, g;
+        // count the values of each key, noting its first pair
+        for (i = start; i < end; i++)
+        {
+            g = build->groups[i];
+            if (cursors[g + 1]++ == 0)
+                map->keys[kstart + g] = build->pkeys[i];
+        }
+        for (g = 0; g < nkeys; g++)
+        {
+            cursors[g + 1] += cursors[g];
+            map->offsets[kstart + g] = start + cursors[g];
+        }
+        for (i = start; i < end; i++)
+            map->values[start + cursors[build->groups[i]]++] = build->pvalues[i];
+        free(cursors);
+        // then insert the keys into this partition's region of the slots
+        uint *region = map->slots + (p << map->log2region);
+        for (i = start; i < end; i++)
+        {
+            g = build->groups[i];
+            uint slot = build->phashes[i] & mask(map->log2region);
+            while (region[slot] != 0 && region[slot] != kstart + g + 1)
+                slot = (slot + 1) & mask(map->log2region);
+            region[slot] = kstart + g + 1;
+        }
+    }
+}
+
+FrozenMultiMap *MultiMap_build_frozen(void **keys, void **values, uint n,
+                                      uint (*hash)(void*),
+                                      bool (*comp)(void*,void*),
+                                      ThreadPool *pool)
+{
+    assert(keys != NULL);
+    assert(values != NULL);
+    if (pool == NULL)
+        pool = ThreadPool_shared();
+    FrozenMultiMap *map = malloc(sizeof(FrozenMultiMap));
+    map->hash = hash;
+    map->comp = comp;
+    map->size = n;
+    map->postings = NULL;
+    // aim for partitions of a few thousand pairs, up to 256 of them
+    map->log2parts = 1;
+    while (map->log2parts < 8 && (n >> (map->log2parts + 12)) > 0)
+        map->log2parts++;
+    uint nparts = pow2(map->log2parts);
+    
+    _FrozenBuild build;
+    build.keys = keys;
+    build.values = values;
+    build.n = n;
+    // A chunk per thread, unless that leaves them tiny
+    build.nchunks = min(ThreadPool_size(pool), n / PARALLEL_GRAIN + 1);
+    build.hash = hash;
+    build.comp = comp;
+    build.map = map;
+    build.hashes = malloc(n * sizeof(uint));
+    build.cursors = calloc(build.nchunks * nparts, sizeof(uint));
+    build.pstart = malloc((nparts + 1) * sizeof(uint));
+    build.kstart = calloc(nparts + 1, sizeof(uint));
+    build.pkeys = malloc(n * sizeof(void*));
+    build.pvalues = malloc(n * sizeof(void*));
+    build.phashes = malloc(n * sizeof(uint));
+    build.groups = malloc(n * sizeof(uint));
+    
+    ThreadPool_run(pool, _FrozenBuild_histogram, &build, build.nchunks, 1);
+    // Turn the histograms into scatter positions, partition by partition
+    uint p, t, position = 0;
+    for (p = 0; p < nparts; p++)
+    {
+        build.pstart[p] = position;
+        for (t = 0; t < build.nchunks; t++)
+        {
+            uint count = build.cursors[t * nparts + p];
+            build.cursors[t * nparts + p] = position;
+            position += count;
+        }
+    }
+    build.pstart[nparts] = n;
+    ThreadPool_run(pool, _FrozenBuild_scatter, &build, build.nchunks, 1);
+    free(build.hashes);
+    
+    ThreadPool_run(pool, _FrozenBuild_group, &build, nparts, 1);
+    // Every region must fit the partition with the most keys
+    uint most_keys = 0;
+    for (p = 0; p < nparts; p++)
+    {
+        most_keys = max(most_keys, build.kstart[p + 1]);
+        build.kstart[p + 1] += build.kstart[p];
+    }
+    map->nkeys = build.kstart[nparts];
+    map->log2region = 2;
+    while (_OATable_full(most_keys, map->log2region))
+        map->log2region++;
+    map->keys = malloc(map->nkeys * sizeof(void*));
+    map->offsets = malloc((map->nkeys + 1) * sizeof(uint));
+    map->offsets[map->nkeys] = n;
+    map->values = malloc(n * sizeof(void*));
+    map->slots = calloc(nparts << map->log2region, sizeof(uint));
+    ThreadPool_run(pool, _FrozenBuild_emit, &build, nparts, 1);
+    
+    free(build.cursors);
+    free(build.pstart);
+    free(build.kstart);
+    free(build.pkeys);
+    free(build.pvalues);
+    free(build.phashes);
+    free(build.groups);
+    return map;
+}
+
+// Key number of the key, or nkeys if it isn't there
+static uint _FrozenMultiMap_find(FrozenMultiMap *map, void *key)
+{
+    assert(key != NULL);
+    uint mixed = _FrozenMultiMap_mix(map->hash(key));
+    uint *region = map->slots + (_partition(map, mixed) << map->log2region);
+    uint slot = mixed & mask(map->log2region);
+    while (region[slot] != 0)
+    {
+        uint k = region[slot] - 1;
+        if (map->comp(map->keys[k], key))
+            return k;
+        slot = (slot + 1) & mask(map->log2region);
+    }
+    return map->nkeys;
+}
+
+bool FrozenMultiMap_has(FrozenMultiMap *map, void *key)
+{
+    return _FrozenMultiMap_find(map, key) != map->nkeys;
+}
+
+MultiMapSpan FrozenMultiMap_get(FrozenMultiMap *map, void *key)
+{
+    assert(map->postings == NULL);
+    MultiMapSpan span;
+    span.values = NULL;
+    span.size = 0;
+    uint k = _FrozenMultiMap_find(map, key);
+    if (k != map->nkeys)
+    {
+        span.values = map->values + map->offsets[k];
+        span.size = map->offsets[k + 1] - map->offsets[k];
+    }
+    return span;
+}
+
+void FrozenMultiMap_del(FrozenMultiMap *map)
+{
+    free(map->keys);
+    free(map->offsets);
+    if (map->values != NULL)
+        free(map->values);
+    if (map->postings != NULL)
+        free(map->postings);
+    free(map->slots);
+    free(map);
+}
+
+void FrozenMultiMap_test()
+{
+    uint n = 100000;
+    void **keys = malloc(n * sizeof(void*));
+    void **values = malloc(n * sizeof(void*));
+    uint i;
+    for (i = 0; i < n; i++)
+    {
+        keys[i] = (void*)(i % 1009 + 1);
+        values[i] = (void*)i;
+    }
+    ThreadPool *pool = ThreadPool_new(4);
+    FrozenMultiMap *map = MultiMap_build_frozen(keys, values, n,
+                                                ptrhash, ptrcomp, pool);
+    CU_ASSERT(map->nkeys == 1009);
+    MultiMapSpan span = FrozenMultiMap_get(map, (void*)5);
+    CU_ASSERT(span.size == n / 1009 + 1);
+    // values keep the order they were given in
+    bool ordered = true;
+    for (i = 0; i < span.size; i++)
+        ordered &= span.values[i] == (void*)(4 + i * 1009);
+    CU_ASSERT(ordered);
+    CU_ASSERT(FrozenMultiMap_has(map, (void*)1009));
+    CU_ASSERT(!FrozenMultiMap_has(map, (void*)1010));
+    CU_ASSERT(FrozenMultiMap_get(map, (void*)1010).size == 0);
+    FrozenMultiMap_del(map);
+    ThreadPool_del(pool);
+    free(keys);
+    free(values);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Posting lists
+// A FrozenMultiMap whose values are integers can store each key's values as a
+// sorted, compressed posting list. The values are split into blocks of
+// POSTING_BLOCK, and a list is laid out as
+//     varint count | skip table | block data
+// where the skip table has, for each block, its first value and the offset of
+// its data as two 32 bit integers, and the block data is the varint encoded
+// difference of each later value from the one before it. The skip table lets
+// an intersection gallop over whole blocks without decoding them.
+////////////////////////////////////////////////////////////////////////////////
+
+#define POSTING_BLOCK 128
+#define POSTING_SKIP (2 * sizeof(uint32_t)) // bytes per skip table entry
+#define POSTING_GRAIN 64 // keys per task when building the lists
+
+static inline uint _varint_size(uint value)
+{
+    uint size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static inline uchar *_varint_put(uchar *out, uint value)
+{
+    while (value >= 0x80)
+    {
+        *out++ = (uchar)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uchar)value;
+    return out;
+}
+
+static inline uchar *_varint_get(uchar *in, uint *value)
+{
+    uint result = 0;
+    uint shift = 0;
+    while (*in & 0x80)
+    {
+        result |= (uint)(*in++ & 0x7f) << shift;
+        shift += 7;
+    }
+    *value = result | ((uint)*in++ << shift);
+    return in;
+}
+
+// qsort() comparison of integers stored as pointers
+static int _intptrcomp(const void *a, const void *b)
+{
+    uint x = (uint)*(void* const*)a, y = (uint)*(void* const*)b;
+    return (x > y) - (x < y);
+}
+
+// Sort and deduplicate the values of each key in a range of keys, in place,
+// and work out the encoded size of each list
+static void _Postings_measure(void *build_ptr, uint first, uint last)
+{
+    _FrozenBuild *build = build_ptr;
+    FrozenMultiMap *map = build->map;
+    uint k;
+    for (k = first; k < last; k++)
+    {
+        void **values = map->values + map->offsets[k];
+        uint size = map->offsets[k + 1] - map->offsets[k];
+        qsort(values, size, sizeof(void*), _intptrcomp);
+        uint i, count = 1;
+        for (i = 1; i < size; i++)
+            if (values[i] != values[count - 1])
+                values[count++] = values[i];
+        assert((uint)values[count - 1] <= 0xFFFFFFFFul);
+        uint bytes = _varint_size(count);
+        bytes += ((count + POSTING_BLOCK - 1) / POSTING_BLOCK) * POSTING_SKIP;
+        for (i = 1; i < count; i++)
+            if (i % POSTING_BLOCK != 0)
+                bytes += _varint_size((uint)values[i] - (uint)values[i - 1]);
+        build->groups[k] = count;
+        build->kstart[k + 1] = bytes;
+    }
+}
+
+static void _Postings_encode(void *build_ptr, uint first, uint last)
+{
+    _FrozenBuild *build = build_ptr;
+    FrozenMultiMap *map = build->map;
+    uint k;
+    for (k = first; k < last; k++)
+    {
+        void **values = map->values + map->offsets[k];
+        uint count = build->groups[k];
+        uint nblocks = (count + POSTING_BLOCK - 1) / POSTING_BLOCK;
+        uchar *skip = _varint_put(map->postings + build->kstart[k], count);
+        uchar *data = skip + nblocks * POSTING_SKIP;
+        uchar *out = data;
+        uint i;
+        for (i = 0; i < count; i++)
+        {
+            if (i % POSTING_BLOCK == 0)
+            {
+                uint32_t entry[2] = {(uint)values[i], out - data};
+                memcpy(skip, entry, POSTING_SKIP);
+                skip += POSTING_SKIP;
+            }
+            else
+                out = _varint_put(out, (uint)values[i] - (uint)values[i - 1]);
+        }
+    }
+}
+
+FrozenMultiMap *MultiMap_build_postings(void **keys, void **values, uint n,
+                                        uint (*hash)(void*),
+                                        bool (*comp)(void*,void*),
+                                        ThreadPool *pool)
+{
+    FrozenMultiMap *map = MultiMap_build_frozen(keys, values, n, hash, comp,
+                                                pool);
+    _FrozenBuild build;
+    build.map = map;
+    build.groups = malloc(map->nkeys * sizeof(uint)); // values per key
+    build.kstart = malloc((map->nkeys + 1) * sizeof(uint)); // byte offsets
+    build.kstart[0] = 0;
+    ThreadPool_run(pool, _Postings_measure, &build, map->nkeys, POSTING_GRAIN);
+    uint k;
+    map->size = 0;
+    for (k = 0; k < map->nkeys; k++)
+    {
+        build.kstart[k + 1] += build.kstart[k];
+        map->size += build.groups[k];
+    }
+    map->postings = malloc(build.kstart[map->nkeys]);
+    ThreadPool_run(pool, _Postings_encode, &build, map->nkeys, POSTING_GRAIN);
+    free(build.groups);
+    free(map->values);
+    free(map->offsets);
+    map->values = NULL;
+    map->offsets = build.kstart;
+    return map;
+}
+
+// A reader over one posting list, which decodes a block at a time
+typedef struct
+{
+    uchar *skip, *data;
+    uint count, nblocks;
+    uint block;     // number of the decoded block
+    uint length;    // number of values in the decoded block
+    uint position;  // position of the next value to look at in the block
+    // padded with 0xFFFFFFFF so that SIMD loads past the end are harmless
+    uint32_t values[POSTING_BLOCK + 8];
+} _PostingReader;
+
+static inline uint32_t _PostingReader_first(_PostingReader *reader, uint block)
+{
+    uint32_t first;
+    memcpy(&first, reader->skip + block * POSTING_SKIP, sizeof(uint32_t));
+    return first;
+}
+
+static void _PostingReader_decode(_PostingReader *reader, uint block)
+{
+    uint32_t entry[2];
+    memcpy(entry, reader->skip + block * POSTING_SKIP, POSTING_SKIP);
+    uchar *in = reader->data + entry[1];
+    reader->block = block;
+    reader->length = min(POSTING_BLOCK, reader->count - block * POSTING_BLOCK);
+    reader->position = 0;
+    reader->values[0] = entry[0];
+    uint i, delta;
+    for (i = 1; i < reader->length; i++)
+    {
+        in = _varint_get(in, &delta);
+        reader->values[i] = reader->values[i - 1] + (uint32_t)delta;
+    }
+    for (; i < POSTING_BLOCK + 8; i++)
+        reader->values[i] = 0xFFFFFFFF;
+}
+
+static void _PostingReader_init(_PostingReader *reader, uchar *list)
+{
+    uint count;
+    reader->skip = _varint_get(list, &count);
+    reader->count = count;
+    reader->nblocks = (count + POSTING_BLOCK - 1) / POSTING_BLOCK;
+    reader->data = reader->skip + reader->nblocks * POSTING_SKIP;
+    _PostingReader_decode(reader, 0);
+}
+
+// Position of the first value >= target in a padded block, starting from
+// position. Compares 8 or 4 values at a time where the CPU allows.
+static inline uint _posting_scan(uint32_t *values, uint position, uint32_t target)
+{
+#if defined(__AVX2__)
+    // there is no unsigned compare, so flip the sign bits and compare signed
+    __m256i flip = _mm256_set1_epi32((int)0x80000000);
+    __m256i t = _mm256_xor_si256(_mm256_set1_epi32((int)target), flip);
+    while (true)
+    {
+        __m256i v = _mm256_loadu_si256((__m256i*)(values + position));
+        v = _mm256_xor_si256(v, flip);
+        uint below = (uint)_mm256_movemask_ps(
+            _mm256_castsi256_ps(_mm256_cmpgt_epi32(t, v)));
+        if (below != 0xFF)
+            return position + __builtin_ctz(~below);
+        position += 8;
+    }
+#elif defined(__SSE2__)
+    __m128i flip = _mm_set1_epi32((int)0x80000000);
+    __m128i t = _mm_xor_si128(_mm_set1_epi32((int)target), flip);
+    while (true)
+    {
+        __m128i v = _mm_loadu_si128((__m128i*)(values + position));
+        v = _mm_xor_si128(v, flip);
+        uint below = (uint)_mm_movemask_ps(
+            _mm_castsi128_ps(_mm_cmplt_epi32(v, t)));
+        if (below != 0xF)
+            return position + __builtin_ctz(~below);
+        position += 4;
+    }
+#else
+    while (values[position] < target)
+        position++;
+    return position;
+#endif
+}
+
+// Advance to the first value >= target, returning false if there is none.
+// Gallops over the skip table to find the block, then scans inside it.
+static bool _PostingReader_seek(_PostingReader *reader, uint32_t target)
+{
+    uint block = reader->block;
+    if (block + 1 < reader->nblocks &&
+        _PostingReader_first(reader, block + 1) <= target)
+    {
+        // find the last block starting at or before target
+        uint low = block + 1, step = 1, high;
+        while (true)
+        {
+            high = low + step;
+            if (high >= reader->nblocks ||
+                _PostingReader_first(reader, high) > target)
+                break;
+            low = high;
+            step <<= 1;
+        }
+        high = min(high, reader->nblocks);
+        while (high - low > 1)
+        {
+            uint middle = (low + high) >> 1;
+            if (_PostingReader_first(reader, middle) <= target)
+                low = middle;
+            else
+                high = middle;
+        }
+        _PostingReader_decode(reader, low);
+    }
+    uint position = _posting_scan(reader->values, reader->position, target);
+    if (position < reader->length)
+    {
+        reader->position = position;
+        return true;
+    }
+    // every value in this block is smaller, so it must be the next block's first
+    if (reader->block + 1 >= reader->nblocks)
+        return false;
+    _PostingReader_decode(reader, reader->block + 1);
+    return true;
+}
+
+static uchar *_FrozenMultiMap_postings(FrozenMultiMap *map, void *key)
+{
+    assert(map->postings != NULL);
+    uint k = _FrozenMultiMap_find(map, key);
+    if (k == map->nkeys)
+        return NULL;
+    return map->postings + map->offsets[k];
+}
+
+uint FrozenMultiMap_count(FrozenMultiMap *map, void *key)
+{
+    uchar *list = _FrozenMultiMap_postings(map, key);
+    uint count = 0;
+    if (list != NULL)
+        _varint_get(list, &count);
+    return count;
+}
+
+ArrayList *FrozenMultiMap_decode(FrozenMultiMap *map, void *key)
+{
+    ArrayList *result = ArrayList_new();
+    uchar *list = _FrozenMultiMap_postings(map, key);
+    if (list == NULL)
+        return result;
+    _PostingReader *reader = malloc(sizeof(_PostingReader));
+    _PostingReader_init(reader, list);
+    ArrayList_growby(result, reader->count);
+    uint block, i;
+    for (block = 0; block < reader->nblocks; block++)
+    {
+        _PostingReader_decode(reader, block);
+        for (i = 0; i < reader->length; i++)
+            ArrayList_add(result, (void*)(uint)reader->values[i]);
+    }
+    free(reader);
+    return result;
+}
+
+ArrayList *MultiMap_intersect_keys(FrozenMultiMap *map, void **keys, uint k)
+{
+    assert(map->postings != NULL);
+    ArrayList *result = ArrayList_new();
+    if (k == 0)
+        return result;
+    // Order the lists from shortest to longest
+    uchar **lists = malloc(k * sizeof(uchar*));
+    uint *counts = malloc(k * sizeof(uint));
+    _PostingReader *readers = NULL;
+    uint i, j;
+    for (i = 0; i < k; i++)
+    {
+        uchar *list = _FrozenMultiMap_postings(map, keys[i]);
+        if (list == NULL)
+            goto done;
+        uint count;
+        _varint_get(list, &count);
+        for (j = i; j > 0 && counts[j - 1] > count; j--)
+        {
+            lists[j] = lists[j - 1];
+            counts[j] = counts[j - 1];
+        }
+        lists[j] = list;
+        counts[j] = count;
+    }
+    readers = malloc(k * sizeof(_PostingReader));
+    for (i = 0; i < k; i++)
+        _PostingReader_init(&readers[i], lists[i]);
+    // Every value of the shortest list is a candidate; seek to it in the
+    // others, and skip ahead to wherever a longer list lands when it misses.
+    _PostingReader *shortest = &readers[0];
+    uint block;
+    for (block = 0; block < shortest->nblocks; block++)
+    {
+        _PostingReader_decode(shortest, block);
+        for (i = 0; i < shortest->length; i++)
+        {
+            uint32_t candidate = shortest->values[i];
+            for (j = 1; j < k; j++)
+            {
+                if (!_PostingReader_seek(&readers[j], candidate))
+                    goto done;
+                if (readers[j].values[readers[j].position] != candidate)
+                    break;
+            }
+            if (j == k)
+                ArrayList_add(result, (void*)(uint)candidate);
+        }
+    }
+done:
+    free(readers);
+    free(counts);
+    free(lists);
+    return result;
+}
+
+void Postings_test()
+{
+    // Term t (1 to 3) appears in every document divisible by t + 1
+    uint ndocs = 5000;
+    uint n = 0;
+    void **keys = malloc(3 * ndocs * sizeof(void*));
+    void **values = malloc(3 * ndocs * sizeof(void*));
+    uint term, doc;
+    for (doc = ndocs; doc > 0; doc--) // unsorted, with a duplicate
+    {
+        for (term = 1; term <= 3; term++)
+        {
+            if (doc % (term + 1) == 0)
+            {
+                keys[n] = (void*)term;
+                values[n++] = (void*)doc;
+            }
+        }
+    }
+    keys[n] = (void*)1;
+    values[n++] = (void*)ndocs;
+    FrozenMultiMap *map = MultiMap_build_postings(keys, values, n,
+                                                  ptrhash, ptrcomp, NULL);
+    CU_ASSERT(FrozenMultiMap_count(map, (void*)1) == ndocs / 2);
+    ArrayList *list = FrozenMultiMap_decode(map, (void*)3);
+    CU_ASSERT(list->size == ndocs / 4);
+    CU_ASSERT(ArrayList_index(list, 0) == (void*)4);
+    CU_ASSERT(ArrayList_index(list, -1) == (void*)ndocs);
+    ArrayList_del(list);
+    // Documents divisible by 2, 3 and 4 are those divisible by 12
+    void *terms[3] = {(void*)3, (void*)1, (void*)2};
+    list = MultiMap_intersect_keys(map, terms, 3);
+    CU_ASSERT(list->size == ndocs / 12);
+    CU_ASSERT(ArrayList_index(list, 0) == (void*)12);
+    CU_ASSERT(ArrayList_index(list, -1) == (void*)(ndocs / 12 * 12));
+    ArrayList_del(list);
+    void *missing[2] = {(void*)1, (void*)7};
+    list = MultiMap_intersect_keys(map, missing, 2);
+    CU_ASSERT(list->size == 0);
+    ArrayList_del(list);
+    // Many keys, with and without a missing one at the end
+    uint many = 2000;
+    void **repeated = malloc(many * sizeof(void*));
+    for (n = 0; n < many; n++)
+        repeated[n] = (void*)3;
+    list = MultiMap_intersect_keys(map, repeated, many);
+    CU_ASSERT(list->size == ndocs / 4);
+    ArrayList_del(list);
+    repeated[many - 1] = (void*)7;
+    list = MultiMap_intersect_keys(map, repeated, many);
+    CU_ASSERT(list->size == 0);
+    ArrayList_del(list);
+    free(repeated);
+    FrozenMultiMap_del(map);
+    free(keys);
+    free(values);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Set
+// A set type implemented by an incrementally resizing hashtable with open
+// addressing
+////////////////////////////////////////////////////////////////////////////////
+
+static void _Set_add(Set *set, void *value, bool recurrant);
+
+// A Set slot is just the value itself, so it uses Map's probing with a stride
+// of one pointer.
+#define SET_STRIDE 1
+
+Set *Set_new_sized(uint log2tablesize,
+                   uint (*hash)(void*),
+                   bool (*comp)(void*,void*))
+{
+    Set *set = malloc(sizeof(Set));
+    set->hash = hash;
+    set->comp = comp;
+    set->indexA = 0;
+    set->sizeA = 0;
+    set->sizeB = 0;
+    set->deletedB = 0;
+    set->log2capA = 0;
+    set->log2capB = log2tablesize;
+    set->tableA = NULL;
+    set->tableB = calloc(pow2(log2tablesize), sizeof(void*));
+    return set;
+}
+
+Set *Set_new(uint (*hash)(void*), bool (*comp)(void*,void*))
+{
+    return Set_new_sized(4, hash, comp);
+}
+
+uint Set_size(Set *set)
+{
+    return set->sizeA + set->sizeB;
+}
+
+SetIterator Set_iter(Set *set)
+{
+    SetIterator iter;
+    iter.set = set;
+    iter.tableA = false;
+    iter.index = 0;
+    return iter;
+}
+
+// Returns the slot of the next value, or NULL once both tables are exhausted.
+// It is safe to remove the value most recently returned while iterating.
+static void **_Set_iter_next(SetIterator *iter)
+{
+    Set *set = iter->set;
+    while (true)
+    {
+        void **table = (iter->tableA)? set->tableA : set->tableB;
+        uint tablesize = (iter->tableA)? pow2(set->log2capA) : pow2(set->log2capB);
+        if (table != NULL)
+        {
+            while (iter->index < tablesize)
+            {
+                void **slot = &table[iter->index++];
+                if (occupied(*slot))
+                    return slot;
+            }
+        }
+        // If we reach the end of this table...
+        iter->index = 0;
+        if (iter->tableA)
+        {
+            // we're done iterating. Reset the iterator and return NULL
+            iter->tableA = false;
+            return NULL;
+        }
+        // go on to table A
+        iter->tableA = true;
+    }
+}
+
+void *Set_iter_next(SetIterator *iter)
+{
+    void **slot = _Set_iter_next(iter);
+    if (slot == NULL)
+        return NULL;
+    return *slot;
+}
+
+static void **_Set_get(Set *set, void *value)
+{
+    assert(set != NULL);
+    assert(value != NULL);
+    uint hash = set->hash(value);
+    void **slot = _OATable_find(set->tableB, set->log2capB, SET_STRIDE, hash,
+                                set->comp, value);
+    if (slot != NULL || set->tableA == NULL)
+        return slot;
+    return _OATable_find(set->tableA, set->log2capA, SET_STRIDE, hash,
+                         set->comp, value);
+}
+
+// Move one entry from tableA to tableB
+static void _Set_transfer(Set *set)
+{
+    assert(set != NULL);
+    if (set->tableA != NULL)
+    {
+        uint cap = pow2(set->log2capA);
+        while (set->indexA < cap)
+        {
+            void **slot = &set->tableA[set->indexA];
+            if (occupied(*slot))
+            {
+                _Set_add(set, *slot, true);
+                *slot = deleted;
+                set->sizeA--;
+                return;
+            }
+            set->indexA++;
+        }
+        // We have emptied tableA
+        assert(set->sizeA == 0);
+        free(set->tableA);
+        set->tableA = NULL;
+    }
+    
+    if (!_OATable_full(set->sizeB + set->deletedB, set->log2capB))
+        return;
+    
+    uint log2newtablesize = _OATable_regrow(set->sizeB, set->log2capB);
+    set->tableA = set->tableB;
+    set->log2capA = set->log2capB;
+    set->sizeA = set->sizeB;
+    set->indexA = 0;
+    set->tableB = calloc(pow2(log2newtablesize), sizeof(void*));
+    set->log2capB = log2newtablesize;
+    set->sizeB = 0;
+    set->deletedB = 0;
+}
+
+bool Set_has(Set *set, void *value)
+{
+    return _Set_get(set, value) != NULL;
+}
+
+// Empty the given slot, which must belong to one of the set's tables
+static void _Set_remove_slot(Set *set, void **slot)
+{
+    *slot = deleted;
+    // check which table the slot was in:
+    if (slot >= set->tableA && slot < set->tableA + pow2(set->log2capA))
+        set->sizeA--;
+    else
+    {
+        set->sizeB--;
+        set->deletedB++;
+    }
+}
+
+void Set_remove(Set *set, void *value)
+{
+    void **slot = _Set_get(set, value);
+    if (slot != NULL)
+        _Set_remove_slot(set, slot);
+}
+
+// Add to table B, requires that the value is not yet in the set
+static void _Set_add(Set *set, void *value, bool recurrant)
+{
+    void **slot = _OATable_empty(set->tableB, set->log2capB, SET_STRIDE,
+                                 set->hash(value));
+    if (*slot == deleted)
+        set->deletedB--;
+    *slot = value;
+    set->sizeB++;
+    if (!recurrant)
+        _Set_transfer(set); // also move an item from tableA to tableB
+}
+
+void Set_add(Set *set, void *value)
+{
+    if (_Set_get(set, value) == NULL)
+        _Set_add(set, value, false);
+}
+
+void Set_del(Set *set)
+{
+    if (set->tableA != NULL)
+        free(set->tableA);
+    free(set->tableB);
+    free(set);
+}
+
+// Removing the current value does not disturb the iterator, since slots are
+// only ever marked deleted and never moved.
+void Set_intersect_inplace(Set *set1, Set *set2)
+{
+    SetIterator iter = Set_iter(set1);
+    void **slot;
+    while ((slot = _Set_iter_next(&iter)) != NULL)
+    {
+        if (!Set_has(set2, *slot))
+            _Set_remove_slot(set1, slot);
+    }
+}
+
+void Set_union_inplace(Set *set1, Set *set2)
+{
+    SetIterator iter = Set_iter(set2);
+    void **slot;
+    while ((slot = _Set_iter_next(&iter)) != NULL)
+        Set_add(set1, *slot);
+}
+
+void Set_difference_inplace(Set *set1, Set *set2)
+{
+    SetIterator iter = Set_iter(set1);
+    void **slot;
+    while ((slot = _Set_iter_next(&iter)) != NULL)
+    {
+        if (Set_has(set2, *slot))
+            _Set_remove_slot(set1, slot);
+    }
+}
+
+void Set_symdifference_inplace(Set *set1, Set *set2)
+{
+    Set *only2 = Set_difference(set2, set1);
+    Set_difference_inplace(set1, set2);
+    Set_union_inplace(set1, only2);
+    Set_del(only2);
+}
+
+Set *Set_intersection(Set *set1, Set *set2)
+{
+    Set *set = Set_copy(set1);
+    Set_intersect_inplace(set, set2);
+    return set;
+}
+
+Set *Set_union(Set *set1, Set *set2)
+{
+    Set *set = Set_copy(set1);
+    Set_union_inplace(set, set2);
+    return set;
+}
+
+Set *Set_difference(Set *set1, Set *set2)
+{
+    Set *set = Set_copy(set1);
+    Set_difference_inplace(set, set2);
+    return set;
+}
+
+Set *Set_symdifference(Set *set1, Set *set2)
+{
+    Set *set = Set_copy(set1);
+    Set_symdifference_inplace(set, set2);
+    return set;
+}
+
+// Since there are no chains, copying a set is just copying its tables
+Set *Set_copy(Set *set)
+{
+    Set *new = malloc(sizeof(Set));
+    *new = *set;
+    new->tableA = NULL;
+    if (set->tableA != NULL)
+    {
+        uint tableAsize = sizeof(void*) * pow2(set->log2capA);
+        new->tableA = malloc(tableAsize);
+        memcpy(new->tableA, set->tableA, tableAsize);
+    }
+    uint tableBsize = sizeof(void*) * pow2(set->log2capB);
+    new->tableB = malloc(tableBsize);
+    memcpy(new->tableB, set->tableB, tableBsize);
+    return new;
+}
+
+void Set_test()
+{
+    Set *set = Set_new(ptrhash, ptrcomp);
+    uint i;
+    // Add all integers from 1 to 50
+    for (i = 1; i <= 50; i++)
+        Set_add(set, (void*)i);
+    // Add all integers from 25 to 75
+    for (i = 25; i <= 75; i++)
+        Set_add(set, (void*)i);
+    // Make sure there are exactly 75 integers in the set
+    CU_ASSERT(Set_size(set) == 75);
+    CU_ASSERT(Set_has(set, (void*)75));
+    CU_ASSERT(!Set_has(set, (void*)76));
+    // Test the algebra against the integers from 50 to 100
+    Set *other = Set_new(ptrhash, ptrcomp);
+    for (i = 50; i <= 100; i++)
+        Set_add(other, (void*)i);
+    Set *result = Set_intersection(set, other);
+    CU_ASSERT(Set_size(result) == 26);
+    Set_del(result);
+    result = Set_union(set, other);
+    CU_ASSERT(Set_size(result) == 100);
+    Set_del(result);
+    result = Set_difference(set, other);
+    CU_ASSERT(Set_size(result) == 49);
+    CU_ASSERT(!Set_has(result, (void*)50));
+    Set_del(result);
+    result = Set_symdifference(set, other);
+    CU_ASSERT(Set_size(result) == 74);
+    CU_ASSERT(Set_has(result, (void*)100) && !Set_has(result, (void*)60));
+    Set_del(result);
+    Set_remove(set, (void*)30);
+    CU_ASSERT(!Set_has(set, (void*)30));
+    CU_ASSERT(Set_size(set) == 74);
+    Set_del(other);
+    Set_del(set);
+    // Churn at a steady size must not fill the table with deleted markers
+    set = Set_new(ptrhash, ptrcomp);
+    for (i = 1; i <= 100000; i++)
+    {
+        Set_add(set, (void*)i);
+        if (i > 50)
+            Set_remove(set, (void*)(i - 50));
+    }
+    CU_ASSERT(Set_size(set) == 50 && set->log2capB <= 8);
+    CU_ASSERT(_OATable_empties(set->tableB, set->log2capB, SET_STRIDE)
+              >= pow2(set->log2capB) / 4);
+    CU_ASSERT(Set_has(set, (void*)99951) && !Set_has(set, (void*)99950));
+    Set_del(set);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SkipList
+// An ordered map implemented by an indexable skip list
+////////////////////////////////////////////////////////////////////////////////
+
+int stringorder(void *str1, void *str2)
+{
+    return strcmp(str1, str2);
+}
+
+int ptrorder(void *ptr1, void *ptr2)
+{
+    return ((uint)ptr1 > (uint)ptr2) - ((uint)ptr1 < (uint)ptr2);
+}
+
+#define SKIPLIST_SLAB 64 // nodes carved out of each pool allocation
+
+static inline uint _SkipList_nodesize(uint level)
+{
+    return sizeof(SkipListNode) + level * sizeof(SkipListLink);
+}
+
+// Nodes of each level come from their own free list, refilled a slab at a time
+static SkipListNode *_SkipList_alloc(SkipList *list, uint level)
+{
+    SkipListNode *node = list->free[level - 1];
+    if (node != NULL)
+    {
+        list->free[level - 1] = node->links[0].next;
+    }
+    else
+    {
+        uint size = _SkipList_nodesize(level);
+        // the first word of each slab links it to the previous one
+        void **slab = malloc(sizeof(void*) + SKIPLIST_SLAB * size);
+        *slab = list->slabs;
+        list->slabs = slab;
+        char *nodes = (char*)(slab + 1);
+        uint i;
+        for (i = 1; i < SKIPLIST_SLAB; i++)
+        {
+            SkipListNode *spare = (SkipListNode*)(nodes + i * size);
+            spare->links[0].next = list->free[level - 1];
+            list->free[level - 1] = spare;
+        }
+        node = (SkipListNode*)nodes;
+    }
+    node->level = level;
+    return node;
+}
+
+static void _SkipList_free(SkipList *list, SkipListNode *node)
+{
+    node->links[0].next = list->free[node->level - 1];
+    list->free[node->level - 1] = node;
+}
+
+SkipList *SkipList_new(int (*cmp)(void*,void*))
+{
+    SkipList *list = malloc(sizeof(SkipList));
+    list->cmp = cmp;
+    list->size = 0;
+    list->level = 1;
+    list->seed = 0x2545F4914F6CDD1Dul;
+    list->slabs = NULL;
+    memset(list->free, 0, sizeof(list->free));
+    list->head = malloc(_SkipList_nodesize(SKIPLIST_MAXLEVEL));
+    list->head->key = list->head->value = NULL;
+    list->head->level = SKIPLIST_MAXLEVEL;
+    uint i;
+    for (i = 0; i < SKIPLIST_MAXLEVEL; i++)
+    {
+        list->head->links[i].next = NULL;
+        list->head->links[i].span = 0;
+    }
+    return list;
+}
+
+// Each level holds a quarter of the nodes of the level below
+static uint _SkipList_random_level(SkipList *list)
+{
+    // xorshift64
+    list->seed ^= list->seed << 13;
+    list->seed ^= list->seed >> 7;
+    list->seed ^= list->seed << 17;
+    uint bits = list->seed;
+    uint level = 1;
+    while ((bits & 3) == 0 && level < SKIPLIST_MAXLEVEL)
+    {
+        level++;
+        bits >>= 2;
+    }
+    return level;
+}
+
+// Find the last node on each level before key, and its rank (1 for the first
+// node, 0 for the head)
+static SkipListNode *_SkipList_search(SkipList *list, void *key,
+                                      SkipListNode **update, uint *rank)
+{
+    SkipListNode *node = list->head;
+    int i;
+    for (i = (int)list->level - 1; i >= 0; i--)
+    {
+        rank[i] = (i == (int)list->level - 1)? 0 : rank[i + 1];
+        while (node->links[i].next != NULL &&
+               list->cmp(node->links[i].next->key, key) < 0)
+        {
+            rank[i] += node->links[i].span;
+            node = node->links[i].next;
+        }
+        update[i] = node;
+    }
+    return node->links[0].next;
+}
+
+void *SkipList_set(SkipList *list, void *key, void *value)
+{
+    SkipListNode *update[SKIPLIST_MAXLEVEL];
+    uint rank[SKIPLIST_MAXLEVEL];
+    SkipListNode *node = _SkipList_search(list, key, update, rank);
+    if (node != NULL && list->cmp(node->key, key) == 0)
+    {
+        void *oldvalue = node->value;
+        node->value = value;
+        return oldvalue;
+    }
+    uint level = _SkipList_random_level(list);
+    uint i;
+    for (i = list->level; i < level; i++)
+    {
+        rank[i] = 0;
+        update[i] = list->head;
+        update[i]->links[i].span = list->size;
     }
-    // We didn't find an existing such key, so add it
-    _ChainedMap_add(map, key, value, false);
+    list->level = max(list->level, level);
+    node = _SkipList_alloc(list, level);
+    node->key = key;
+    node->value = value;
+    for (i = 0; i < level; i++)
+    {
+        SkipListLink *link = &update[i]->links[i];
+        node->links[i].next = link->next;
+        node->links[i].span = link->span - (rank[0] - rank[i]);
+        link->next = node;
+        link->span = rank[0] - rank[i] + 1;
+    }
+    // links passing over the new node are now one step longer
+    for (; i < list->level; i++)
+        update[i]->links[i].span++;
+    list->size++;
     return NULL;
 }
 
-void ChainedMap_del(ChainedMap *map)
+void *SkipList_remove(SkipList *list, void *key)
 {
+    SkipListNode *update[SKIPLIST_MAXLEVEL];
+    uint rank[SKIPLIST_MAXLEVEL];
+    SkipListNode *node = _SkipList_search(list, key, update, rank);
+    if (node == NULL || list->cmp(node->key, key) != 0)
+        return NULL;
     uint i;
-    ChainedMapBucket *bucket, *next;
-    if (map->tableA != NULL)
-    {
-        for (i = 0; i < pow2(map->log2capA); i++)
-        {
-            bucket = &map->tableA[i];
-            next = bucket->next;
-            while (next != NULL)
-            {
-                free(next);
-                next = next->next;
-                bucket->next = next;
-            }
-        }
-        free(map->tableA);
-    }
-    for (i = 0; i < pow2(map->log2capB); i++)
+    for (i = 0; i < list->level; i++)
     {
-        bucket = &map->tableB[i];
-        next = bucket->next;
-        while (next != NULL)
+        SkipListLink *link = &update[i]->links[i];
+        if (link->next == node)
         {
-            free(next);
-            next = next->next;
-            bucket->next = next;
+            link->span += node->links[i].span - 1;
+            link->next = node->links[i].next;
         }
+        else
+            link->span--;
     }
-    free(map->tableB);
-    free(map);
+    while (list->level > 1 && list->head->links[list->level - 1].next == NULL)
+        list->level--;
+    list->size--;
+    void *value = node->value;
+    _SkipList_free(list, node);
+    return value;
 }
 
-void ChainedMap_test()
+SkipListNode *SkipList_ceiling(SkipList *list, void *key)
 {
-    ChainedMap *map = ChainedMap_new(stringhash, stringcomp);
-    ChainedMap_set(map, "test0", "a");
-    ChainedMap_set(map, "test1", "b");
-    ChainedMap_set(map, "test2", "c");
-    ChainedMap_set(map, "test3", "d");
-    ChainedMap_set(map, "test0", "e");
-    CU_ASSERT(strcmp(ChainedMap_get(map, "test0"), "e") == 0);
-    CU_ASSERT(strcmp(ChainedMap_get(map, "test1"), "b") == 0);
-    CU_ASSERT(strcmp(ChainedMap_get(map, "test2"), "c") == 0);
-    CU_ASSERT(strcmp(ChainedMap_get(map, "test3"), "d") == 0);
-    ChainedMap_remove(map, "test2");
-    CU_ASSERT(strcmp(ChainedMap_get(map, "test0"), "e") == 0);
-    CU_ASSERT(strcmp(ChainedMap_get(map, "test1"), "b") == 0);
-    CU_ASSERT(ChainedMap_get(map, "test2") == NULL);
-    CU_ASSERT(strcmp(ChainedMap_get(map, "test3"), "d") == 0);
-    ChainedMap_del(map);
+    SkipListNode *update[SKIPLIST_MAXLEVEL];
+    uint rank[SKIPLIST_MAXLEVEL];
+    return _SkipList_search(list, key, update, rank);
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// MultiMap
-// Like Map, but each key can have 1 or more values (instead of just 1).
-// An open addressing scheme is used.
-////////////////////////////////////////////////////////////////////////////////
+static SkipListNode *_SkipList_get(SkipList *list, void *key)
+{
+    SkipListNode *node = SkipList_ceiling(list, key);
+    if (node == NULL || list->cmp(node->key, key) != 0)
+        return NULL;
+    return node;
+}
 
-MultiMap *MultiMap_new(uint (*hash)(void*), bool (*comp)(void*,void*))
+bool SkipList_has(SkipList *list, void *key)
 {
-    return Map_new(hash, comp);
+    return _SkipList_get(list, key) != NULL;
 }
 
-MultiMap *MultiMap_new_sized(uint log2size, uint (*hash)(void*), bool (*comp)(void*,void*))
+void *SkipList_get(SkipList *list, void *key)
 {
-    return Map_new_sized(log2size, hash, comp);
+    SkipListNode *node = _SkipList_get(list, key);
+    return (node == NULL)? NULL : node->value;
 }
 
-bool MultiMap_has(MultiMap *map, void *key)
+uint SkipList_rank(SkipList *list, void *key)
 {
-    return Map_has(map, key);
+    SkipListNode *update[SKIPLIST_MAXLEVEL];
+    uint rank[SKIPLIST_MAXLEVEL];
+    _SkipList_search(list, key, update, rank);
+    return rank[0];
 }
 
-bool MultiMap_has_pair(MultiMap *map, void *key, void *value)
+SkipListNode *SkipList_index(SkipList *list, int index)
 {
-    LinkedList *list = Map_get(map, key);
-    LinkedListElement *first = list->first;
-    LinkedListElement *elem = first;
-    do
+    int size = (int)list->size;
+    if (index < 0)
+        index += size;
+    if (index < 0 || index >= size) // check bounds
+        return NULL;
+    uint target = index + 1; // rank of the node we want
+    uint traversed = 0;
+    SkipListNode *node = list->head;
+    int i;
+    for (i = (int)list->level - 1; i >= 0; i--)
     {
-        if (elem->value == value)
-            return true;
-        elem = elem->next;
-    } while (elem != first);
-    return false;
+        while (node->links[i].next != NULL &&
+               traversed + node->links[i].span <= target)
+        {
+            traversed += node->links[i].span;
+            node = node->links[i].next;
+        }
+        if (traversed == target)
+            return node;
+    }
+    return NULL;
 }
 
-LinkedList *MultiMap_get(MultiMap *map, void *key)
+SkipListNode *SkipList_next(SkipListNode *node)
 {
-    return Map_get(map, key);
+    return node->links[0].next;
 }
 
-bool MultiMap_remove_key(MultiMap *map, void *key)
+void SkipList_del(SkipList *list)
 {
-    LinkedList *list = Map_remove(map, key);
-    if (list == NULL)
-        return false;
-    LinkedList_del(list);
-    return true;
+    void **slab = list->slabs;
+    while (slab != NULL)
+    {
+        void **next = *slab;
+        free(slab);
+        slab = next;
+    }
+    free(list->head);
+    free(list);
 }
 
-LinkedList *MultiMap_remove(MultiMap *map, void *key, void *value)
+void SkipList_test()
 {
-    LinkedList *list = Map_get(map, key);
-    if (list == NULL)
-        return NULL;
-    LinkedList_remove_all(list, value);
-    return list;
+    SkipList *list = SkipList_new(ptrorder);
+    uint i;
+    // Insert the even numbers from 2 to 2000 in a scrambled order
+    for (i = 0; i < 1000; i++)
+        SkipList_set(list, (void*)(((i * 7919) % 1000 + 1) * 2), (void*)i);
+    CU_ASSERT(list->size == 1000);
+    SkipList_set(list, (void*)2, (void*)5000);
+    CU_ASSERT(SkipList_get(list, (void*)2) == (void*)5000);
+    CU_ASSERT(list->size == 1000);
+    CU_ASSERT(SkipList_has(list, (void*)1000));
+    CU_ASSERT(!SkipList_has(list, (void*)1001));
+    // Test rank and index
+    CU_ASSERT(SkipList_rank(list, (void*)2) == 0);
+    CU_ASSERT(SkipList_rank(list, (void*)1001) == 500);
+    CU_ASSERT(SkipList_index(list, 499)->key == (void*)1000);
+    CU_ASSERT(SkipList_index(list, -1)->key == (void*)2000);
+    CU_ASSERT(SkipList_index(list, 1000) == NULL);
+    // Test remove, then a range scan over [101, 121)
+    for (i = 2; i <= 1000; i += 4)
+        SkipList_remove(list, (void*)i);
+    CU_ASSERT(list->size == 750);
+    CU_ASSERT(SkipList_index(list, 0)->key == (void*)4);
+    CU_ASSERT(SkipList_rank(list, (void*)1001) == 250);
+    SkipListNode *node;
+    uint count = 0;
+    for (node = SkipList_ceiling(list, (void*)101);
+         node != NULL && ptrorder(node->key, (void*)121) < 0;
+         node = SkipList_next(node))
+        count++;
+    CU_ASSERT(count == 5); // 104, 108, 112, 116, 120
+    SkipList_del(list);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// StrBuilder
+// Useful for building lengths of string
+////////////////////////////////////////////////////////////////////////////////
+
+uint _StrBuilder_nextsize(uint size)
+{
+    return size + (size >> 1);
 }
 
-LinkedList *MultiMap_add(MultiMap *map, void *key, void *value)
+// StrArena: blocks are bump allocated and all freed together. Each block
+// starts with a pointer to the one before.
+
+StrArena *StrArena_new(uint blocksize)
 {
-    LinkedList *list = Map_get(map, key);
-    if (list == NULL)
+    StrArena *arena = malloc(sizeof(StrArena));
+    arena->blocksize = blocksize;
+    arena->blocks = malloc(sizeof(char*) + blocksize);
+    *(char**)arena->blocks = NULL;
+    arena->top = arena->blocks + sizeof(char*);
+    arena->end = arena->top + blocksize;
+    return arena;
+}
+
+char *StrArena_alloc(StrArena *arena, uint size)
+{
+    if (size > (uint)(arena->end - arena->top))
     {
-        list = LinkedList_new();
-        Map_set(map, key, list);
+        // Oversized requests get a block of their own
+        uint blocksize = max(size, arena->blocksize);
+        char *block = malloc(sizeof(char*) + blocksize);
+        *(char**)block = arena->blocks;
+        arena->blocks = block;
+        arena->top = block + sizeof(char*);
+        arena->end = arena->top + blocksize;
     }
-    LinkedList_add(list, value);
-    return list;
+    char *p = arena->top;
+    arena->top += size;
+    return p;
 }
 
-void MultiMap_del(MultiMap *map)
+char *StrArena_realloc(StrArena *arena, char *p, uint size, uint newsize)
 {
-    uint i;
-    for (i = 0; i < pow2(map->log2capA); i++)
+    // The newest allocation can grow in place
+    if (p + size == arena->top && newsize <= (uint)(arena->end - p))
     {
-        LinkedList *list = map->tableA[i].value;
-        if (list != NULL)
-            LinkedList_del(list);
+        arena->top = p + newsize;
+        return p;
     }
-    for (i = 0; i < pow2(map->log2capB); i++)
+    char *moved = StrArena_alloc(arena, newsize);
+    memcpy(moved, p, min(size, newsize));
+    return moved;
+}
+
+void StrArena_reset(StrArena *arena)
+{
+    // Keep only the first block, which has the usual size
+    while (*(char**)arena->blocks != NULL)
     {
-        LinkedList *list = map->tableB[i].value;
-        if (list != NULL)
-            LinkedList_del(list);
+        char *prev = *(char**)arena->blocks;
+        free(arena->blocks);
+        arena->blocks = prev;
     }
-    Map_del(map);
+    arena->top = arena->blocks + sizeof(char*);
+    arena->end = arena->top + arena->blocksize;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Set
-// A set type implemented by hash table
-////////////////////////////////////////////////////////////////////////////////
+void StrArena_del(StrArena *arena)
+{
+    StrArena_reset(arena);
+    free(arena->blocks);
+    free(arena);
+}
 
-static void _Set_add(Set *set, void *value, bool recurrant);
+void StrBuilder_init(StrBuilder *sb)
+{
+    assert(sb != NULL);
+    sb->size = 0;
+    sb->cap = STRBUILDER_SMALL;
+    sb->s = sb->small;
+    sb->slices = NULL;
+    sb->nslices = sb->slicecap = 0;
+    sb->blocks = NULL;
+    sb->arena = NULL;
+    sb->sink = NULL;
+}
 
-Set *Set_new_sized(uint log2tablesize,
-                   uint (*hash)(void*),
-                   bool (*comp)(void*,void*))
+void StrBuilder_init_arena(StrBuilder *sb, StrArena *arena)
 {
-    Set *set = malloc(sizeof(Set));
-    set->hash = hash;
-    set->comp = comp;
-    set->indexA = 0;
-    set->sizeA = 0;
-    set->sizeB = 0;
-    set->log2capA = 0;
-    set->log2capB = log2tablesize;
-    set->tableA = NULL;
-    set->tableB = calloc(pow2(log2tablesize), sizeof(SetBucket));
-    return set;
+    StrBuilder_init(sb);
+    // Start in the arena so cstr() outlives the builder
+    sb->arena = arena;
+    sb->cap = 16;
+    sb->s = StrArena_alloc(arena, sb->cap);
 }
 
-Set *Set_new(uint (*hash)(void*), bool (*comp)(void*,void*))
+StrBuilder *StrBuilder_new(char *initial)
 {
-    return Set_new_sized(4, hash, comp);
+    StrBuilder *sb = malloc(sizeof(StrBuilder));
+    StrBuilder_init(sb);
+    if (initial != NULL)
+        StrBuilder_append(sb, initial);
+    return sb;
 }
 
-SetIterator Set_iter(Set *set)
+StrBuilder *StrBuilder_new_chunked()
 {
-    SetIterator iter;
-    iter.set = set;
-    iter.tableA = false;
-    iter.index = 0;
-    return iter;
+    StrBuilder *sb = malloc(sizeof(StrBuilder));
+    StrBuilder_init(sb);
+    sb->cap = 0;
+    sb->s = NULL;
+    sb->slicecap = 8;
+    sb->slices = malloc(sizeof(StrSlice) * sb->slicecap);
+    return sb;
 }
 
-static SetBucket *_Set_iter_current(SetIterator *iter)
+// Frees every block but the newest if keep is set
+static void _StrBuilder_free_blocks(StrBuilder *sb, bool keep)
 {
-    SetBucket *table;
-    if (iter->tableA)
-        table = tableA;
+    char *block = sb->blocks;
+    if (keep && block != NULL)
+    {
+        block = *(char**)sb->blocks;
+        *(char**)sb->blocks = NULL;
+    }
     else
-        table = tableB;
-    SetBucket *bucket;
-    bucket = &table[iter->bucket_index];
-    assert(bucket->value != NULL);
-    uint i = iter->chain_index;
-    while (i --> 0)
+        sb->blocks = NULL;
+    while (block != NULL)
     {
-        bucket = bucket->next;
-        assert(bucket != NULL);
+        char *prev = *(char**)block;
+        free(block);
+        block = prev;
     }
-    return bucket;
 }
 
-void *Set_iter_current(SetIterator *iter)
+void StrBuilder_release(StrBuilder *sb)
 {
-    return _Set_iter_current(iter)->value;
+    if (sb->slices != NULL)
+    {
+        _StrBuilder_free_blocks(sb, false);
+        free(sb->slices);
+    }
+    else if (sb->arena == NULL && sb->s != sb->small)
+        free(sb->s);
 }
 
-// The iterator should be describing the position of the bucket returned once
-// this function returns
-static SetBucket *_Set_iter_next(SetIterator *iter)
+void StrBuilder_del(StrBuilder *sb)
 {
-    SetBucket *table;
-    uint tablesize;
-    if (iter->tableA)
-    {
-        table = tableA;
-        tablesize = pow2(set->log2capA);
-    }
-    else
+    if (sb->sink != NULL)
     {
-        table = tableB;
-        tablesize = pow2(set->log2capB);
+        StrBuilder_close(sb);
+        return;
     }
-    iter->chain_index++;
-    SetBucket *bucket;
-    while (true)
+    StrBuilder_release(sb);
+    free(sb);
+}
+
+// Sink builders fill one buffer while a writer thread drains the other
+struct strSink
+{
+    int fd;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // there is something to write, or stopping
+    pthread_cond_t done; // the back buffer has been written
+    char *back; // the buffer being written, or free when pending is 0
+    uint pending; // bytes in back still to be written
+    bool stopping;
+    bool failed; // a write failed and later output is dropped
+};
+
+static bool _StrSink_write(int fd, char *data, uint size)
+{
+    while (size > 0)
     {
-        bucket = &table[iter->bucket_index];
-        if (bucket->value != NULL)
-            break;
-        iter->chain_index = 0;
-        iter->bucket_index++;
-        // If we reach the end of this table...
-        if (iter->bucket_index >= tablesize)
+        ssize_t written = write(fd, data, size);
+        if (written < 0)
         {
-            iter->bucket_index = 0;
-            if (iter->tableA)
-            {
-                // we're done iterating. Reset the iterator and return NULL
-                iter->tableA = false;
-                return NULL;
-            }
-            else
-            {
-                // go on to table A
-                iter->tableA = true;
-            }
+            if (errno == EINTR)
+                continue;
+            return false;
         }
+        data += written;
+        size -= written;
     }
-    uint i = iter->chain_index;
-    while (i --> 0)
+    return true;
+}
+
+static void *_StrSink_writer(void *arg)
+{
+    StrSink *sink = arg;
+    pthread_mutex_lock(&sink->lock);
+    while (true)
     {
-        bucket = bucket->next;
-        if (bucket == NULL)
-            return NULL;
+        while (sink->pending == 0 && !sink->stopping)
+            pthread_cond_wait(&sink->wake, &sink->lock);
+        if (sink->pending == 0)
+            break;
+        char *data = sink->back;
+        uint size = sink->pending;
+        bool failed = sink->failed;
+        pthread_mutex_unlock(&sink->lock);
+        if (!failed && !_StrSink_write(sink->fd, data, size))
+            failed = true;
+        pthread_mutex_lock(&sink->lock);
+        sink->failed = failed;
+        sink->pending = 0;
+        pthread_cond_broadcast(&sink->done);
     }
-    return bucket;
+    pthread_mutex_unlock(&sink->lock);
+    return NULL;
 }
 
-void *Set_iter_next(SetIterator *iter)
+// Swaps the full buffer for the written one, waiting only if the writer is
+// still a whole buffer behind
+static void _StrSink_handoff(StrBuilder *sb)
 {
-    return _Set_iter_next(iter);
+    StrSink *sink = sb->sink;
+    if (sb->size == 0)
+        return;
+    pthread_mutex_lock(&sink->lock);
+    while (sink->pending > 0)
+        pthread_cond_wait(&sink->done, &sink->lock);
+    swap(sb->s, sink->back);
+    sink->pending = sb->size;
+    pthread_cond_signal(&sink->wake);
+    pthread_mutex_unlock(&sink->lock);
+    sb->size = 0;
 }
 
-static SetBucket *_Set_get_chain(Set *set, SetBucket *settable,
-                                 uint index, void *value)
+static void _StrBuilder_appendN_sink(StrBuilder *sb, char *s, uint len)
 {
-    SetBucket *bucket = &settable[index];
-    if (bucket->value != NULL)
+    // Never grow: anything beyond a full buffer waits for the next one
+    while (len > 0)
     {
-        do
-        {
-            if (set->comp(bucket->value, value))
-                return bucket;
-            bucket = bucket->next;
-        } while (bucket != NULL);
+        if (sb->size == sb->cap)
+            _StrSink_handoff(sb);
+        uint n = min(len, sb->cap - sb->size);
+        memcpy(sb->s + sb->size, s, n);
+        sb->size += n;
+        s += n;
+        len -= n;
     }
-    return NULL;
 }
 
-// Move one entry from tableA to tableB
-static void _Set_transfer(Set *set)
+// Makes room for n more bytes in a flat builder
+static void _StrBuilder_grow(StrBuilder *sb, uint n)
 {
-    assert(set != NULL);
-    if (set->tableA != NULL)
+    uint cap = _StrBuilder_nextsize(sb->size + n);
+    if (sb->arena != NULL)
+        sb->s = StrArena_realloc(sb->arena, sb->s, sb->cap, cap);
+    else if (sb->s == sb->small)
     {
-        uint i = set->indexA;
-        uint cap = pow2(set->log2capA);
-        SetBucket *bucket, *next;
-        for (i = 0; i < cap; i++)
-        {
-            bucket = &set->tableA[i];
-            if (bucket->value != NULL)
-            {
-                next = bucket->next->next;
-                void *value = bucket->value;
-                bucket->value = next->value;
-                free(bucket->next);
-                bucket->next = next;
-                _Set_add(set, value, true);
-                set->indexA = i;
-                return;
-            }
-        }
+        // Spill to the heap
+        sb->s = malloc(cap);
+        memcpy(sb->s, sb->small, sb->size);
     }
-    
-    // check to see if table B has reached 75% cap.
-    uint high_load = pow2(set->log2capB + 2) + pow2(set->log2capB + 1);
-    if (set->sizeB < high_load)
-        return;
-    
-    uint log2newtablesize = set->log2capB + 1; // grow by 2x
-    if (set->tableA != NULL)
-        free(set->tableA);
-    set->tableA = set->tableB;
-    set->log2capA = set->log2capB;
-    set->sizeA = set->sizeB;
-    set->indexA = 0;
-    set->tableB = calloc(pow2(log2newtablesize), sizeof(SetBucket));
-    set->log2capB = log2newtablesize;
-    set->sizeB = 0;
+    else
+        sb->s = realloc(sb->s, cap);
+    sb->cap = cap;
 }
 
-bool Set_has(Set *set, void *value)
+static StrSlice *_StrBuilder_add_slice(StrBuilder *sb, char *data, bool borrowed)
 {
-    assert(set != NULL);
-    assert(value != NULL);
-    uint hash = set->hash(value);
-    uint indexB = hash & mask(set->log2capB);
-    SetBucket *bucket = _Set_get_chain(set, set->tableB, indexB, value);
-    while (bucket != NULL)
+    if (sb->nslices == sb->slicecap)
     {
-        if (set->comp(bucket->value, value))
-            return true;
-        bucket = bucket->next;
+        sb->slicecap *= 2;
+        sb->slices = realloc(sb->slices, sizeof(StrSlice) * sb->slicecap);
     }
-    uint indexA = hash & mask(set->log2capA);
-    bucket = _Set_get_chain(set, set->tableA, indexA, value);
-    while (bucket != NULL)
+    StrSlice *slice = &sb->slices[sb->nslices++];
+    slice->data = data;
+    slice->size = 0;
+    slice->borrowed = borrowed;
+    return slice;
+}
+
+// The slice being appended to. After a borrowed slice a new one is opened
+// where the last left off in the current block.
+static StrSlice *_StrBuilder_open_slice(StrBuilder *sb)
+{
+    if (sb->cap == 0) // start a new block
     {
-        if (set->comp(bucket->value, value))
-            return true;
-        bucket = bucket->next;
+        char *block = malloc(sizeof(char*) + STRBUILDER_BLOCK);
+        *(char**)block = sb->blocks;
+        sb->blocks = block;
+        sb->s = block + sizeof(char*);
+        sb->cap = STRBUILDER_BLOCK;
     }
-    return false;
+    else if (sb->nslices > 0 && !sb->slices[sb->nslices - 1].borrowed)
+        return &sb->slices[sb->nslices - 1];
+    return _StrBuilder_add_slice(sb, sb->s, false);
 }
 
-static bool _Set_remove(Set *set, SetBucket *table, void *value, uint index)
+static void _StrBuilder_appendN_chunked(StrBuilder *sb, char *s, uint len)
 {
-    SetBucket *bucket = &table[index];
-    if (set->comp(bucket->value, value))
+    sb->size += len;
+    while (len > 0)
     {
-        SetBucket *next = bucket->next;
-        if (bucket->next != NULL)
-        {
-            bucket->value = next->value;
-            bucket->next = next->next;
-            free(next);
-        }
-        else
-            bucket->value = NULL;
-        
-        return true;
+        StrSlice *slice = _StrBuilder_open_slice(sb);
+        uint n = min(sb->cap, len);
+        memcpy(sb->s, s, n);
+        sb->s += n;
+        sb->cap -= n;
+        slice->size += n;
+        s += n;
+        len -= n;
     }
-    SetBucket *prev = bucket;
-    for (bucket = bucket->next; bucket != NULL; bucket = bucket->next)
+}
+
+void StrBuilder_appendN(StrBuilder *sb, char *s, uint len)
+{
+    if (sb->slices != NULL)
     {
-        if (set->comp(bucket->value, value))
-        {
-            prev->next = bucket->next;
-            value = bucket->value;
-            free(bucket);
-            return true;
-        }
-        prev = bucket;
+        _StrBuilder_appendN_chunked(sb, s, len);
+        return;
     }
-    return false;
+    if (sb->sink != NULL)
+    {
+        _StrBuilder_appendN_sink(sb, s, len);
+        return;
+    }
+    if (sb->size + len > sb->cap)
+        _StrBuilder_grow(sb, len);
+    memcpy(sb->s + sb->size, s, len);
+    sb->size += len;
 }
 
-void Set_remove(Set *set, void *value)
+// Room for at least n more bytes, written in place and then claimed with
+// _StrBuilder_commit()
+static char *_StrBuilder_reserve(StrBuilder *sb, uint n)
 {
-    assert(set != NULL);
-    assert(value != NULL);
-    uint hash = set->hash(value);
-    uint indexB = hash & mask(set->log2capB);
-    bool removed = _Set_remove(set, set->tableB, value, indexB);
-    if (removed)
+    if (sb->slices != NULL)
     {
-        set->sizeB--;
-        return;
+        assert(n <= STRBUILDER_BLOCK);
+        if (sb->cap < n)
+            sb->cap = 0; // leave the rest of this block unused
+        _StrBuilder_open_slice(sb);
+        return sb->s;
     }
-    uint indexA = hash & mask(set->log2capA);
-    bool removed = _Set_remove(set, set->tableA, value, indexA);
-    if (removed)
+    if (sb->sink != NULL)
     {
-        set->sizeA--;
-        return;
+        assert(n <= sb->cap);
+        if (sb->size + n > sb->cap)
+            _StrSink_handoff(sb);
     }
+    else if (sb->size + n > sb->cap)
+        _StrBuilder_grow(sb, n);
+    return sb->s + sb->size;
 }
 
-// Add to table B, requires that the value is not yet in table B
-static void _Set_add(Set *set, void *value, bool recurrant)
+static void _StrBuilder_commit(StrBuilder *sb, uint n)
 {
-    uint index = set->hash(value) & mask(set->log2capB);
-    SetBucket *bucket = &set->tableB[index];
-    SetBucket *new_bucket = malloc(sizeof(SetBucket));
-    new_bucket->value = bucket->value;
-    new_bucket->next = bucket->next;
-    bucket->value = value;
-    bucket->next = new_bucket;
-    set->sizeB++;
-    if (!recurrant)
-        _Set_transfer(set); // also move an item from tableA to tableB
+    sb->size += n;
+    if (sb->slices != NULL)
+    {
+        sb->slices[sb->nslices - 1].size += n;
+        sb->s += n;
+        sb->cap -= n;
+    }
 }
 
-void Set_del(Set *set)
+void StrBuilder_append(StrBuilder *sb, char *s)
 {
-    uint i;
-    SetBucket *bucket, *next;
-    if (set->tableA != NULL)
+    uint len = strlen(s);
+    StrBuilder_appendN(sb, s, len);
+}
+
+void StrBuilder_appendC(StrBuilder *sb, char c)
+{
+    StrBuilder_appendN(sb, &c, 1);
+}
+
+void StrBuilder_append_borrowed(StrBuilder *sb, char *s, uint len)
+{
+    // Short strings are cheaper to copy than to give their own iovec
+    if (sb->slices == NULL || len < STRBUILDER_BORROW)
     {
-        for (i = 0; i < pow2(set->log2capA); i++)
-        {
-            bucket = &set->tableA[i];
-            next = bucket->next;
-            while (next != NULL)
-            {
-                free(next);
-                next = next->next;
-                bucket->next = next;
-            }
-        }
-        free(set->tableA);
+        StrBuilder_appendN(sb, s, len);
+        return;
     }
-    for (i = 0; i < pow2(set->log2capB); i++)
+    _StrBuilder_add_slice(sb, s, true)->size = len;
+    sb->size += len;
+}
+
+void StrBuilder_join(StrBuilder *sb1, StrBuilder *sb2)
+{
+    if (sb2->slices == NULL)
     {
-        bucket = &set->tableB[i];
-        next = bucket->next;
-        while (next != NULL)
-        {
-            free(next);
-            next = next->next;
-            bucket->next = next;
-        }
+        StrBuilder_appendN(sb1, sb2->s, sb2->size);
+        return;
     }
-    free(set->tableB);
-    free(set);
+    uint i;
+    for (i = 0; i < sb2->nslices; i++)
+        StrBuilder_appendN(sb1, sb2->slices[i].data, sb2->slices[i].size);
 }
 
-/// This could actually be pretty bad, iterating through the set while removing
-/// items... Maybe have an iterator method to remove the current item gracefully?
-void Set_intersect_inplace(Set *set1, Set *set2)
+char *StrBuilder_tostring(StrBuilder *sb)
 {
-    SetIterator iter = Set_iter(set1);
-    SetBucket *bucket;
-    while ((bucket = _Set_iter_next(&iter)) != NULL)
+    assert(sb->sink == NULL);
+    if (sb->slices != NULL)
     {
-        if (!Set_has(set2, bucket->value))
+        char *s = malloc(sb->size + 1), *end = s;
+        uint i;
+        for (i = 0; i < sb->nslices; i++)
         {
-            SetBucket *table = (iter.tableA)? set1->tableA : set1->tableB;
-            _Set_remove(set1, table, bucket->value, iter.bucket_index);
+            memcpy(end, sb->slices[i].data, sb->slices[i].size);
+            end += sb->slices[i].size;
         }
+        *end = '\0';
+        StrBuilder_del(sb);
+        return s;
+    }
+    assert(sb->arena == NULL);
+    char *s = sb->s;
+    if (s == sb->small)
+    {
+        s = malloc(sb->size + 1);
+        memcpy(s, sb->small, sb->size);
     }
+    else if (sb->size == sb->cap)
+        s = realloc(s, sb->size + 1);
+    s[sb->size] = '\0';
+    free(sb);
+    return s;
 }
 
-void Set_union_inplace(Set *set1, Set *set2)
+char *StrBuilder_cstr(StrBuilder *sb)
 {
-    SetIterator iter = Set_iter(set2);
-    SetBucket *bucket = _Set_iter_next(&iter);
-    for ( ; bucket != NULL; bucket = _Set_iter_next(&iter))
-        _Set_add(set1, bucket->value, false);
+    assert(sb->slices == NULL && sb->sink == NULL);
+    if (sb->size == sb->cap)
+        _StrBuilder_grow(sb, 1);
+    sb->s[sb->size] = '\0';
+    return sb->s;
 }
 
-void Set_difference_inplace(Set *set1, Set *set2)
+bool StrBuilder_writev(StrBuilder *sb, int fd)
 {
-    SetIterator iter = Set_iter(set1);
-    SetBucket *bucket = _Set_iter_next(&iter);
-    for ( ; bucket != NULL; bucket = _Set_iter_next(&iter))
+    assert(sb->sink == NULL);
+    StrSlice flat = {sb->s, sb->size, false};
+    StrSlice *slices = &flat;
+    uint nslices = 1, next = 0;
+    if (sb->slices != NULL)
     {
-        if (Set_has(set2, bucket->value))
+        slices = sb->slices;
+        nslices = sb->nslices;
+    }
+    struct iovec iov[STRBUILDER_IOV];
+    bool ok = true;
+    while (ok && next < nslices)
+    {
+        uint n;
+        for (n = 0; n < STRBUILDER_IOV && next < nslices; n++, next++)
+        {
+            iov[n].iov_base = slices[next].data;
+            iov[n].iov_len = slices[next].size;
+        }
+        struct iovec *v = iov;
+        while (n > 0)
         {
-            SetBucket *table = (iter.tableA)? set1->tableA : set1->tableB;
-            _Set_remove(set1, table, bucket->value, iter.bucket_index);
+            ssize_t written = writev(fd, v, n);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                ok = false;
+                break;
+            }
+            // Skip what went out and trim a partial write
+            while (n > 0 && (size_t)written >= v->iov_len)
+            {
+                written -= v->iov_len;
+                v++;
+                n--;
+            }
+            if (n > 0)
+            {
+                v->iov_base = (char*)v->iov_base + written;
+                v->iov_len -= written;
+            }
         }
     }
+    sb->size = 0;
+    if (sb->slices != NULL)
+    {
+        // Keep the current block for what comes next
+        _StrBuilder_free_blocks(sb, true);
+        sb->nslices = 0;
+    }
+    return ok;
 }
 
-void Set_symdifference_inplace(Set *set1, Set *set2)
+StrBuilder *StrBuilder_new_sink(int fd, uint bufsize)
 {
-    Set_difference_inplace(set1, set2);
-    Set_union_inplace(set1, Set_difference(set2, set1));
+    // Formatted appends reserve up to 32 bytes at once
+    bufsize = max(bufsize, STRBUILDER_SINK_MIN);
+    StrBuilder *sb = malloc(sizeof(StrBuilder));
+    StrBuilder_init(sb);
+    sb->cap = bufsize;
+    sb->s = malloc(bufsize);
+    StrSink *sink = malloc(sizeof(StrSink));
+    sink->fd = fd;
+    sink->back = malloc(bufsize);
+    sink->pending = 0;
+    sink->stopping = false;
+    sink->failed = false;
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->wake, NULL);
+    pthread_cond_init(&sink->done, NULL);
+    pthread_create(&sink->writer, NULL, _StrSink_writer, sink);
+    sb->sink = sink;
+    return sb;
 }
 
-Set *Set_intersection(Set *set1, Set *set2)
-{
-    Set *set = Set_copy(set1);
-    Set_intersect_inplace(set, set2);
-    return set;
+bool StrBuilder_flush(StrBuilder *sb)
+{
+    StrSink *sink = sb->sink;
+    assert(sink != NULL);
+    _StrSink_handoff(sb);
+    pthread_mutex_lock(&sink->lock);
+    while (sink->pending > 0)
+        pthread_cond_wait(&sink->done, &sink->lock);
+    bool failed = sink->failed;
+    pthread_mutex_unlock(&sink->lock);
+    return !failed;
+}
+
+bool StrBuilder_close(StrBuilder *sb)
+{
+    StrSink *sink = sb->sink;
+    bool ok = StrBuilder_flush(sb);
+    pthread_mutex_lock(&sink->lock);
+    sink->stopping = true;
+    pthread_cond_signal(&sink->wake);
+    pthread_mutex_unlock(&sink->lock);
+    pthread_join(sink->writer, NULL);
+    pthread_cond_destroy(&sink->done);
+    pthread_cond_destroy(&sink->wake);
+    pthread_mutex_destroy(&sink->lock);
+    free(sink->back);
+    free(sink);
+    free(sb->s);
+    free(sb);
+    return ok;
 }
 
-Set *Set_union(Set *set1, Set *set2)
+void StrBuilder_print(StrBuilder *sb)
 {
-    Set *set = Set_copy(set1);
-    Set_union_inplace(set, set2);
-    return set;
+    if (sb->slices == NULL)
+    {
+        fwrite(sb->s, 1, sb->size, stdout);
+        return;
+    }
+    uint i;
+    for (i = 0; i < sb->nslices; i++)
+        fwrite(sb->slices[i].data, 1, sb->slices[i].size, stdout);
 }
 
-Set *Set_difference(Set *set1, Set *set2)
+// Formatted appends write straight into the builder. Integers go two digits
+// at a time and doubles use Grisu3, which finds the shortest digits that read
+// back as the same double for all but a few rare ones. Those take Grisu2's
+// digits, which read back but may be a digit long, and check with strtod()
+// whether shorter ones would do. Those come out shortest too, if not always
+// the nearest to the double of that length.
+
+static const char _StrBuilder_digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const uint64_t _StrBuilder_pow10[20] =
 {
-    Set *set = Set_copy(set1);
-    Set_difference_inplace(set, set2);
-    return set;
-}
+    1UL, 10UL, 100UL, 1000UL, 10000UL, 100000UL, 1000000UL, 10000000UL,
+    100000000UL, 1000000000UL, 10000000000UL, 100000000000UL,
+    1000000000000UL, 10000000000000UL, 100000000000000UL,
+    1000000000000000UL, 10000000000000000UL, 100000000000000000UL,
+    1000000000000000000UL, 10000000000000000000UL
+};
 
-Set *Set_symdifference(Set *set1, Set *set2)
+static uint _StrBuilder_count_digits(uint64_t v)
 {
-    Set *set = Set_copy(set1);
-    Set_symdifference_inplace(set, set2);
-    return set;
+    v |= 1; // counts 0 as one digit without changing any other count
+    uint t = (64 - __builtin_clzl(v)) * 1233 >> 12; // about log10(2)
+    return t - (v < _StrBuilder_pow10[t]) + 1;
 }
 
-Set *Set_copy(Set *set)
+// Writes the digits of v ending just before end
+static void _StrBuilder_write_digits(char *end, uint64_t v)
 {
-    Set *new = malloc(sizeof(Set));
-    new->hash = set->hash;
-    new->comp = set->comp;
-    new->indexA = set->indexA;
-    new->sizeA = set->sizeA;
-    new->sizeB = set->sizeB;
-    new->log2capA = set->log2capA;
-    new->log2capB = set->log2capB;
-    uint tableAsize = sizeof(SetBucket) * pow2(new->log2capA);
-    uint tableBsize = sizeof(SetBucket) * pow2(new->log2capB)
-    new->tableA = malloc(tableAsize);
-    new->tableB = malloc(tableBsize);
-    memcpy(new->tableA, set->tableA, tableAsize);
-    memcpy(new->tableB, set->tableB, tableBsize);
-    /// now we need to iterate through the tables and copy the chains
-    todo
+    while (v >= 100)
+    {
+        end -= 2;
+        memcpy(end, &_StrBuilder_digit_pairs[(v % 100) * 2], 2);
+        v /= 100;
+    }
+    if (v >= 10)
+        memcpy(end - 2, &_StrBuilder_digit_pairs[v * 2], 2);
+    else
+        end[-1] = '0' + v;
 }
 
-void Set_test()
+void StrBuilder_append_uint(StrBuilder *sb, uint v)
 {
-    Set *set = Set_new();
-    uint i;
-    // Add all integers from 1 to 50
-    for (i = 1; i <= 50; i++)
-        Set_add(set, (void*)i);
-    // Add all integers from 25 to 75
-    for (i = 25; i <= 75; i++)
-        Set_add(set, (void*)i);
-    // Make sure there are exactly 75 integers in the set
-    CU_ASSERT(set->sizeA + set->sizeB == 75);
+    uint n = _StrBuilder_count_digits(v);
+    char *out = _StrBuilder_reserve(sb, n);
+    _StrBuilder_write_digits(out + n, v);
+    _StrBuilder_commit(sb, n);
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// StrBuilder
-// Useful for building lengths of string
-////////////////////////////////////////////////////////////////////////////////
+void StrBuilder_append_int(StrBuilder *sb, long v)
+{
+    // Negate as unsigned so LONG_MIN doesn't overflow
+    uint magnitude = v < 0 ? -(uint)v : (uint)v;
+    uint n = _StrBuilder_count_digits(magnitude) + (v < 0);
+    char *out = _StrBuilder_reserve(sb, n);
+    out[0] = '-';
+    _StrBuilder_write_digits(out + n, magnitude);
+    _StrBuilder_commit(sb, n);
+}
 
-uint _StrBuilder_nextsize(uint size)
+void StrBuilder_append_hex(StrBuilder *sb, uint v)
 {
-    return size + (size >> 1);
+    uint n = (64 - __builtin_clzl(v | 1) + 3) / 4;
+    char *out = _StrBuilder_reserve(sb, n);
+    uint i;
+    for (i = n; i > 0; i--, v >>= 4)
+        out[i - 1] = "0123456789abcdef"[v & 0xf];
+    _StrBuilder_commit(sb, n);
+}
+
+// A double as f * 2^e with a full 64 bit significand
+typedef struct
+{
+    uint64_t f;
+    int e;
+} _DiyFp;
+
+// Normalized powers 10^-348, 10^-340, ..., 10^340
+static const _DiyFp _StrBuilder_cached_powers[87] =
+{
+    {0xfa8fd5a0081c0288, -1220},
+    {0xbaaee17fa23ebf76, -1193},
+    {0x8b16fb203055ac76, -1166},
+    {0xcf42894a5dce35ea, -1140},
+    {0x9a6bb0aa55653b2d, -1113},
+    {0xe61acf033d1a45df, -1087},
+    {0xab70fe17c79ac6ca, -1060},
+    {0xff77b1fcbebcdc4f, -1034},
+    {0xbe5691ef416bd60c, -1007},
+    {0x8dd01fad907ffc3c, -980},
+    {0xd3515c2831559a83, -954},
+    {0x9d71ac8fada6c9b5, -927},
+    {0xea9c227723ee8bcb, -901},
+    {0xaecc49914078536d, -874},
+    {0x823c12795db6ce57, -847},
+    {0xc21094364dfb5637, -821},
+    {0x9096ea6f3848984f, -794},
+    {0xd77485cb25823ac7, -768},
+    {0xa086cfcd97bf97f4, -741},
+    {0xef340a98172aace5, -715},
+    {0xb23867fb2a35b28e, -688},
+    {0x84c8d4dfd2c63f3b, -661},
+    {0xc5dd44271ad3cdba, -635},
+    {0x936b9fcebb25c996, -608},
+    {0xdbac6c247d62a584, -582},
+    {0xa3ab66580d5fdaf6, -555},
+    {0xf3e2f893dec3f126, -529},
+    {0xb5b5ada8aaff80b8, -502},
+    {0x87625f056c7c4a8b, -475},
+    {0xc9bcff6034c13053, -449},
+    {0x964e858c91ba2655, -422},
+    {0xdff9772470297ebd, -396},
+    {0xa6dfbd9fb8e5b88f, -369},
+    {0xf8a95fcf88747d94, -343},
+    {0xb94470938fa89bcf, -316},
+    {0x8a08f0f8bf0f156b, -289},
+    {0xcdb02555653131b6, -263},
+    {0x993fe2c6d07b7fac, -236},
+    {0xe45c10c42a2b3b06, -210},
+    {0xaa242499697392d3, -183},
+    {0xfd87b5f28300ca0e, -157},
+    {0xbce5086492111aeb, -130},
+    {0x8cbccc096f5088cc, -103},
+    {0xd1b71758e219652c, -77},
+    {0x9c40000000000000, -50},
+    {0xe8d4a51000000000, -24},
+    {0xad78ebc5ac620000, 3},
+    {0x813f3978f8940984, 30},
+    {0xc097ce7bc90715b3, 56},
+    {0x8f7e32ce7bea5c70, 83},
+    {0xd5d238a4abe98068, 109},
+    {0x9f4f2726179a2245, 136},
+    {0xed63a231d4c4fb27, 162},
+    {0xb0de65388cc8ada8, 189},
+    {0x83c7088e1aab65db, 216},
+    {0xc45d1df942711d9a, 242},
+    {0x924d692ca61be758, 269},
+    {0xda01ee641a708dea, 295},
+    {0xa26da3999aef774a, 322},
+    {0xf209787bb47d6b85, 348},
+    {0xb454e4a179dd1877, 375},
+    {0x865b86925b9bc5c2, 402},
+    {0xc83553c5c8965d3d, 428},
+    {0x952ab45cfa97a0b3, 455},
+    {0xde469fbd99a05fe3, 481},
+    {0xa59bc234db398c25, 508},
+    {0xf6c69a72a3989f5c, 534},
+    {0xb7dcbf5354e9bece, 561},
+    {0x88fcf317f22241e2, 588},
+    {0xcc20ce9bd35c78a5, 614},
+    {0x98165af37b2153df, 641},
+    {0xe2a0b5dc971f303a, 667},
+    {0xa8d9d1535ce3b396, 694},
+    {0xfb9b7cd9a4a7443c, 720},
+    {0xbb764c4ca7a44410, 747},
+    {0x8bab8eefb6409c1a, 774},
+    {0xd01fef10a657842c, 800},
+    {0x9b10a4e5e9913129, 827},
+    {0xe7109bfba19c0c9d, 853},
+    {0xac2820d9623bf429, 880},
+    {0x80444b5e7aa7cf85, 907},
+    {0xbf21e44003acdd2d, 933},
+    {0x8e679c2f5e44ff8f, 960},
+    {0xd433179d9c8cb841, 986},
+    {0x9e19db92b4e31ba9, 1013},
+    {0xeb96bf6ebadf77d9, 1039},
+    {0xaf87023b9bf0ee6b, 1066},
+};
+
+static _DiyFp _DiyFp_mul(_DiyFp a, _DiyFp b)
+{
+    // The high half of the 128 bit product, rounded
+    unsigned __int128 p = (unsigned __int128)a.f * b.f;
+    _DiyFp r = {(uint64_t)(p >> 64) + (((uint64_t)p >> 63) & 1), a.e + b.e + 64};
+    return r;
+}
+
+static _DiyFp _DiyFp_normalize(_DiyFp x)
+{
+    int shift = __builtin_clzl(x.f);
+    x.f <<= shift;
+    x.e -= shift;
+    return x;
+}
+
+// Nudges the last digit down while that brings it closer to the real value
+// and stays inside the rounding interval
+static void _StrBuilder_grisu_round(char *digits, uint len, uint64_t delta,
+                                    uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w))
+    {
+        digits[len - 1]--;
+        rest += ten_kappa;
+    }
 }
 
-StrBuilder *StrBuilder_new(char *initial)
+// Scales w and the halfway points to its neighbouring doubles, minus and plus,
+// by a cached power of ten that lands their exponent in [-60, -32], and
+// returns the power's negated exponent
+static int _StrBuilder_grisu_scale(double v, _DiyFp *w, _DiyFp *minus, _DiyFp *plus)
 {
-    StrBuilder *sb = malloc(sizeof(StrBuilder));
-    if (initial == NULL)
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    uint64_t hidden = 1UL << 52;
+    int biased = bits >> 52;
+    _DiyFp x = {bits & (hidden - 1), -1074};
+    if (biased != 0)
     {
-        sb->size = 0;
-        sb->cap = 8;
+        x.f += hidden;
+        x.e = biased - 1075;
     }
-    else
+    _DiyFp p = {(x.f << 1) + 1, x.e - 1}, m = {(x.f << 1) - 1, x.e - 1};
+    if (x.f == hidden)
     {
-        sb->size = strlen(initial);
-        sb->cap = _StrBuilder_nextsize(sb->size);
+        // The neighbour below is only half as far away
+        m.f = (x.f << 2) - 1;
+        m.e = x.e - 2;
+    }
+    p = _DiyFp_normalize(p);
+    m.f <<= m.e - p.e;
+    m.e = p.e;
+    x = _DiyFp_normalize(x);
+    double dk = (-61 - p.e) * 0.30102999566398114 + 347;
+    int k = (int)dk;
+    if (dk - k > 0.0)
+        k++;
+    uint index = (k >> 3) + 1;
+    _DiyFp c = _StrBuilder_cached_powers[index];
+    *w = _DiyFp_mul(x, c);
+    *plus = _DiyFp_mul(p, c);
+    *minus = _DiyFp_mul(m, c);
+    return 348 - (int)(index << 3);
+}
+
+// Writes the significant digits of positive finite v and returns how many,
+// with v ~ digits * 10^*exp10. They always read back as v but may be a digit
+// longer than needed
+static uint _StrBuilder_grisu2(double v, char *digits, int *exp10)
+{
+    _DiyFp w, minus, plus;
+    *exp10 = _StrBuilder_grisu_scale(v, &w, &minus, &plus);
+    plus.f--;
+    minus.f++;
+    // Generate digits until they pin down a value inside (minus, plus)
+    uint64_t delta = plus.f - minus.f, wp_w = plus.f - w.f;
+    int shift = -plus.e;
+    uint64_t one = 1UL << shift;
+    uint32_t p1 = plus.f >> shift;
+    uint64_t p2 = plus.f & (one - 1);
+    int kappa = _StrBuilder_count_digits(p1);
+    uint len = 0;
+    while (kappa > 0)
+    {
+        uint32_t d = p1 / _StrBuilder_pow10[kappa - 1];
+        p1 %= _StrBuilder_pow10[kappa - 1];
+        if (d != 0 || len != 0)
+            digits[len++] = '0' + d;
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << shift) + p2;
+        if (rest <= delta)
+        {
+            *exp10 += kappa;
+            _StrBuilder_grisu_round(digits, len, delta, rest,
+                                    _StrBuilder_pow10[kappa] << shift, wp_w);
+            return len;
+        }
+    }
+    while (true)
+    {
+        p2 *= 10;
+        delta *= 10;
+        char d = p2 >> shift;
+        if (d != 0 || len != 0)
+            digits[len++] = '0' + d;
+        p2 &= one - 1;
+        kappa--;
+        if (p2 < delta)
+        {
+            *exp10 += kappa;
+            _StrBuilder_grisu_round(digits, len, delta, p2, one,
+                                    -kappa < 9 ? wp_w * _StrBuilder_pow10[-kappa] : 0);
+            return len;
+        }
     }
-    sb->s = malloc(sizeof(char) * sb->cap);
-    if (initial != NULL)
-        memcpy(sb->s, initial, sb->size);
-    return sb;
 }
 
-void StrBuilder_del(StrBuilder *sb)
+// Like _StrBuilder_grisu_round() but on an interval widened by unit, the
+// most the scaled values can be off by. Fails when that error leaves the
+// closest digits or whether they are inside the interval in doubt
+static bool _StrBuilder_grisu3_round(char *digits, uint len, uint64_t delta, uint64_t rest,
+                                     uint64_t ten_kappa, uint64_t wp_w, uint64_t unit)
 {
-    free(sb->s);
-    free(sb);
+    uint64_t small = wp_w - unit, big = wp_w + unit;
+    while (rest < small && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < small || small - rest >= rest + ten_kappa - small))
+    {
+        digits[len - 1]--;
+        rest += ten_kappa;
+    }
+    if (rest < big && delta - rest >= ten_kappa &&
+        (rest + ten_kappa < big || big - rest > rest + ten_kappa - big))
+        return false;
+    return 2 * unit <= rest && rest <= delta - 4 * unit;
+}
+
+// As _StrBuilder_grisu2() but the digits are the shortest that read back as
+// v, or returns 0 for the few doubles where it can't be sure of that
+static uint _StrBuilder_grisu3(double v, char *digits, int *exp10)
+{
+    _DiyFp w, minus, plus;
+    *exp10 = _StrBuilder_grisu_scale(v, &w, &minus, &plus);
+    uint64_t unit = 1;
+    plus.f += unit;
+    minus.f -= unit;
+    uint64_t delta = plus.f - minus.f, wp_w = plus.f - w.f;
+    int shift = -plus.e;
+    uint64_t one = 1UL << shift;
+    uint32_t p1 = plus.f >> shift;
+    uint64_t p2 = plus.f & (one - 1);
+    int kappa = _StrBuilder_count_digits(p1);
+    uint len = 0;
+    while (kappa > 0)
+    {
+        uint32_t d = p1 / _StrBuilder_pow10[kappa - 1];
+        p1 %= _StrBuilder_pow10[kappa - 1];
+        digits[len++] = '0' + d;
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << shift) + p2;
+        if (rest < delta)
+        {
+            *exp10 += kappa;
+            return _StrBuilder_grisu3_round(digits, len, delta, rest,
+                                            _StrBuilder_pow10[kappa] << shift, wp_w, unit) ? len : 0;
+        }
+    }
+    while (true)
+    {
+        p2 *= 10;
+        unit *= 10;
+        delta *= 10;
+        digits[len++] = '0' + (p2 >> shift);
+        p2 &= one - 1;
+        kappa--;
+        if (p2 < delta)
+        {
+            *exp10 += kappa;
+            return _StrBuilder_grisu3_round(digits, len, delta, p2, one,
+                                            wp_w * unit, unit) ? len : 0;
+        }
+    }
 }
 
-void StrBuilder_appendN(StrBuilder *sb, char *s, uint len)
-{
-    uint size = sb->size;
-    sb->size += len;
-    if (sb->size > sb->cap)
+// Whether digits * 10^exp10 reads back as v. There's no decimal point for the
+// locale to get in the way of
+static bool _StrBuilder_reads_back(double v, char *digits, uint len, int exp10)
+{
+    char buf[32], *out = buf + len;
+    memcpy(buf, digits, len);
+    *out++ = 'e';
+    if (exp10 < 0)
+        *out++ = '-';
+    uint e = exp10 < 0 ? -exp10 : exp10;
+    out += _StrBuilder_count_digits(e);
+    _StrBuilder_write_digits(out, e);
+    *out = '\0';
+    return strtod(buf, NULL) == v;
+}
+
+// Drops digits that reading back shows aren't needed. A shorter number that
+// reads back as v is inside v's rounding interval, as are the digits, so the
+// nearest ones of that length either side of the digits are too
+static uint _StrBuilder_shorten(double v, char *digits, uint len, int *exp10)
+{
+    char g[24], up[24];
+    memcpy(g, digits, len);
+    int exp = *exp10;
+    uint best = len;
+    for (uint n = len - 1; n > 0; n--)
     {
-        sb->cap = _StrBuilder_nextsize(sb->size);
-        sb->s = realloc(sb->s, sb->cap);
+        int down_exp = exp + (int)(len - n);
+        // Rounding up carries past any trailing 9s, and past them all to 1
+        uint i = n;
+        while (i > 0 && g[i - 1] == '9')
+            i--;
+        uint up_len = i > 0 ? i : 1;
+        int up_exp = down_exp + (int)(n - i);
+        memcpy(up, g, i);
+        up[up_len - 1] = i > 0 ? g[i - 1] + 1 : '1';
+        bool down_ok = _StrBuilder_reads_back(v, g, n, down_exp);
+        bool up_ok = _StrBuilder_reads_back(v, up, up_len, up_exp);
+        if (!down_ok && !up_ok)
+            break;
+        // When both do, take the one nearer the dropped digits
+        bool past_half = g[n] > '5';
+        for (uint j = n + 1; g[n] == '5' && j < len; j++)
+            past_half |= g[j] != '0';
+        if (up_ok && (!down_ok || past_half))
+        {
+            memcpy(digits, up, up_len);
+            best = up_len;
+            *exp10 = up_exp;
+        }
+        else
+        {
+            memcpy(digits, g, n);
+            best = n;
+            *exp10 = down_exp;
+        }
     }
-    memcpy(sb->s + size, s, len);
+    return best;
 }
 
-void StrBuilder_append(StrBuilder *sb, char *s)
+// Plain notation for exponents of ten in [-6, 21), like JavaScript, and
+// otherwise d.ddde+X
+void StrBuilder_append_double(StrBuilder *sb, double v)
 {
-    uint len = strlen(s);
-    StrBuilder_appendN(sb, s, len);
+    if (v != v)
+    {
+        StrBuilder_appendN(sb, "nan", 3);
+        return;
+    }
+    char *out = _StrBuilder_reserve(sb, 32), *start = out;
+    if (signbit(v))
+    {
+        *out++ = '-';
+        v = -v;
+    }
+    if (v == 0)
+        *out++ = '0';
+    else if (isinf(v))
+    {
+        memcpy(out, "inf", 3);
+        out += 3;
+    }
+    else
+    {
+        char digits[24];
+        int exp10;
+        int len = _StrBuilder_grisu3(v, digits, &exp10);
+        if (len == 0)
+            len = _StrBuilder_shorten(v, digits, _StrBuilder_grisu2(v, digits, &exp10), &exp10);
+        while (digits[len - 1] == '0')
+        {
+            len--;
+            exp10++;
+        }
+        int point = len + exp10; // where the decimal point falls in the digits
+        if (exp10 >= 0 && point <= 21)
+        {
+            memcpy(out, digits, len);
+            memset(out + len, '0', exp10);
+            out += point;
+        }
+        else if (point > 0 && point <= 21)
+        {
+            memcpy(out, digits, point);
+            out[point] = '.';
+            memcpy(out + point + 1, digits + point, len - point);
+            out += len + 1;
+        }
+        else if (point > -6 && point <= 0)
+        {
+            memcpy(out, "0.", 2);
+            memset(out + 2, '0', -point);
+            memcpy(out + 2 - point, digits, len);
+            out += 2 - point + len;
+        }
+        else
+        {
+            *out++ = digits[0];
+            if (len > 1)
+            {
+                *out++ = '.';
+                memcpy(out, digits + 1, len - 1);
+                out += len - 1;
+            }
+            *out++ = 'e';
+            *out++ = point > 0 ? '+' : '-';
+            uint e = point > 0 ? point - 1 : 1 - point;
+            uint n = _StrBuilder_count_digits(e);
+            _StrBuilder_write_digits(out + n, e);
+            out += n;
+        }
+    }
+    _StrBuilder_commit(sb, out - start);
 }
 
-void StrBuilder_appendC(StrBuilder *sb, char c)
+void StrBuilder_appendf(StrBuilder *sb, char *format, ...)
 {
-    StrBuilder_appendN(sb, &c, 1);
+    va_list args;
+    va_start(args, format);
+    char *run = format, *p = format;
+    while (*p != '\0')
+    {
+        if (*p++ != '%')
+            continue;
+        StrBuilder_appendN(sb, run, p - 1 - run);
+        bool l = *p == 'l';
+        p += l;
+        switch (*p)
+        {
+            case 'd':
+            case 'i':
+                StrBuilder_append_int(sb, l ? va_arg(args, long) : va_arg(args, int));
+                break;
+            case 'u':
+                StrBuilder_append_uint(sb, l ? va_arg(args, unsigned long) : va_arg(args, unsigned));
+                break;
+            case 'x':
+                StrBuilder_append_hex(sb, l ? va_arg(args, unsigned long) : va_arg(args, unsigned));
+                break;
+            case 'g': StrBuilder_append_double(sb, va_arg(args, double)); break;
+            case 's': StrBuilder_append(sb, va_arg(args, char*)); break;
+            case 'c': StrBuilder_appendC(sb, va_arg(args, int)); break;
+            case '%': StrBuilder_appendC(sb, '%'); break;
+            default: assert(false); break;
+        }
+        if (*p != '\0')
+            p++;
+        run = p;
+    }
+    StrBuilder_appendN(sb, run, p - run);
+    va_end(args);
 }
 
-void StrBuilder_join(StrBuilder *sb1, StrBuilder *sb2)
+// Length of the run before the first byte of s that is a or b, or a control
+// character if control is set. Checks 32 or 16 bytes at a time where the CPU
+// allows.
+static uint _StrBuilder_scan(char *s, uint len, char a, char b, bool control)
 {
-    StrBuilder_appendN(sb1, sb2->s, sb2->size);
+    uint i = 0;
+#if defined(__AVX2__)
+    __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+    __m256i limit = _mm256_set1_epi8(0x1f), ctl = _mm256_set1_epi8(control ? -1 : 0);
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((__m256i*)(s + i));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb));
+        // v <= 0x1f as unsigned bytes
+        __m256i low = _mm256_cmpeq_epi8(_mm256_min_epu8(v, limit), v);
+        hit = _mm256_or_si256(hit, _mm256_and_si256(low, ctl));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hit);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    __m128i limit = _mm_set1_epi8(0x1f), ctl = _mm_set1_epi8(control ? -1 : 0);
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((__m128i*)(s + i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb));
+        __m128i low = _mm_cmpeq_epi8(_mm_min_epu8(v, limit), v);
+        hit = _mm_or_si128(hit, _mm_and_si128(low, ctl));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(hit);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < len; i++)
+    {
+        unsigned char c = s[i];
+        if (c == (unsigned char)a || c == (unsigned char)b || (control && c < 0x20))
+            break;
+    }
+    return i;
 }
 
-char *StrBuilder_tostring(StrBuilder *sb)
+void StrBuilder_append_json_escaped(StrBuilder *sb, char *s, uint len)
 {
-    StrBuilder_appendN(sb, "\0", 1);
-    char *s = sb->s;
-    free(sb);
-    return s;
+    while (true)
+    {
+        uint run = _StrBuilder_scan(s, len, '"', '\\', true);
+        StrBuilder_appendN(sb, s, run);
+        if (run == len)
+            break;
+        unsigned char c = s[run];
+        char *out = _StrBuilder_reserve(sb, 6);
+        uint n = 2;
+        out[0] = '\\';
+        switch (c)
+        {
+            case '"': out[1] = '"'; break;
+            case '\\': out[1] = '\\'; break;
+            case '\b': out[1] = 'b'; break;
+            case '\f': out[1] = 'f'; break;
+            case '\n': out[1] = 'n'; break;
+            case '\r': out[1] = 'r'; break;
+            case '\t': out[1] = 't'; break;
+            default:
+                memcpy(out + 1, "u00", 3);
+                out[4] = "0123456789abcdef"[c >> 4];
+                out[5] = "0123456789abcdef"[c & 0xf];
+                n = 6;
+                break;
+        }
+        _StrBuilder_commit(sb, n);
+        s += run + 1;
+        len -= run + 1;
+    }
 }
 
-void StrBuilder_print(StrBuilder *sb)
+void StrBuilder_append_csv_field(StrBuilder *sb, char *s, uint len)
 {
-    uint i;
-    for (i = 0; i < sb->size; i++)
-        printf("%c", sb->s[i]);
+    uint run = _StrBuilder_scan(s, len, ',', '"', true);
+    if (run == len)
+    {
+        StrBuilder_appendN(sb, s, len);
+        return;
+    }
+    // Quote the field and double the quotes inside, none of which come
+    // before run
+    StrBuilder_appendC(sb, '"');
+    StrBuilder_appendN(sb, s, run);
+    s += run;
+    len -= run;
+    while (true)
+    {
+        run = _StrBuilder_scan(s, len, '"', '"', false);
+        StrBuilder_appendN(sb, s, run);
+        if (run == len)
+            break;
+        StrBuilder_appendN(sb, "\"\"", 2);
+        s += run + 1;
+        len -= run + 1;
+    }
+    StrBuilder_appendC(sb, '"');
 }
 
 void StrBuilder_test()
@@ -1547,6 +7447,174 @@ void StrBuilder_test()
     StrBuilder_append(sb, "test2\0");
     StrBuilder_append(sb, "test3");
     CU_ASSERT(strcmp(StrBuilder_tostring(sb), "test1test2test3") == 0);
+    // Chunked builders span blocks and borrow long strings
+    sb = StrBuilder_new_chunked();
+    char borrowed[STRBUILDER_BORROW];
+    memset(borrowed, 'b', sizeof(borrowed));
+    uint i;
+    for (i = 0; i < STRBUILDER_BLOCK / 4; i++)
+        StrBuilder_append(sb, "abcde");
+    StrBuilder_append_borrowed(sb, borrowed, sizeof(borrowed));
+    StrBuilder_append(sb, "end");
+    CU_ASSERT(sb->size == 5 * (STRBUILDER_BLOCK / 4) + STRBUILDER_BORROW + 3);
+    CU_ASSERT(sb->nslices == 4 && sb->slices[2].borrowed);
+    StrBuilder *copy = StrBuilder_new(NULL);
+    StrBuilder_join(copy, sb);
+    char *s = StrBuilder_tostring(sb);
+    CU_ASSERT(strlen(s) == copy->size && memcmp(s, copy->s, copy->size) == 0);
+    CU_ASSERT(strncmp(s + 5 * (STRBUILDER_BLOCK / 4) - 2, "debbb", 5) == 0);
+    CU_ASSERT(strcmp(s + copy->size - 4, "bend") == 0);
+    free(s);
+    StrBuilder_del(copy);
+    // Test writev() through a pipe
+    int fds[2];
+    CU_ASSERT(pipe(fds) == 0);
+    sb = StrBuilder_new_chunked();
+    StrBuilder_append(sb, "head ");
+    memset(borrowed, 'x', sizeof(borrowed));
+    StrBuilder_append_borrowed(sb, borrowed, sizeof(borrowed));
+    StrBuilder_append(sb, " tail");
+    CU_ASSERT(StrBuilder_writev(sb, fds[1]) && sb->size == 0);
+    StrBuilder_append(sb, "!");
+    CU_ASSERT(StrBuilder_writev(sb, fds[1]));
+    char out[STRBUILDER_BORROW + 11];
+    CU_ASSERT(read(fds[0], out, sizeof(out)) == (ssize_t)sizeof(out));
+    CU_ASSERT(memcmp(out, "head x", 6) == 0);
+    CU_ASSERT(memcmp(out + sizeof(out) - 7, "x tail!", 7) == 0);
+    close(fds[0]);
+    close(fds[1]);
+    StrBuilder_del(sb);
+    // Test formatted appends
+    sb = StrBuilder_new(NULL);
+    StrBuilder_append_int(sb, 0);
+    StrBuilder_appendC(sb, ' ');
+    StrBuilder_append_int(sb, -9223372036854775807L - 1);
+    StrBuilder_appendC(sb, ' ');
+    StrBuilder_append_uint(sb, 18446744073709551615UL);
+    StrBuilder_appendC(sb, ' ');
+    StrBuilder_append_hex(sb, 0xbeef);
+    CU_ASSERT(sb->size == 48);
+    CU_ASSERT(memcmp(sb->s, "0 -9223372036854775808 18446744073709551615 beef", 48) == 0);
+    StrBuilder_del(sb);
+    // The last two are a digit longer with Grisu2 alone
+    double doubles[] = {0.1, -1.5, 100, 1e21, 1.25e-7, 0.000001, 5e-324,
+                        1.7976931348623157e308, 123456.789, -0.0,
+                        338962.879277, 30892612233637950.0};
+    char *expected = "0.1 -1.5 100 1e+21 1.25e-7 0.000001 5e-324 "
+                     "1.7976931348623157e+308 123456.789 -0 "
+                     "338962.879277 30892612233637950";
+    sb = StrBuilder_new_chunked();
+    for (i = 0; i < sizeof(doubles) / sizeof(double); i++)
+    {
+        if (i > 0)
+            StrBuilder_appendC(sb, ' ');
+        StrBuilder_append_double(sb, doubles[i]);
+    }
+    s = StrBuilder_tostring(sb);
+    CU_ASSERT(strcmp(s, expected) == 0);
+    free(s);
+    // Every double reads back the same
+    for (i = 0; i < 1000; i++)
+    {
+        uint64_t bits = ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ rand();
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        if (isnan(d) || isinf(d))
+            continue;
+        sb = StrBuilder_new(NULL);
+        StrBuilder_append_double(sb, d);
+        s = StrBuilder_tostring(sb);
+        CU_ASSERT(strtod(s, NULL) == d);
+        free(s);
+    }
+    sb = StrBuilder_new(NULL);
+    StrBuilder_appendf(sb, "%s=%d %lu%% 0x%x %c %g", "key", -42, 99UL, 255, '!', 2.5);
+    s = StrBuilder_tostring(sb);
+    CU_ASSERT(strcmp(s, "key=-42 99% 0xff ! 2.5") == 0);
+    free(s);
+    // Builders on the stack stay in their small buffer until they spill
+    StrBuilder local;
+    StrBuilder_init(&local);
+    StrBuilder_append(&local, "small");
+    CU_ASSERT(local.s == local.small);
+    CU_ASSERT(strcmp(StrBuilder_cstr(&local), "small") == 0);
+    for (i = 0; i < STRBUILDER_SMALL; i++)
+        StrBuilder_appendC(&local, 'a' + i % 26);
+    CU_ASSERT(local.s != local.small && local.size == STRBUILDER_SMALL + 5);
+    CU_ASSERT(strncmp(StrBuilder_cstr(&local), "smallabc", 8) == 0);
+    StrBuilder_release(&local);
+    // Arena builders share blocks and outlive themselves until a reset
+    StrArena *arena = StrArena_new(256);
+    StrBuilder first, second;
+    StrBuilder_init_arena(&first, arena);
+    StrBuilder_append(&first, "grown in place");
+    char *start = first.s;
+    StrBuilder_append(&first, " by the arena");
+    CU_ASSERT(first.s == start);
+    StrBuilder_init_arena(&second, arena);
+    StrBuilder_append_int(&second, 12345);
+    StrBuilder_append(&first, ", then moved elsewhere");
+    CU_ASSERT(first.s != start);
+    char *firsts = StrBuilder_cstr(&first), *seconds = StrBuilder_cstr(&second);
+    for (i = 0; i < 100; i++)
+        StrBuilder_append(&second, "0123456789"); // beyond one block
+    CU_ASSERT(second.size == 1005 && strncmp(second.s, "123450123", 9) == 0);
+    CU_ASSERT(strcmp(firsts, "grown in place by the arena, then moved elsewhere") == 0);
+    CU_ASSERT(strncmp(seconds, "12345", 5) == 0);
+    StrArena_reset(arena);
+    CU_ASSERT(arena->top == arena->blocks + sizeof(char*));
+    StrArena_del(arena);
+    // Sink builders stream through two small buffers
+    CU_ASSERT(pipe(fds) == 0);
+    sb = StrBuilder_new_sink(fds[1], 64);
+    for (i = 0; i < 1000; i++)
+        StrBuilder_appendf(sb, "%lu,", i % 10);
+    StrBuilder_append_borrowed(sb, borrowed, sizeof(borrowed));
+    CU_ASSERT(sb->cap == 64);
+    CU_ASSERT(StrBuilder_flush(sb) && sb->size == 0);
+    StrBuilder_append(sb, "!");
+    CU_ASSERT(StrBuilder_close(sb));
+    char streamed[2000 + STRBUILDER_BORROW + 1];
+    uint got = 0;
+    while (got < sizeof(streamed))
+    {
+        ssize_t n = read(fds[0], streamed + got, sizeof(streamed) - got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    CU_ASSERT(got == sizeof(streamed));
+    CU_ASSERT(memcmp(streamed, "0,1,2,3,4,5,6,7,8,9,0,", 22) == 0);
+    CU_ASSERT(memcmp(streamed + 1994, "7,8,9,xxx", 9) == 0);
+    CU_ASSERT(streamed[sizeof(streamed) - 1] == '!');
+    close(fds[0]);
+    close(fds[1]);
+    // Failed writes are reported, and tiny buffers still fit any number
+    sb = StrBuilder_new_sink(-1, 16);
+    CU_ASSERT(sb->cap == STRBUILDER_SINK_MIN);
+    StrBuilder_append_uint(sb, 18446744073709551615UL);
+    StrBuilder_append_double(sb, -1.7976931348623157e308);
+    StrBuilder_append(sb, "lost");
+    CU_ASSERT(!StrBuilder_flush(sb));
+    CU_ASSERT(!StrBuilder_close(sb));
+    // Test escaping, with the special bytes past a vector's worth of clean ones
+    char *raw = "a clean run long enough to fill a vector \"quoted\" \\ \t\n\x01 ok";
+    sb = StrBuilder_new(NULL);
+    StrBuilder_append_json_escaped(sb, raw, strlen(raw));
+    s = StrBuilder_tostring(sb);
+    CU_ASSERT(strcmp(s, "a clean run long enough to fill a vector "
+                        "\\\"quoted\\\" \\\\ \\t\\n\\u0001 ok") == 0);
+    free(s);
+    sb = StrBuilder_new(NULL);
+    StrBuilder_append_csv_field(sb, "plain", 5);
+    StrBuilder_appendC(sb, ',');
+    StrBuilder_append_csv_field(sb, "a,b", 3);
+    StrBuilder_appendC(sb, ',');
+    StrBuilder_append_csv_field(sb, raw, strlen(raw));
+    s = StrBuilder_tostring(sb);
+    CU_ASSERT(strcmp(s, "plain,\"a,b\",\"a clean run long enough to fill a vector "
+                        "\"\"quoted\"\" \\ \t\n\x01 ok\"") == 0);
+    free(s);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -2199,13 +8267,24 @@ int main()
 
     /* add the tests to the suite */
     if ((NULL == CU_add_test(pSuite, "test of LinkedList", LinkedList_test)) ||
+        (NULL == CU_add_test(pSuite, "test of IntrusiveList", IntrusiveList_test)) ||
+        (NULL == CU_add_test(pSuite, "test of UnrolledList", UnrolledList_test)) ||
+        (NULL == CU_add_test(pSuite, "test of BTreeList", BTreeList_test)) ||
+        (NULL == CU_add_test(pSuite, "test of PVector", PVector_test)) ||
+        (NULL == CU_add_test(pSuite, "test of Queue", Queue_test)) ||
         (NULL == CU_add_test(pSuite, "test of ArrayList", ArrayList_test)) ||
+        (NULL == CU_add_test(pSuite, "test of Vec", Vec_test)) ||
+        (NULL == CU_add_test(pSuite, "test of ArrayDeque", ArrayDeque_test)) ||
+        (NULL == CU_add_test(pSuite, "test of SlotMap", SlotMap_test)) ||
         (NULL == CU_add_test(pSuite, "test of Map", Map_test)) ||
         (NULL == CU_add_test(pSuite, "test of ChainedMap", ChainedMap_test)) ||
         (NULL == CU_add_test(pSuite, "test of StrBuilder", StrBuilder_test)) ||
         (NULL == CU_add_test(pSuite, "test of BitArray", BitArray_test)) ||
         (NULL == CU_add_test(pSuite, "test of MultiMap", MultiMap_test)) ||
-        (NULL == CU_add_test(pSuite, "test of Set", Set_test)))
+        (NULL == CU_add_test(pSuite, "test of FrozenMultiMap", FrozenMultiMap_test)) ||
+        (NULL == CU_add_test(pSuite, "test of Postings", Postings_test)) ||
+        (NULL == CU_add_test(pSuite, "test of Set", Set_test)) ||
+        (NULL == CU_add_test(pSuite, "test of SkipList", SkipList_test)))
     {
         CU_cleanup_registry();
         return CU_get_error();
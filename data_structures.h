@@ -1,6 +1,11 @@
 #ifndef __data_structures__
 #define __data_structures__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
 typedef unsigned long uint;
 typedef unsigned char uchar;
 
@@ -26,6 +31,14 @@ typedef struct
     uint size; // number of elements
 } LinkedList;
 
+// Walks a list in either direction. elem is NULL when the cursor is on the
+// "end", between the last element and the first.
+typedef struct
+{
+    LinkedList *list;
+    LinkedListElement *elem;
+} LinkedListCursor;
+
 LinkedList *LinkedList_new();
 void LinkedList_reverse(LinkedList *list);
 void *LinkedList_index(LinkedList *list, int index);
@@ -37,8 +50,285 @@ bool LinkedList_add(LinkedList *list, void *value); // like "push"
 bool LinkedList_enqueue(LinkedList *list, void *value);
 void *LinkedList_pop(LinkedList *list); // like "dequeue"
 int LinkedList_find(LinkedList *list, void *value);
+// Stable and allocation-free; cmp orders values like strcmp
+void LinkedList_sort(LinkedList *list, int (*cmp)(void*,void*));
 void LinkedList_del(LinkedList *list);
 
+// All cursor operations are O(1)
+LinkedListCursor LinkedList_cursor(LinkedList *list); // on the first element
+LinkedListCursor LinkedList_cursor_last(LinkedList *list);
+bool LinkedListCursor_next(LinkedListCursor *cursor); // false once on the end
+bool LinkedListCursor_prev(LinkedListCursor *cursor);
+void *LinkedListCursor_get(LinkedListCursor *cursor);
+void LinkedListCursor_insert_before(LinkedListCursor *cursor, void *value);
+void LinkedListCursor_insert_after(LinkedListCursor *cursor, void *value);
+// Removes the current element and moves on to the next
+void *LinkedListCursor_remove(LinkedListCursor *cursor);
+// Moves the count elements first..last (inclusive) to before the cursor
+void LinkedListCursor_splice(LinkedListCursor *cursor, LinkedListCursor *first,
+                             LinkedListCursor *last, uint count);
+
+////////////////////////////////////////////////////////////////////////////////
+// IntrusiveList
+// A circular doubly-linked list whose links are embedded in the caller's own
+// structs, so that insert and remove never allocate and are O(1) given the
+// object. Use container_of() to get from a link back to its object.
+////////////////////////////////////////////////////////////////////////////////
+
+#define container_of(_link, _type, _member) \
+    ((_type*)((char*)(_link) - offsetof(_type, _member)))
+
+typedef struct ilistLink
+{
+    struct ilistLink *prev, *next; // both NULL while not in a list
+} IntrusiveLink;
+
+typedef struct
+{
+    IntrusiveLink head; // links to the first and last elements
+    uint size; // number of elements
+} IntrusiveList;
+
+void IntrusiveList_init(IntrusiveList *list); // for lists embedded in structs
+IntrusiveList *IntrusiveList_new();
+void IntrusiveList_insert_after(IntrusiveList *list, IntrusiveLink *at,
+                                IntrusiveLink *link);
+void IntrusiveList_insert_before(IntrusiveList *list, IntrusiveLink *at,
+                                 IntrusiveLink *link);
+void IntrusiveList_add(IntrusiveList *list, IntrusiveLink *link); // like "push"
+void IntrusiveList_enqueue(IntrusiveList *list, IntrusiveLink *link);
+IntrusiveLink *IntrusiveList_pop(IntrusiveList *list); // like "dequeue"
+void IntrusiveList_remove(IntrusiveList *list, IntrusiveLink *link);
+// These return NULL at either end of the list
+IntrusiveLink *IntrusiveList_first(IntrusiveList *list);
+IntrusiveLink *IntrusiveList_last(IntrusiveList *list);
+IntrusiveLink *IntrusiveList_next(IntrusiveList *list, IntrusiveLink *link);
+IntrusiveLink *IntrusiveList_prev(IntrusiveList *list, IntrusiveLink *link);
+bool IntrusiveList_linked(IntrusiveLink *link);
+void IntrusiveList_del(IntrusiveList *list);
+
+////////////////////////////////////////////////////////////////////////////////
+// UnrolledList
+// A doubly-linked list where each node holds a cache line worth of values.
+// Nodes split when full and merge when less than half full, so indexing and
+// iteration walk whole chunks while middle insertion stays cheap.
+////////////////////////////////////////////////////////////////////////////////
+
+#define UNROLLED_CHUNK (64 / sizeof(void*)) // values per node
+
+typedef struct unrolledNode
+{
+    struct unrolledNode *prev, *next;
+    uint count; // number of values used in this node
+    void *values[UNROLLED_CHUNK];
+} UnrolledListNode;
+
+typedef struct
+{
+    UnrolledListNode *first, *last;
+    uint size; // number of values
+} UnrolledList;
+
+typedef struct
+{
+    UnrolledListNode *node;
+    uint index;
+} UnrolledListIterator;
+
+UnrolledList *UnrolledList_new();
+void *UnrolledList_index(UnrolledList *list, int index);
+bool UnrolledList_insert(UnrolledList *list, int index, void *value);
+void *UnrolledList_remove(UnrolledList *list, int index);
+bool UnrolledList_add(UnrolledList *list, void *value); // like "push"
+bool UnrolledList_enqueue(UnrolledList *list, void *value);
+void *UnrolledList_pop(UnrolledList *list); // like "dequeue"
+int UnrolledList_find(UnrolledList *list, void *value);
+UnrolledListIterator UnrolledList_iter(UnrolledList *list);
+// Returns the slot of the next value, or NULL when done
+void **UnrolledList_iter_next(UnrolledListIterator *iter);
+void UnrolledList_del(UnrolledList *list);
+
+////////////////////////////////////////////////////////////////////////////////
+// BTreeList
+// A sequence kept in a B+tree whose branches record how many values are under
+// each child. Indexing, insert, remove, split and concat are all O(log n), and
+// the leaves are chained for iteration.
+////////////////////////////////////////////////////////////////////////////////
+
+#define BTREE_LEAF (64 / sizeof(void*)) // values per leaf
+#define BTREE_BRANCH 16 // children per branch
+
+typedef struct btreeLeaf
+{
+    uint count; // number of values used in this leaf
+    struct btreeLeaf *prev, *next;
+    void *values[BTREE_LEAF];
+} BTreeLeaf;
+
+typedef struct
+{
+    uint count; // number of children
+    uint sizes[BTREE_BRANCH]; // number of values under each child
+    void *children[BTREE_BRANCH];
+} BTreeBranch;
+
+typedef struct
+{
+    void *root; // a BTreeLeaf when height is 0, otherwise a BTreeBranch
+    uint height;
+    uint size; // number of values
+} BTreeList;
+
+typedef struct
+{
+    BTreeLeaf *leaf;
+    uint index;
+} BTreeListIterator;
+
+BTreeList *BTreeList_new();
+void *BTreeList_index(BTreeList *list, int index);
+bool BTreeList_insert(BTreeList *list, int index, void *value);
+bool BTreeList_add(BTreeList *list, void *value);
+void *BTreeList_remove(BTreeList *list, int index);
+// Leaves list with the values before index and returns a new list of the rest
+BTreeList *BTreeList_split(BTreeList *list, int index);
+// Moves all of other's values onto the end of list and deletes other
+void BTreeList_concat(BTreeList *list, BTreeList *other);
+BTreeListIterator BTreeList_iter(BTreeList *list, int index);
+// Returns the slot of the next value, or NULL when done
+void **BTreeList_iter_next(BTreeListIterator *iter);
+void BTreeList_del(BTreeList *list);
+
+////////////////////////////////////////////////////////////////////////////////
+// PVector
+// A persistent vector: every version stays valid, and copying one is O(1)
+// because versions share their nodes. Index, add and set are O(log32 n).
+// push() and update() are the transient forms, which change vec itself but
+// copy only nodes shared with other versions, so a batch of changes to one
+// version copies each path once.
+////////////////////////////////////////////////////////////////////////////////
+
+#define PVECTOR_BITS 5
+#define PVECTOR_WIDTH (1 << PVECTOR_BITS) // children or values per node
+
+typedef struct pvectorNode
+{
+    uint refs; // number of versions and nodes referring to this one
+    void *slots[PVECTOR_WIDTH]; // children, or values in leaves
+} PVectorNode;
+
+typedef struct
+{
+    uint size;
+    uint shift; // bits of the index used above the leaves
+    PVectorNode *root;
+    PVectorNode *tail; // the last leaf, kept out of the trie to make add cheap
+} PVector;
+
+PVector *PVector_new();
+PVector *PVector_copy(PVector *vec); // a snapshot
+void *PVector_index(PVector *vec, int index);
+// Return a new version, leaving vec as it was. set() returns NULL when out of
+// bounds. concat() is O(size of b).
+PVector *PVector_add(PVector *vec, void *value);
+PVector *PVector_set(PVector *vec, int index, void *value);
+PVector *PVector_concat(PVector *a, PVector *b);
+void PVector_push(PVector *vec, void *value);
+bool PVector_update(PVector *vec, int index, void *value);
+void PVector_del(PVector *vec); // other versions are unaffected
+
+////////////////////////////////////////////////////////////////////////////////
+// MPMCQueue
+// A bounded lock-free multi-producer multi-consumer ring queue. Enqueue and
+// dequeue never block and return false when the queue is full or empty; the
+// _wait variants sleep on a futex until they can succeed.
+////////////////////////////////////////////////////////////////////////////////
+
+// Threads blocked on a queue sleep on sequence, which changes on every signal
+typedef struct
+{
+    unsigned int sequence; // futex word
+    unsigned int waiters;
+} QueueEvent;
+
+typedef struct
+{
+    uint sequence; // which lap of the ring the cell is ready for
+    void *value;
+} MPMCQueueCell;
+
+typedef struct
+{
+    MPMCQueueCell *cells;
+    uint mask; // capacity - 1, the capacity being a power of 2
+    // producers and consumers each get their own cache line
+    char pad0[64];
+    uint enqueue_pos;
+    char pad1[64];
+    uint dequeue_pos;
+    char pad2[64];
+    QueueEvent not_empty, not_full;
+} MPMCQueue;
+
+MPMCQueue *MPMCQueue_new(uint log2cap);
+bool MPMCQueue_enqueue(MPMCQueue *queue, void *value);
+bool MPMCQueue_dequeue(MPMCQueue *queue, void **value);
+// The batch operations move as many values as they can, up to n, and return
+// how many that was
+uint MPMCQueue_enqueue_batch(MPMCQueue *queue, void **values, uint n);
+uint MPMCQueue_dequeue_batch(MPMCQueue *queue, void **values, uint n);
+void MPMCQueue_enqueue_wait(MPMCQueue *queue, void *value);
+void *MPMCQueue_dequeue_wait(MPMCQueue *queue);
+void MPMCQueue_del(MPMCQueue *queue);
+
+////////////////////////////////////////////////////////////////////////////////
+// SPSCQueue
+// The same interface as MPMCQueue for exactly one producer and one consumer
+// thread, which needs no compare-and-swap.
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+    void **values;
+    uint mask; // capacity - 1, the capacity being a power of 2
+    char pad0[64];
+    uint tail, cached_head; // written by the producer
+    char pad1[64];
+    uint head, cached_tail; // written by the consumer
+    char pad2[64];
+    QueueEvent not_empty, not_full;
+} SPSCQueue;
+
+SPSCQueue *SPSCQueue_new(uint log2cap);
+bool SPSCQueue_enqueue(SPSCQueue *queue, void *value);
+bool SPSCQueue_dequeue(SPSCQueue *queue, void **value);
+uint SPSCQueue_enqueue_batch(SPSCQueue *queue, void **values, uint n);
+uint SPSCQueue_dequeue_batch(SPSCQueue *queue, void **values, uint n);
+void SPSCQueue_enqueue_wait(SPSCQueue *queue, void *value);
+void *SPSCQueue_dequeue_wait(SPSCQueue *queue);
+void SPSCQueue_del(SPSCQueue *queue);
+
+////////////////////////////////////////////////////////////////////////////////
+// ThreadPool
+// A fixed set of threads for running parallel loops, which balance their load
+// by work stealing
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct threadPool ThreadPool; // holds pthread state, so kept opaque
+
+ThreadPool *ThreadPool_new(uint nthreads);
+// A pool with a thread per CPU, created on first use and never deleted
+ThreadPool *ThreadPool_shared();
+uint ThreadPool_size(ThreadPool *pool);
+// Calls fn(arg, begin, end) over ranges covering 0..size and returns once all
+// are done. The calling thread joins in. Ranges are split down to grain while
+// there is room to queue the rest, so some may be bigger. Loops on one pool
+// run one at a time, and one started by fn on the same pool runs inline as
+// fn(arg, 0, size). A NULL pool means the shared pool.
+void ThreadPool_run(ThreadPool *pool, void (*fn)(void*, uint, uint), void *arg,
+                    uint size, uint grain);
+void ThreadPool_del(ThreadPool *pool);
+
 ////////////////////////////////////////////////////////////////////////////////
 // ArrayList
 // A dynamically growing/shrinking array list
@@ -49,6 +339,7 @@ typedef struct
     void **array;
     uint size;     // number of elements contained
     uint cap; // size of the allocated array
+    bool mapped; // whether the array is a memory mapping rather than malloc()ed
 } ArrayList;
 
 ArrayList *ArrayList_new();
@@ -56,16 +347,260 @@ void *ArrayList_index(ArrayList *list, int index);
 // Use growby if you expect to need the additional capacity. Not necessary to
 // use since the list will resize itself as needed.
 void ArrayList_growby(ArrayList *list, int additional_capacity);
+// Make room for at least cap values in all. Large lists are kept in their own
+// memory mapping, which grows without copying and uses transparent huge pages.
+void ArrayList_reserve(ArrayList *list, uint cap);
+void ArrayList_shrink_to_fit(ArrayList *list);
 void ArrayList_add(ArrayList *list, void *item);
 void *ArrayList_pop(ArrayList *list);
 void *ArrayList_remove(ArrayList *list, int index);
 bool ArrayList_insert(ArrayList *list, int index, void *value);
 int ArrayList_find(ArrayList *list, void *value);
 bool ArrayList_has(ArrayList *list, void *value);
+// Index of the first value equal to any of the k values, or -1
+int ArrayList_find_any(ArrayList *list, void **values, uint k);
+uint ArrayList_count(ArrayList *list, void *value); // occurrences of value
 ArrayList *ArrayList_join(ArrayList *listA, ArrayList *listB);
 void ArrayList_reverse(ArrayList *list);
+// Unstable introsort; cmp orders values like strcmp
+void ArrayList_sort(ArrayList *list, int (*cmp)(void*,void*));
+// Sorts a run on each thread of a ThreadPool (the shared pool if pool is
+// NULL), then merges the runs on all of them
+void ArrayList_sort_parallel(ArrayList *list, int (*cmp)(void*,void*),
+                             ThreadPool *pool);
+// Stable radix sort on key(value), or on the values themselves if key is NULL
+void ArrayList_radix_sort(ArrayList *list, uint (*key)(void*));
+// Loops over the values on a ThreadPool, or the shared pool if pool is NULL.
+// Each callback gets arg first.
+void ArrayList_parallel_for(ArrayList *list, void (*fn)(void*, void**),
+                            void *arg, ThreadPool *pool);
+ArrayList *ArrayList_map(ArrayList *list, void *(*fn)(void*, void*),
+                         void *arg, ThreadPool *pool);
+// Keeps the values for which keep() is true, in order
+ArrayList *ArrayList_filter(ArrayList *list, bool (*keep)(void*, void*),
+                            void *arg, ThreadPool *pool);
+// fn must be associative
+void *ArrayList_reduce(ArrayList *list, void *(*fn)(void*, void*, void*),
+                       void *init, void *arg, ThreadPool *pool);
 void ArrayList_del(ArrayList *list);
 
+////////////////////////////////////////////////////////////////////////////////
+// Vec
+// DS_DEFINE_VEC(name, T) defines an ArrayList-like vector type called name that
+// stores values of type T inline, along with its functions name_new(),
+// name_index() and so on. find() compares values bytewise, so structs with
+// padding should be zeroed before being filled in.
+////////////////////////////////////////////////////////////////////////////////
+
+#define DS_DEFINE_VEC(name, T)                                                 \
+typedef struct                                                                 \
+{                                                                              \
+    T *array;                                                                  \
+    uint size; /* number of elements contained */                              \
+    uint cap; /* size of the allocated array */                                \
+} name;                                                                        \
+                                                                               \
+static inline name *name##_new()                                               \
+{                                                                              \
+    name *vec = malloc(sizeof(name));                                          \
+    vec->size = 0;                                                             \
+    vec->cap = 8;                                                              \
+    vec->array = malloc(vec->cap * sizeof(T));                                 \
+    return vec;                                                                \
+}                                                                              \
+                                                                               \
+/* A pointer to the value, valid until the vector next grows */                \
+static inline T *name##_index(name *vec, int index)                            \
+{                                                                              \
+    int size = (int)vec->size;                                                 \
+    if (index < 0)                                                             \
+        index += size;                                                         \
+    if (index < 0 || index >= size) /* check bounds */                         \
+        return NULL;                                                           \
+    return vec->array + index;                                                 \
+}                                                                              \
+                                                                               \
+static inline void name##_growby(name *vec, int additional_cap)                \
+{                                                                              \
+    vec->cap += additional_cap;                                                \
+    vec->array = realloc(vec->array, vec->cap * sizeof(T));                    \
+}                                                                              \
+                                                                               \
+static inline void name##_add(name *vec, T value)                              \
+{                                                                              \
+    if (vec->size >= vec->cap)                                                 \
+        name##_growby(vec, (vec->cap >> 1) + 1);                               \
+    vec->array[vec->size++] = value;                                           \
+}                                                                              \
+                                                                               \
+/* Copies the value out into *value, which may be NULL */                      \
+static inline bool name##_pop(name *vec, T *value)                             \
+{                                                                              \
+    if (vec->size == 0)                                                        \
+        return false;                                                          \
+    vec->size--;                                                               \
+    if (value != NULL)                                                         \
+        *value = vec->array[vec->size];                                        \
+    return true;                                                               \
+}                                                                              \
+                                                                               \
+static inline bool name##_insert(name *vec, int index, T value)                \
+{                                                                              \
+    int size = (int)vec->size;                                                 \
+    if (index == -1 || index == size)                                          \
+    {                                                                          \
+        name##_add(vec, value);                                                \
+        return true;                                                           \
+    }                                                                          \
+    if (index < 0)                                                             \
+        index += size;                                                         \
+    if (index < 0 || index >= size) /* check bounds */                         \
+        return false;                                                          \
+    if (vec->size >= vec->cap)                                                 \
+        name##_growby(vec, (vec->cap >> 1) + 1);                               \
+    T *dest = vec->array + index;                                              \
+    memmove(dest + 1, dest, (vec->size - index) * sizeof(T));                  \
+    *dest = value;                                                             \
+    vec->size++;                                                               \
+    return true;                                                               \
+}                                                                              \
+                                                                               \
+static inline bool name##_remove(name *vec, int index, T *value)               \
+{                                                                              \
+    int size = (int)vec->size;                                                 \
+    if (index < 0)                                                             \
+        index += size;                                                         \
+    if (index < 0 || index >= size) /* check bounds */                         \
+        return false;                                                          \
+    T *dest = vec->array + index;                                              \
+    if (value != NULL)                                                         \
+        *value = *dest;                                                        \
+    memmove(dest, dest + 1, (vec->size - index - 1) * sizeof(T));              \
+    vec->size--;                                                               \
+    return true;                                                               \
+}                                                                              \
+                                                                               \
+static inline int name##_find(name *vec, T value)                              \
+{                                                                              \
+    uint i;                                                                    \
+    for (i = 0; i < vec->size; i++)                                            \
+        if (memcmp(vec->array + i, &value, sizeof(T)) == 0)                    \
+            return i;                                                          \
+    return -1;                                                                 \
+}                                                                              \
+                                                                               \
+static inline bool name##_has(name *vec, T value)                              \
+{                                                                              \
+    return (name##_find(vec, value) == -1)? false : true;                      \
+}                                                                              \
+                                                                               \
+static inline name *name##_join(name *vecA, name *vecB)                        \
+{                                                                              \
+    name *vec = malloc(sizeof(name));                                          \
+    vec->size = vecA->size + vecB->size;                                       \
+    vec->cap = (vec->size > 8)? vec->size : 8;                                 \
+    vec->array = malloc(vec->cap * sizeof(T));                                 \
+    memcpy(vec->array, vecA->array, vecA->size * sizeof(T));                   \
+    memcpy(vec->array + vecA->size, vecB->array, vecB->size * sizeof(T));      \
+    return vec;                                                                \
+}                                                                              \
+                                                                               \
+static inline void name##_reverse(name *vec)                                   \
+{                                                                              \
+    uint i, size = vec->size;                                                  \
+    for (i = 0; i < (size >> 1); i++)                                          \
+    {                                                                          \
+        T value = vec->array[i];                                               \
+        vec->array[i] = vec->array[size - 1 - i];                              \
+        vec->array[size - 1 - i] = value;                                      \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+/* Moves the contents into a new vector, leaving vec empty */                  \
+static inline name *name##_take(name *vec)                                     \
+{                                                                              \
+    name *taken = malloc(sizeof(name));                                        \
+    *taken = *vec;                                                             \
+    vec->size = 0;                                                             \
+    vec->cap = 8;                                                              \
+    vec->array = malloc(vec->cap * sizeof(T));                                 \
+    return taken;                                                              \
+}                                                                              \
+                                                                               \
+/* Frees the vector but not its array, which is returned for the caller to    \
+   free(). *size, if not NULL, gets the number of values. */                   \
+static inline T *name##_release_buffer(name *vec, uint *size)                  \
+{                                                                              \
+    T *array = vec->array;                                                     \
+    if (size != NULL)                                                          \
+        *size = vec->size;                                                     \
+    free(vec);                                                                 \
+    return array;                                                              \
+}                                                                              \
+                                                                               \
+static inline void name##_del(name *vec)                                       \
+{                                                                              \
+    free(vec->array);                                                          \
+    free(vec);                                                                 \
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ArrayDeque
+// A double-ended queue in a circular array whose capacity is a power of 2.
+// Adding and popping at either end and indexing are all O(1).
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+    void **array;
+    uint first; // position of the first value in the array
+    uint size;  // number of values contained
+    uint cap;   // size of the allocated array, a power of 2
+} ArrayDeque;
+
+ArrayDeque *ArrayDeque_new();
+void *ArrayDeque_index(ArrayDeque *deque, int index);
+void ArrayDeque_add(ArrayDeque *deque, void *value); // at the end
+void ArrayDeque_add_first(ArrayDeque *deque, void *value);
+void ArrayDeque_add_all(ArrayDeque *deque, void **values, uint n);
+void *ArrayDeque_pop(ArrayDeque *deque); // from the end
+void *ArrayDeque_pop_first(ArrayDeque *deque);
+void ArrayDeque_del(ArrayDeque *deque);
+
+////////////////////////////////////////////////////////////////////////////////
+// SlotMap
+// Stores values behind handles that stay valid until the value is removed and
+// are recognised as stale afterwards. Insert, remove and lookup are O(1), and
+// the values are kept packed in map->values[0..size) for iteration.
+// A handle holds a slot number in its low 32 bits and that slot's generation
+// in its high 32 bits. 0 is never a valid handle.
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct
+{
+    uint32_t index; // position in values when in use, else the next free slot
+    uint32_t generation; // odd when in use
+} SlotMapSlot;
+
+typedef struct
+{
+    void **values; // packed
+    uint32_t *owners; // the slot of each value
+    uint size, cap;
+    SlotMapSlot *slots;
+    uint nslots;
+    uint32_t free; // first free slot
+} SlotMap;
+
+SlotMap *SlotMap_new();
+uint SlotMap_insert(SlotMap *map, void *value); // returns a handle
+bool SlotMap_has(SlotMap *map, uint handle);
+void *SlotMap_get(SlotMap *map, uint handle);
+bool SlotMap_set(SlotMap *map, uint handle, void *value);
+uint SlotMap_handle_at(SlotMap *map, uint index); // handle of values[index]
+void *SlotMap_remove(SlotMap *map, uint handle);
+void SlotMap_del(SlotMap *map);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Map
 // An incrementally resizing hashtable map with open addressing
@@ -82,6 +617,7 @@ typedef struct
     bool (*comp)(void*, void*); // algorithm used to compare keys
     uint indexA;       // keeps track of how far we are in moving items from tableA
     uint sizeA, sizeB; // number of buckets occupied
+    uint deletedB; // deleted markers left in tableB, which count towards its load
     uint log2capA, log2capB; // capacity: actual size of tables as a power of 2
     MapBucket *tableA, *tableB; // "old" table and "new" table
 } Map;
@@ -143,32 +679,108 @@ void ChainedMap_del(ChainedMap *map);
 ////////////////////////////////////////////////////////////////////////////////
 // MultiMap
 // Like Map, but each key can have 1 or more values (instead of just 1).
-// Uses an open addressing scheme with linear probing. This is essentially just
-// the Map data type with different semantics.
+// Uses an open addressing scheme with linear probing, sharing Map's probing
+// machinery. The first few values of a key live inline next to the key and
+// larger groups spill into a growable array, so values are read as a span.
+// Each (key, value) pair is stored at most once. Keys with many values also get
+// a hash index of their values, so pair lookup and removal stay O(1); such keys
+// do not preserve the order of their values, and their values may not be NULL.
 ////////////////////////////////////////////////////////////////////////////////
 
-typedef Map MultiMap;
+#define MULTIMAP_INLINE 3 // number of values stored inside a bucket
+#define MULTIMAP_PROMOTE 64 // index a key's values once it has more than this
+#define MULTIMAP_DEMOTE 16 // drop the index once there are fewer than this
+
+typedef struct
+{
+    void *key;
+    uint size; // number of values for this key
+    uint cap;  // capacity of values.large, or 0 while the values are inline
+    Map *index; // value -> position + 1, only for keys with many values
+    union
+    {
+        void *small[MULTIMAP_INLINE];
+        void **large;
+    } values;
+} MultiMapBucket;
+
+typedef struct
+{
+    uint (*hash)(void*); // algorithm used to hash keys
+    bool (*comp)(void*, void*); // algorithm used to compare keys
+    uint indexA;       // keeps track of how far we are in moving items from tableA
+    uint sizeA, sizeB; // number of buckets occupied
+    uint deletedB; // deleted markers left in tableB, which count towards its load
+    uint log2capA, log2capB; // capacity: actual size of tables as a power of 2
+    MultiMapBucket *tableA, *tableB; // "old" table and "new" table
+} MultiMap;
+
+// The values of one key, contiguous in memory. Only valid until the MultiMap is
+// next modified. A missing key gives a span of size 0.
+typedef struct
+{
+    void **values;
+    uint size;
+} MultiMapSpan;
 
 MultiMap *MultiMap_new(uint (*hash)(void*), bool (*comp)(void*,void*));
 MultiMap *MultiMap_new_sized(uint log2size, uint (*hash)(void*), bool (*comp)(void*,void*));
 bool MultiMap_has(MultiMap *map, void *key);
 bool MultiMap_has_pair(MultiMap *map, void *key, void *value);
-LinkedList *MultiMap_get(MultiMap *map, void *key);
+MultiMapSpan MultiMap_get(MultiMap *map, void *key);
 bool MultiMap_remove_key(MultiMap *map, void *key);
-LinkedList *MultiMap_remove(MultiMap *map, void *key, void *value);
-LinkedList *MultiMap_add(MultiMap *map, void *key, void *value);
+MultiMapSpan MultiMap_remove(MultiMap *map, void *key, void *value);
+MultiMapSpan MultiMap_add(MultiMap *map, void *key, void *value);
 void MultiMap_del(MultiMap *map);
 
+// A read-only MultiMap built in one go from arrays of keys and values, stored
+// as CSR: the values of the key keys[k] are values[offsets[k]..offsets[k+1]).
+// Pairs are kept as given, including duplicates, in their original order.
+typedef struct
+{
+    uint (*hash)(void*); // algorithm used to hash keys
+    bool (*comp)(void*, void*); // algorithm used to compare keys
+    uint size, nkeys;    // number of values and of distinct keys
+    uint log2parts;      // keys are hash partitioned into 2^log2parts regions
+    uint log2region;     // size of each region of slots as a power of 2
+    void **keys;
+    uint *offsets;       // nkeys + 1 entries
+    void **values;
+    uint *slots;         // key number + 1 for each hash slot, 0 marks empty
+    uchar *postings;     // compressed lists replacing values, or NULL
+} FrozenMultiMap;
+
+// The pairs are partitioned by hash and grouped by key on a ThreadPool, or
+// the shared pool if pool is NULL
+FrozenMultiMap *MultiMap_build_frozen(void **keys, void **values, uint n,
+                                      uint (*hash)(void*),
+                                      bool (*comp)(void*,void*),
+                                      ThreadPool *pool);
+bool FrozenMultiMap_has(FrozenMultiMap *map, void *key);
+MultiMapSpan FrozenMultiMap_get(FrozenMultiMap *map, void *key);
+void FrozenMultiMap_del(FrozenMultiMap *map);
+
+// Posting list mode, for inverted indexes: the values are integers below 2^32
+// (such as document numbers) cast to pointers. Each key's values are sorted,
+// deduplicated and stored delta+varint compressed, and offsets[k] is the byte
+// offset of key k's list in postings. FrozenMultiMap_get is not available.
+FrozenMultiMap *MultiMap_build_postings(void **keys, void **values, uint n,
+                                        uint (*hash)(void*),
+                                        bool (*comp)(void*,void*),
+                                        ThreadPool *pool);
+uint FrozenMultiMap_count(FrozenMultiMap *map, void *key);
+ArrayList *FrozenMultiMap_decode(FrozenMultiMap *map, void *key);
+// The sorted values common to all k keys
+ArrayList *MultiMap_intersect_keys(FrozenMultiMap *map, void **keys, uint k);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Set
-// A set type implemented by hash table
+// A set type implemented by an incrementally resizing hashtable with open
+// addressing
 ////////////////////////////////////////////////////////////////////////////////
 
-typedef struct setBucket
-{
-    void *value;
-    struct setBucket *next;
-} SetBucket;
+// Uses the same open addressing machinery as Map, but each slot stores only the
+// value itself, so no per-element allocation is needed.
 
 typedef struct
 {
@@ -176,22 +788,23 @@ typedef struct
     bool (*comp)(void*, void*); // algorithm used to compare keys
     uint indexA;       // keeps track of how far we are in moving items from tableA
     uint sizeA, sizeB; // number of buckets occupied
+    uint deletedB; // deleted markers left in tableB, which count towards its load
     uint log2capA, log2capB; // capacity: actual size of tables as a power of 2
-    SetBucket *tableA, *tableB; // "old" table and "new" table
+    void **tableA, **tableB; // "old" table and "new" table, NULL marks empty
 } Set;
 
 typedef struct
 {
     Set *set;
     bool tableA; // start with tableB (false) and work to tableA (true)
-    uint bucket_index;
-    uint chain_index;
+    uint index;
 } SetIterator;
 
 Set *Set_new(uint (*hash)(void*), bool (*comp)(void*,void*));
 Set *Set_new_sized(uint log2size, uint (*hash)(void*), bool (*comp)(void*,void*));
+uint Set_size(Set *set);
 SetIterator Set_iter(Set *set);
-void *Set_iter_next(SetIterator iter);
+void *Set_iter_next(SetIterator *iter); // returns NULL when done
 bool Set_has(Set *set, void *value);
 void Set_remove(Set *set, void *value);
 void Set_add(Set *set, void *value);
@@ -203,28 +816,160 @@ Set *Set_intersection(Set *set1, Set *set2);
 Set *Set_union(Set *set1, Set *set2);
 Set *Set_difference(Set *set1, Set *set2);
 Set *Set_symdifference(Set *set1, Set *set2);
+Set *Set_copy(Set *set);
 void Set_del(Set *set);
 
+////////////////////////////////////////////////////////////////////////////////
+// SkipList
+// An ordered map implemented by a skip list. Each link records how many nodes
+// it spans, so finding a key's rank or the node at a rank is O(log n) as well.
+// Nodes are allocated from per-level pools.
+////////////////////////////////////////////////////////////////////////////////
+
+#define SKIPLIST_MAXLEVEL 32
+
+typedef struct skipListLink
+{
+    struct skipListNode *next;
+    uint span; // number of nodes moved over by following this link
+} SkipListLink;
+
+typedef struct skipListNode
+{
+    void *key, *value;
+    uint level; // number of links
+    SkipListLink links[];
+} SkipListNode;
+
+typedef struct
+{
+    int (*cmp)(void*, void*); // orders keys, like strcmp
+    uint size, level;
+    uint seed; // for choosing node levels
+    SkipListNode *head;
+    SkipListNode *free[SKIPLIST_MAXLEVEL]; // unused nodes of each level
+    void *slabs; // pool allocations, linked through their first word
+} SkipList;
+
+int stringorder(void *str1, void *str2);
+int ptrorder(void *ptr1, void *ptr2);
+
+SkipList *SkipList_new(int (*cmp)(void*,void*));
+bool SkipList_has(SkipList *list, void *key);
+void *SkipList_get(SkipList *list, void *key);
+void *SkipList_set(SkipList *list, void *key, void *value);
+void *SkipList_remove(SkipList *list, void *key);
+// The number of keys less than key
+uint SkipList_rank(SkipList *list, void *key);
+// The node of the given rank, with negative indices counting from the end
+SkipListNode *SkipList_index(SkipList *list, int index);
+// For range scans: the first node whose key is not less than key, then next()
+// until the end of the range or NULL
+SkipListNode *SkipList_ceiling(SkipList *list, void *key);
+SkipListNode *SkipList_next(SkipListNode *node);
+void SkipList_del(SkipList *list);
+
 ////////////////////////////////////////////////////////////////////////////////
 // StrBuilder
 // Useful for building lengths of string
 ////////////////////////////////////////////////////////////////////////////////
 
+#define STRBUILDER_BLOCK 65536 // bytes per block in chunked mode
+#define STRBUILDER_BORROW 512 // shorter strings are copied rather than borrowed
+#define STRBUILDER_IOV 1024 // slices gathered per writev() call
+#define STRBUILDER_SMALL 64 // bytes kept inside the struct before spilling
+#define STRBUILDER_SINK_MIN 64 // smallest buffer for a sink
+
+typedef struct
+{
+    char *data;
+    uint size;
+    bool borrowed; // owned by the caller rather than the builder
+} StrSlice;
+
+// A bump allocator shared by many builders. Everything it handed out is freed
+// at once by reset(), e.g. at the end of each request.
+typedef struct
+{
+    char *blocks; // the newest block, which links to the one before
+    char *top, *end; // free space in the newest block
+    uint blocksize;
+} StrArena;
+
+StrArena *StrArena_new(uint blocksize);
+char *StrArena_alloc(StrArena *arena, uint size);
+// Grows the newest allocation in place when it can, otherwise moves p
+char *StrArena_realloc(StrArena *arena, char *p, uint size, uint newsize);
+void StrArena_reset(StrArena *arena);
+void StrArena_del(StrArena *arena);
+
+typedef struct strSink StrSink;
+
+// In chunked mode the string is the slices in order, and s and cap are the
+// write position and room left in the current block. Growing never copies.
 typedef struct
 {
     uint size, cap;
     char *s;
+    StrSlice *slices; // NULL unless chunked
+    uint nslices, slicecap;
+    char *blocks; // each block starts with a pointer to the one before
+    StrArena *arena; // where the buffer grows instead of the heap, or NULL
+    StrSink *sink; // the file descriptor being streamed to, or NULL
+    char small[STRBUILDER_SMALL]; // the buffer until it outgrows it
 } StrBuilder;
 
+// For builders on the stack or embedded in structs, which must not be copied.
+// Nothing is allocated until the string outgrows the small buffer.
+void StrBuilder_init(StrBuilder *sb);
+// The buffer comes from arena and is never freed by the builder
+void StrBuilder_init_arena(StrBuilder *sb, StrArena *arena);
+// Frees what an init()ed builder owns, but not the builder itself
+void StrBuilder_release(StrBuilder *sb);
+
 StrBuilder *StrBuilder_new(char *initial);
+StrBuilder *StrBuilder_new_chunked();
 void StrBuilder_del(StrBuilder *sb);
 void StrBuilder_appendN(StrBuilder *sb, char *s, uint len);
 void StrBuilder_append(StrBuilder *sb, char *s);
 void StrBuilder_appendC(StrBuilder *sb, char c);
+// Chunked builders keep a reference to s instead of copying it, unless it is
+// short. s must stay unchanged until the builder is flushed or deleted.
+void StrBuilder_append_borrowed(StrBuilder *sb, char *s, uint len);
+void StrBuilder_append_int(StrBuilder *sb, long v);
+void StrBuilder_append_uint(StrBuilder *sb, uint v);
+// Lowercase and without a 0x prefix
+void StrBuilder_append_hex(StrBuilder *sb, uint v);
+// The shortest digits that read back as v, e.g. 0.1, 1e+21, 1.25e-7
+void StrBuilder_append_double(StrBuilder *sb, double v);
+// A restricted printf without width or precision: %d %i %u %x (each may take
+// an l), %g (as append_double()), %s %c and %%
+void StrBuilder_appendf(StrBuilder *sb, char *format, ...);
+// s escaped for the inside of a JSON string, without the surrounding quotes
+void StrBuilder_append_json_escaped(StrBuilder *sb, char *s, uint len);
+// s as one CSV field, quoted if it has commas, quotes or control characters
+void StrBuilder_append_csv_field(StrBuilder *sb, char *s, uint len);
 // join() will change the first strbuilder and not affect the other
 void StrBuilder_join(StrBuilder *sb1, StrBuilder *sb2);
 // tostring() frees the StrBuilder and returns a string
 char *StrBuilder_tostring(StrBuilder *sb);
+// The string NUL terminated in place, owned by the builder (or its arena) and
+// valid until it is changed. Not for chunked builders.
+char *StrBuilder_cstr(StrBuilder *sb);
+// Sink builders stream everything appended to fd. Each full buffer of
+// bufsize bytes (at least STRBUILDER_SINK_MIN) goes to a writer thread while
+// appends carry on in a second one, so memory stays at two buffers. Appends
+// wait only when the writer has fallen a whole buffer behind. Use just the
+// append functions, flush() and close() (or del()).
+StrBuilder *StrBuilder_new_sink(int fd, uint bufsize);
+// Waits until everything appended so far is written. Returns false if any
+// write failed, after which output is dropped.
+bool StrBuilder_flush(StrBuilder *sb);
+// Flushes, stops the writer and frees the builder, but doesn't close fd
+bool StrBuilder_close(StrBuilder *sb);
+// Writes the whole string to fd with as few system calls as possible, then
+// empties the builder. Returns false on a write error.
+bool StrBuilder_writev(StrBuilder *sb, int fd);
 
 ////////////////////////////////////////////////////////////////////////////////
 // BitArray2D